@@ -34,11 +34,46 @@ from requests.auth import AuthBase
 import maprsecurity
 import security_pb2
 import base64
+import threading
+import time
 
 CONF_FILE = '/opt/mapr/conf/mapr-clusters.conf'
+SERVER_KEY_TYPE = 1  # ServerKeyType.ServerKey in security.proto
+
+# Prebuilt requests are only used while fresh, so that a renewed ticket
+# is picked up by connections opened later on.
+PREBUILT_REQUEST_TTL = 60
+_prebuilt_requests = []
+_prebuilt_lock = threading.Lock()
+
 def get_cluster_name():
     return open(CONF_FILE, 'r').read().split()[0]
 
+def prebuild_auth_requests(count):
+    """
+    Builds count handshake requests in a single native call, to be used
+    by the next count MaprSasl handshakes. Meant for connection pool
+    warm-up.
+    """
+    auth_requests = maprsecurity.BuildAuthenticationReqFullBatch(get_cluster_name(), SERVER_KEY_TYPE, count)
+    expires = time.time() + PREBUILT_REQUEST_TTL
+    _prebuilt_lock.acquire()
+    try:
+        _prebuilt_requests.extend((expires, request) for request in auth_requests)
+    finally:
+        _prebuilt_lock.release()
+
+def _next_auth_request():
+    _prebuilt_lock.acquire()
+    try:
+        # Newest requests are at the end; if that one is stale, all are.
+        if _prebuilt_requests and _prebuilt_requests[-1][0] > time.time():
+            return _prebuilt_requests.pop()[1]
+        del _prebuilt_requests[:]
+    finally:
+        _prebuilt_lock.release()
+    return maprsecurity.BuildAuthenticationReqFull(get_cluster_name(), SERVER_KEY_TYPE)
+
 class MaprSasl(object):
 
     def __init__(self):
@@ -51,20 +86,7 @@ class MaprSasl(object):
         pass
 
     def get_init_response(self):
-        serverKeyBytes = maprsecurity.GetTicketAndKeyForClusterInternal(get_cluster_name(), 1)
-        tk = security_pb2.TicketAndKey()
-        tk.ParseFromString(serverKeyBytes)
-
-        self.randomNumber = maprsecurity.GenerateRandomNumber()
-        import struct
-        encr = maprsecurity.Encrypt(tk.userKey.key, struct.pack('l', self.randomNumber)[::-1])
-        if (self.randomNumber < 0): self.randomNumber += (1 << 64)
-        auth = security_pb2.AuthenticationReqFull()
-        auth.encryptedRandomSecret = encr
-        auth.encryptedTicket = tk.encryptedTicket
-
-        authRequestBytes = base64.b64encode(auth.SerializeToString())
-        self.tk = tk
+        authRequestBytes, self.randomNumber, self.userKey = _next_auth_request()
         return authRequestBytes
 
     def start(self, mechanism):
@@ -84,7 +106,7 @@ class MaprSasl(object):
     def step(self, payload):
         token = payload
         challenge = base64.b64decode(token)
-        decodedResponse = maprsecurity.Decrypt(self.tk.userKey.key, challenge)
+        decodedResponse = maprsecurity.Decrypt(self.userKey, challenge)
         authResponse = security_pb2.AuthenticationResp()
         authResponse.ParseFromString(decodedResponse)
         result = authResponse.challengeResponse == self.randomNumber
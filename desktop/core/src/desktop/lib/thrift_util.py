@@ -176,6 +176,9 @@ class ConnectionPooler(object):
       self.dictlock.acquire()
       try:
         if _get_pool_key(conf) not in self.pooldict:
+          if conf.use_sasl and conf.mechanism == 'MAPR-SECURITY':
+            # Build the handshakes of the whole pool in one native call.
+            maprsasl.prebuild_auth_requests(self.poolsize)
           q = LifoQueue(self.poolsize)
           self.pooldict[_get_pool_key(conf)] = q
           for i in xrange(self.poolsize):
@@ -0,0 +1,241 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+// Block codec benchmark.
+//
+// Splits each corpus file into CompressChunkSize blocks and runs every
+// codec over them, printing the ratio, compress and decompress MB/s and
+// the number of blocks that would be stored uncompressed (less than
+// MinCompressSavings). ZSTD is run twice, the second time with a
+// dictionary trained on every other block of the same corpus.
+//
+//   g++ -O2 -Iinclude -o bench_compression bench_compression.cc -lMapRClient -lzstd
+//   ./bench_compression [seconds-per-run] corpus...
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "common/compressor.h"
+#include "common/lzf.h"
+#include "common/lz4compressor.h"
+#include "common/zlibcompressor.h"
+#include "common/zstdcompressor.h"
+
+using namespace mapr::fs;
+
+namespace {
+
+const size_t DictSize = 16 * 1024;
+
+struct Codec {
+  const char       *name;
+  BaseCompressor   *compressor;
+  bool             useDict;
+};
+
+struct Block {
+  const uint8_t    *data;
+  unsigned int     len;
+  uint8_t          cbuf[CompressChunkSize + 1024];
+  uint16_t         clen;
+};
+
+double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+bool ReadFile(const char *path, std::vector<uint8_t> *buf) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  uint8_t tmp[64 * 1024];
+  size_t n;
+  while ((n = fread(tmp, 1, sizeof(tmp), f)) > 0) {
+    buf->insert(buf->end(), tmp, tmp + n);
+  }
+  fclose(f);
+  return true;
+}
+
+int TrainDict(std::vector<Block> &blocks, std::vector<uint8_t> *dict) {
+  std::vector<uint8_t> samples;
+  std::vector<size_t> lens;
+  for (size_t i = 0; i < blocks.size(); i += 2) {
+    samples.insert(samples.end(), blocks[i].data,
+                   blocks[i].data + blocks[i].len);
+    lens.push_back(blocks[i].len);
+  }
+
+  size_t dictLen = 0;
+  dict->resize(DictSize);
+  int err = ZSTDCompressor::TrainDictionary(&samples[0], &lens[0],
+                                            lens.size(), &(*dict)[0],
+                                            DictSize, &dictLen);
+  if (!err) {
+    dict->resize(dictLen);
+    err = ZSTDCompressor::SetDictionary(&(*dict)[0], dictLen,
+                                        ZSTDCompressor::DefaultLevel);
+  }
+  return err;
+}
+
+// runs fn over all blocks until at least seconds have passed, returns MB/s
+template <typename Fn>
+double TimeBlocks(std::vector<Block> &blocks, size_t bytes, double seconds,
+                  Fn fn, int *err) {
+  int rounds = 0;
+  double start = Now();
+  double elapsed;
+  do {
+    for (size_t i = 0; i < blocks.size() && !*err; ++i) {
+      *err = fn(&blocks[i]);
+    }
+    ++rounds;
+    elapsed = Now() - start;
+  } while (!*err && elapsed < seconds);
+  return (double) bytes * rounds / elapsed / (1 << 20);
+}
+
+struct CompressFn {
+  BaseCompressor *c;
+  CompressorScratchMem *scratch;
+  int operator()(Block *b) {
+    struct iovec ovec;
+    ovec.iov_base = b->cbuf;
+    ovec.iov_len = sizeof(b->cbuf);
+    uint32_t crc = 0;
+    b->clen = 0;
+    return c->Compress(b->data, b->len, &ovec, 1, &b->clen, &crc, scratch);
+  }
+};
+
+struct DecompressFn {
+  BaseCompressor *c;
+  CompressorScratchMem *scratch;
+  uint8_t *out;
+  int operator()(Block *b) {
+    if (b->clen == 0) {
+      return 0;  // stored as is
+    }
+    struct iovec ivec;
+    ivec.iov_base = b->cbuf;
+    ivec.iov_len = b->clen;
+    int err = c->Decompress(&ivec, 1, out, b->len, scratch);
+    if (!err && memcmp(out, b->data, b->len) != 0) {
+      err = EIO;
+    }
+    return err;
+  }
+};
+
+void RunCorpus(const char *path, double seconds, const Codec *codecs,
+               int numCodecs, CompressorScratchMem *scratch) {
+  std::vector<uint8_t> data;
+  if (!ReadFile(path, &data) || data.empty()) {
+    return;
+  }
+
+  std::vector<Block> blocks((data.size() + CompressChunkSize - 1) /
+                            CompressChunkSize);
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    size_t off = i * CompressChunkSize;
+    blocks[i].data = &data[off];
+    blocks[i].len = MIN((size_t) CompressChunkSize, data.size() - off);
+  }
+
+  std::vector<uint8_t> dict;
+  uint8_t out[CompressChunkSize];
+
+  for (int c = 0; c < numCodecs; ++c) {
+    if (codecs[c].useDict && dict.empty()) {
+      int err = TrainDict(blocks, &dict);
+      if (err) {
+        printf("%-24s %-10s dictionary training failed: %s\n",
+               path, codecs[c].name, strerror(err));
+        continue;
+      }
+    }
+
+    int err = 0;
+    CompressFn cf = { codecs[c].compressor, scratch };
+    double cmbs = TimeBlocks(blocks, data.size(), seconds, cf, &err);
+    if (err) {
+      printf("%-24s %-10s compress failed: %s\n",
+             path, codecs[c].name, strerror(err));
+      continue;
+    }
+
+    uint64_t stored = 0;
+    int raw = 0;
+    for (size_t i = 0; i < blocks.size(); ++i) {
+      Block *b = &blocks[i];
+      if (b->clen == 0 ||
+          b->clen > BaseCompressor::MinCompressSavings(b->len)) {
+        b->clen = 0;
+        stored += b->len;
+        ++raw;
+      } else {
+        stored += b->clen;
+      }
+    }
+
+    DecompressFn df = { codecs[c].compressor, scratch, out };
+    double dmbs = TimeBlocks(blocks, data.size(), seconds, df, &err);
+    if (err) {
+      printf("%-24s %-10s decompress failed: %s\n",
+             path, codecs[c].name, strerror(err));
+      continue;
+    }
+
+    printf("%-24s %-10s %7.3f %10.1f %10.1f %8d/%zu\n",
+           path, codecs[c].name, (double) data.size() / stored,
+           cmbs, dmbs, raw, blocks.size());
+  }
+  ZSTDCompressor::ClearDictionary();
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  double seconds = 2.0;
+  int first = 1;
+  if (argc > 1 && strtod(argv[1], NULL) > 0) {
+    seconds = strtod(argv[1], NULL);
+    first = 2;
+  }
+  if (first >= argc) {
+    fprintf(stderr, "usage: %s [seconds-per-run] corpus...\n", argv[0]);
+    return 1;
+  }
+
+  LZF lzf;
+  LZ4Compressor lz4;
+  ZLIBCompressor zlib;
+  ZSTDCompressor zstd;
+  const Codec codecs[] = {
+    { "lzf",       &lzf,  false },
+    { "lz4",       &lz4,  false },
+    { "zlib",      &zlib, false },
+    { "zstd",      &zstd, false },
+    { "zstd+dict", &zstd, true },
+  };
+  const int numCodecs = sizeof(codecs) / sizeof(codecs[0]);
+
+  // sized by this tree's CompressorScratchMem, not the library's
+  CompressorScratchMem *scratch = new CompressorScratchMem;
+
+  printf("%-24s %-10s %7s %10s %10s %14s\n", "corpus", "codec", "ratio",
+         "comp MB/s", "decomp MB/s", "raw/blocks");
+  for (int i = first; i < argc; ++i) {
+    RunCorpus(argv[i], seconds, codecs, numCodecs, scratch);
+  }
+  delete scratch;
+  return 0;
+}
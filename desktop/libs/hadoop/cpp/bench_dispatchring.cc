@@ -0,0 +1,283 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+// Cross-queue handoff benchmark: GlobalDispatch::ExecuteBatch against
+// DispatchRings::ExecuteBatch.
+//
+// First checks ordering on the DBMain queue, given a ring of only
+// CheckSlots so that most batches overflow: CheckProducers threads each
+// hand over CheckItems WAs in batches of 1 to 37, and every WA must run
+// once, after all the WAs its producer queued before it.
+//
+// Then a number of producer threads keep handing batches of empty callbacks
+// to the FS queue, whose dispatch thread runs them, with at most Window
+// WAs of each producer in flight. Prints callbacks run per second
+// through each path, for a range of batch sizes, and how many WAs did
+// not fit the ring.
+//
+//   g++ -O2 -Iinclude -o bench_dispatchring bench_dispatchring.cc -lMapRClient -lpthread
+//   ./bench_dispatchring [seconds-per-run] [producers]
+
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rpc/dispatch.h"
+#include "rpc/dispatchring.h"
+
+using namespace mapr::fs;
+
+namespace {
+
+const int Target = GlobalDispatch::CpuQ_FS;
+const int Window = 1024;
+const int MaxProducers = 16;
+
+const int CheckTarget = GlobalDispatch::CpuQ_DBMain;
+const int CheckSlots = 64;
+const int CheckProducers = 6;
+const int CheckItems = 200000;
+
+struct Producer;
+
+struct Item {
+  GlobalDispatchWA      wa;
+  volatile int          busy;
+  Producer              *p;
+};
+
+struct Producer {
+  Item                  items[Window];
+  volatile uint64_t     done;       // written by the FS queue only
+  pthread_t             thread;
+  char                  pad[64];
+};
+
+Producer *producers;
+int numProducers;
+int batchSize;
+volatile bool useRing;
+volatile bool stop;
+
+uint64_t NowNsecs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct CheckItem {
+  GlobalDispatchWA      wa;
+  int                   producer;
+  int                   seq;
+};
+
+// written by the DBMain queue only
+int checkLast[CheckProducers];
+uint64_t checkBad;
+volatile uint64_t checkDone;
+
+void Work(void *arg, int /* err */) {
+  Item *it = (Item *) arg;
+  ++it->p->done;
+  atomic_barrier();
+  it->busy = 0;
+}
+
+void *Produce(void *arg) {
+  Producer *p = (Producer *) arg;
+  int next = 0;
+  while (!stop) {
+    GlobalDispatchWA *h = NULL;
+    GlobalDispatchWA *t = NULL;
+    for (int k = 0; k < batchSize; ++k) {
+      Item *it = &p->items[next];
+      while (it->busy && !stop) {
+        sched_yield();
+      }
+      if (stop) {
+        break;
+      }
+      it->busy = 1;
+      GlobalDispatch::AppendBatch(&h, &t, Work, it, 0, 0, &it->wa);
+      next = (next + 1) % Window;
+    }
+    if (!h) {
+      break;
+    }
+    t->next = NULL;
+    if (useRing) {
+      DispatchRings::Instance().ExecuteBatch(Target, h, t);
+    } else {
+      g_Dispatch.ExecuteBatch(Target, h, t);
+    }
+  }
+  return NULL;
+}
+
+void *Consume(void *arg) {
+  GlobalDispatch::SetMyCpuQid((int) (intptr_t) arg);
+  g_Dispatch.Dispatch(true);
+  return NULL;
+}
+
+void CheckWork(void *arg, int /* err */) {
+  CheckItem *it = (CheckItem *) arg;
+  if (it->seq != checkLast[it->producer] + 1) {
+    ++checkBad;
+  }
+  checkLast[it->producer] = it->seq;
+  atomic_store_release64(&checkDone, checkDone + 1);
+}
+
+void *CheckProduce(void *arg) {
+  int p = (int) (intptr_t) arg;
+  CheckItem *items = new CheckItem[CheckItems];
+  int i = 0;
+  while (i < CheckItems) {
+    GlobalDispatchWA *h = NULL;
+    GlobalDispatchWA *t = NULL;
+    int n = 1 + i % 37;
+    for (int k = 0; k < n && i < CheckItems; ++k, ++i) {
+      items[i].producer = p;
+      items[i].seq = i;
+      GlobalDispatch::AppendBatch(&h, &t, CheckWork, &items[i], 0, 0,
+                                  &items[i].wa);
+    }
+    t->next = NULL;
+    DispatchRings::Instance().ExecuteBatch(CheckTarget, h, t);
+    if (i % 4096 < n) {
+      // let the consumer catch up, so the ring is used as well
+      usleep(10 * 1000);
+    }
+  }
+  // the WAs may still be queued, so the items are left to the process
+  return NULL;
+}
+
+// true when every WA ran once and in its producer's order
+bool CheckOrder() {
+  int err = DispatchRings::Instance().Enable(CheckTarget, CheckSlots);
+  if (err) {
+    fprintf(stderr, "cannot enable the check ring: %s\n", strerror(err));
+    return false;
+  }
+  for (int p = 0; p < CheckProducers; ++p) {
+    checkLast[p] = -1;
+  }
+  pthread_t consumer;
+  pthread_create(&consumer, NULL, Consume, (void *) (intptr_t) CheckTarget);
+  pthread_t threads[CheckProducers];
+  for (int p = 0; p < CheckProducers; ++p) {
+    pthread_create(&threads[p], NULL, CheckProduce, (void *) (intptr_t) p);
+  }
+  for (int p = 0; p < CheckProducers; ++p) {
+    pthread_join(threads[p], NULL);
+  }
+  const uint64_t total = (uint64_t) CheckProducers * CheckItems;
+  for (int k = 0; k < 2000 && checkDone < total; ++k) {
+    usleep(10 * 1000);
+  }
+  DispatchRings::QueueStats s;
+  DispatchRings::Instance().GetStats(CheckTarget, &s);
+  uint64_t done = atomic_load_acquire64(&checkDone);
+  printf("order check: %llu of %llu ran, %llu out of order, %llu through "
+         "the ring, %llu overflowed\n", (unsigned long long) done,
+         (unsigned long long) total, (unsigned long long) checkBad,
+         (unsigned long long) s.published,
+         (unsigned long long) s.overflowed);
+  return done == total && checkBad == 0;
+}
+
+uint64_t Done() {
+  uint64_t n = 0;
+  for (int i = 0; i < numProducers; ++i) {
+    n += producers[i].done;
+  }
+  return n;
+}
+
+// callbacks per second through one path
+double Run(bool ring, double seconds) {
+  useRing = ring;
+  stop = false;
+  for (int i = 0; i < numProducers; ++i) {
+    pthread_create(&producers[i].thread, NULL, Produce, &producers[i]);
+  }
+  usleep(100 * 1000);  // warm up
+  uint64_t n0 = Done();
+  uint64_t t0 = NowNsecs();
+  usleep((useconds_t) (seconds * 1e6));
+  uint64_t n1 = Done();
+  uint64_t t1 = NowNsecs();
+  stop = true;
+  for (int i = 0; i < numProducers; ++i) {
+    pthread_join(producers[i].thread, NULL);
+  }
+  // let what is in flight finish before the next run reuses it
+  for (int i = 0; i < numProducers; ++i) {
+    for (int k = 0; k < Window; ++k) {
+      while (producers[i].items[k].busy) {
+        usleep(100);
+      }
+    }
+  }
+  return (n1 - n0) * 1e9 / (t1 - t0);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  double seconds = argc > 1 ? strtod(argv[1], NULL) : 1.0;
+  numProducers = argc > 2 ? atoi(argv[2]) : 4;
+  if (numProducers < 1 || numProducers > MaxProducers) {
+    fprintf(stderr, "producers must be 1 to %d\n", MaxProducers);
+    return 1;
+  }
+  static const int batches[] = { 1, 4, 16, 64 };
+  const int numBatches = sizeof(batches) / sizeof(batches[0]);
+
+  producers = new Producer[numProducers];
+  memset((void *) producers, 0, numProducers * sizeof(Producer));
+  for (int i = 0; i < numProducers; ++i) {
+    for (int k = 0; k < Window; ++k) {
+      producers[i].items[k].p = &producers[i];
+    }
+  }
+
+  if (!CheckOrder()) {
+    fprintf(stderr, "order check FAILED\n");
+    fflush(stdout);
+    _exit(1);
+  }
+
+  int err = DispatchRings::Instance().Enable(Target);
+  if (err) {
+    fprintf(stderr, "cannot enable the ring: %s\n", strerror(err));
+    return 1;
+  }
+  pthread_t consumer;
+  pthread_create(&consumer, NULL, Consume, (void *) (intptr_t) Target);
+
+  printf("%d producers, %.1fs per run\n", numProducers, seconds);
+  printf("%6s %14s %14s %7s %12s\n", "batch", "list ops/s", "ring ops/s",
+         "ratio", "overflowed");
+  for (int b = 0; b < numBatches; ++b) {
+    batchSize = batches[b];
+    DispatchRings::QueueStats before;
+    DispatchRings::QueueStats after;
+    DispatchRings::Instance().GetStats(Target, &before);
+    double list = Run(false, seconds);
+    double ring = Run(true, seconds);
+    DispatchRings::Instance().GetStats(Target, &after);
+    printf("%6d %14.0f %14.0f %6.2fx %12llu\n", batchSize, list, ring,
+           list > 0 ? ring / list : 0.0,
+           (unsigned long long) (after.overflowed - before.overflowed));
+  }
+  // the FS and DBMain queues' threads never return
+  fflush(stdout);
+  _exit(0);
+}
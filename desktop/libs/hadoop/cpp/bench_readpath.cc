@@ -0,0 +1,182 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+// Read path benchmark: decompress and verify.
+//
+// Compresses a read worth of CompressChunkSize blocks with each codec,
+// then times two ways of getting it back verified:
+//   two pass  decompress every block of the read, then XorCrc32 the
+//             whole output, as a second pass over memory
+//   fused     mapr::fs::DecompressCRC per block
+// and prints MB/s for both and the saving, for a range of read sizes.
+//
+//   g++ -O2 -Iinclude -o bench_readpath bench_readpath.cc -lMapRClient
+//   ./bench_readpath [input-file] [seconds-per-run]
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "common/compressor.h"
+#include "common/decompresscrc.h"
+
+using namespace mapr::fs;
+
+namespace {
+
+struct Codec {
+  const char       *name;
+  uint32_t         type;
+};
+
+struct Block {
+  uint8_t          cbuf[CompressChunkSize + 1024];
+  uint16_t         clen;
+  uint32_t         crc;  // of the uncompressed block
+};
+
+double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void Fill(uint8_t *buf, size_t len, const char *path) {
+  size_t n = 0;
+  FILE *f = path ? fopen(path, "rb") : NULL;
+  if (f) {
+    n = fread(buf, 1, len, f);
+    fclose(f);
+  }
+  // reuse what was read, or text like filler that compresses about 3:1
+  static const char words[] = "volume container chunk fid block inode ";
+  for (size_t i = n; i < len; ++i) {
+    buf[i] = n ? buf[i % n]
+               : (rand() % 8) ? words[i % (sizeof(words) - 1)] : rand();
+  }
+}
+
+int TwoPass(uint32_t type, std::vector<Block> &blocks, uint8_t *out,
+            CompressorScratchMem *scratch) {
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    struct iovec ivec;
+    ivec.iov_base = blocks[i].cbuf;
+    ivec.iov_len = blocks[i].clen;
+    int err = Compressor::Decompress(type, &ivec, 1,
+                                     out + i * CompressChunkSize,
+                                     CompressChunkSize, scratch);
+    if (err) {
+      return err;
+    }
+  }
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    if (XorCrc32::ComputeUnalign(out + i * CompressChunkSize, 0,
+                                 CompressChunkSize) != blocks[i].crc) {
+      return EIO;
+    }
+  }
+  delete scratch;
+  return 0;
+}
+
+int Fused(uint32_t type, std::vector<Block> &blocks, uint8_t *out,
+          CompressorScratchMem *scratch) {
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    struct iovec ivec;
+    ivec.iov_base = blocks[i].cbuf;
+    ivec.iov_len = blocks[i].clen;
+    uint32_t crc = 0;
+    int err = DecompressCRC(type, &ivec, 1, out + i * CompressChunkSize,
+                            CompressChunkSize, &crc, scratch);
+    if (err) {
+      return err;
+    }
+    if (crc != blocks[i].crc) {
+      return EIO;
+    }
+  }
+  delete scratch;
+  return 0;
+}
+
+// MB/s of fn over the whole read, repeated for at least seconds
+double Time(int (*fn)(uint32_t, std::vector<Block> &, uint8_t *,
+                      CompressorScratchMem *),
+            uint32_t type, std::vector<Block> &blocks, uint8_t *out,
+            CompressorScratchMem *scratch, double seconds, int *err) {
+  int rounds = 0;
+  double start = Now();
+  double elapsed;
+  do {
+    *err = fn(type, blocks, out, scratch);
+    ++rounds;
+    elapsed = Now() - start;
+  } while (!*err && elapsed < seconds);
+  return (double) blocks.size() * CompressChunkSize * rounds /
+         elapsed / (1 << 20);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : NULL;
+  double seconds = argc > 2 ? strtod(argv[2], NULL) : 1.0;
+  static const int readKB[] = { 64, 1024, 8192 };
+  const int numReads = sizeof(readKB) / sizeof(readKB[0]);
+  const size_t maxRead = readKB[numReads - 1] * 1024;
+
+  std::vector<uint8_t> data(maxRead);
+  std::vector<uint8_t> out(maxRead);
+  Fill(&data[0], maxRead, path);
+
+  const Codec codecs[] = {
+    { "lzf",  CompressionType::LZF },
+    { "lz4",  CompressionType::LZ4 },
+    { "zlib", CompressionType::ZLIB },
+  };
+  const int numCodecs = sizeof(codecs) / sizeof(codecs[0]);
+
+  // sized by this tree's CompressorScratchMem, not the library's
+  CompressorScratchMem *scratch = new CompressorScratchMem;
+
+  printf("%-6s %8s %14s %14s %8s\n", "codec", "read KB",
+         "two pass MB/s", "fused MB/s", "saving");
+  for (int c = 0; c < numCodecs; ++c) {
+    uint32_t type = codecs[c].type;
+    for (int r = 0; r < numReads; ++r) {
+      std::vector<Block> blocks(readKB[r] * 1024 / CompressChunkSize);
+      int err = 0;
+      for (size_t i = 0; i < blocks.size() && !err; ++i) {
+        const uint8_t *in = &data[i * CompressChunkSize];
+        struct iovec ovec;
+        ovec.iov_base = blocks[i].cbuf;
+        ovec.iov_len = sizeof(blocks[i].cbuf);
+        uint32_t ccrc = 0;
+        err = Compressor::Compress(type, in, CompressChunkSize, &ovec, 1,
+                                   &blocks[i].clen, &ccrc, scratch);
+        blocks[i].crc = XorCrc32::ComputeUnalign(in, 0, CompressChunkSize);
+      }
+      if (err) {
+        printf("%-6s %8d compress failed: %s\n", codecs[c].name, readKB[r],
+               strerror(err));
+        break;
+      }
+
+      double two = Time(TwoPass, type, blocks, &out[0], scratch,
+                        seconds, &err);
+      double fused = err ? 0 : Time(Fused, type, blocks, &out[0], scratch,
+                                    seconds, &err);
+      if (err) {
+        printf("%-6s %8d decompress failed: %s\n", codecs[c].name,
+               readKB[r], strerror(err));
+        break;
+      }
+      printf("%-6s %8d %14.1f %14.1f %7.1f%%\n", codecs[c].name, readKB[r],
+             two, fused, 100.0 * (1.0 - two / fused));
+    }
+  }
+  delete scratch;
+  return 0;
+}
@@ -0,0 +1,72 @@
+#!/usr/bin/env python
+"""
+Throughput benchmark for the maprsecurity extension.
+
+Runs Encrypt and Decrypt on a fixed size payload from 1, 4 and 16
+threads and prints calls/s and MB/s for each, so that the effect of
+releasing the GIL around the cipher can be measured. The payload is
+also encrypted as a multi-part frame, once joined in Python and once
+through EncryptV.
+
+  python bench_security.py [payload-bytes] [seconds-per-run]
+"""
+
+import os
+import sys
+import threading
+import time
+
+import maprsecurity
+
+THREAD_COUNTS = (1, 4, 16)
+KEY_SIZE = 32  # AES-256, see KeySizeInBytes in common/credentials.h
+FRAME_PARTS = 4
+
+
+def run(func, nthreads, seconds):
+  calls = [0] * nthreads
+  deadline = time.time() + seconds
+
+  def worker(idx):
+    n = 0
+    while time.time() < deadline:
+      func()
+      n += 1
+    calls[idx] = n
+
+  threads = [threading.Thread(target=worker, args=(i,)) for i in xrange(nthreads)]
+  start = time.time()
+  for t in threads:
+    t.start()
+  for t in threads:
+    t.join()
+  return sum(calls), time.time() - start
+
+
+def main(argv):
+  size = int(argv[1]) if len(argv) > 1 else 64 * 1024
+  seconds = float(argv[2]) if len(argv) > 2 else 5.0
+
+  key = os.urandom(KEY_SIZE)
+  plain = os.urandom(size)
+  cipher = maprsecurity.Encrypt(key, plain)
+  step = max(1, size / FRAME_PARTS)
+  parts = [plain[i:i + step] for i in xrange(0, size, step)]
+
+  cases = (
+    ('Encrypt', lambda: maprsecurity.Encrypt(key, plain)),
+    ('Decrypt', lambda: maprsecurity.Decrypt(key, cipher)),
+    ('Join+Enc', lambda: maprsecurity.Encrypt(key, ''.join(parts))),
+    ('EncryptV', lambda: maprsecurity.EncryptV(key, parts)),
+  )
+
+  print '%-8s %8s %12s %10s' % ('op', 'threads', 'calls/s', 'MB/s')
+  for name, func in cases:
+    for nthreads in THREAD_COUNTS:
+      calls, elapsed = run(func, nthreads, seconds)
+      rate = calls / elapsed
+      print '%-8s %8d %12.0f %10.1f' % (name, nthreads, rate, rate * size / (1 << 20))
+
+
+if __name__ == '__main__':
+  main(sys.argv)
@@ -0,0 +1,143 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+// Snappy iovec microbenchmark.
+//
+// Compresses and decompresses one CompressChunkSize block whose
+// compressed form is split into 1, 2, 4 and 8 fragments. Each layout is
+// run through the CacheArraySource/CacheArraySink path and through
+// SnappyIovecCompressor::Compress/Decompress, and ns per block is
+// printed.
+//
+//   g++ -O2 -Iinclude -o bench_snappy bench_snappy.cc -lsnappy
+//   ./bench_snappy [input-file] [iterations]
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common/snappycompressor.h"
+
+namespace {
+
+const int MaxFrags = 8;
+
+uint64_t NowNsecs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// splits buf into nfrags vectors of uneven size, so that snappy
+// copies and literals straddle the boundaries
+int Split(uint8_t *buf, size_t len, int nfrags, struct iovec *vec) {
+  size_t off = 0;
+  for (int i = 0; i < nfrags; ++i) {
+    size_t fl = (i == nfrags - 1) ? len - off
+                                  : (len - off) / (nfrags - i) + 7 * (i & 1);
+    fl = MIN(fl, len - off);
+    vec[i].iov_base = buf + off;
+    vec[i].iov_len = fl;
+    off += fl;
+  }
+  return nfrags;
+}
+
+void Fill(uint8_t *buf, size_t len, const char *path) {
+  size_t n = 0;
+  FILE *f = path ? fopen(path, "rb") : NULL;
+  if (f) {
+    n = fread(buf, 1, len, f);
+    fclose(f);
+  }
+  // text like filler, compresses about 2:1
+  static const char words[] = "block chunk cluster volume container fid ";
+  for (; n < len; ++n) {
+    buf[n] = (rand() % 4) ? words[n % (sizeof(words) - 1)] : rand();
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : NULL;
+  int iters = argc > 2 ? atoi(argv[2]) : 200000;
+
+  static uint8_t in[CompressChunkSize];
+  static uint8_t out[CompressChunkSize];
+  static uint8_t cbuf[2 * CompressChunkSize];
+  static CompressorScratchMem scratch;
+  Fill(in, sizeof(in), path);
+
+  SnappyIovecCompressor snappyc;
+  struct iovec one;
+  one.iov_base = cbuf;
+  one.iov_len = sizeof(cbuf);
+  uint16_t clen = 0;
+  uint32_t crcs[MaxFrags];
+  memset(crcs, 0, sizeof(crcs));
+  if (snappyc.Compress(in, sizeof(in), &one, 1, &clen, crcs, &scratch)) {
+    fprintf(stderr, "compress failed\n");
+    return 1;
+  }
+  printf("block %d bytes, compressed %u, %d iterations\n",
+         CompressChunkSize, clen, iters);
+  printf("%5s %14s %14s %14s %14s\n", "frags",
+         "sink comp ns", "raw comp ns", "src decomp ns", "raw decomp ns");
+
+  for (int nfrags = 1; nfrags <= MaxFrags; nfrags <<= 1) {
+    struct iovec ovec[MaxFrags];
+    struct iovec ivec[MaxFrags];
+    uint64_t t[4];
+    uint64_t start;
+
+    // output room split the same way as the compressed block
+    Split(cbuf, snappy::MaxCompressedLength(sizeof(in)), nfrags, ovec);
+
+    start = NowNsecs();
+    for (int i = 0; i < iters; ++i) {
+      struct iovec inv;
+      inv.iov_base = in;
+      inv.iov_len = sizeof(in);
+      CacheArraySource src(&inv, 1);
+      CacheArraySink sink(ovec, nfrags);
+      snappy::Compress(&src, &sink);
+    }
+    t[0] = NowNsecs() - start;
+
+    start = NowNsecs();
+    for (int i = 0; i < iters; ++i) {
+      snappyc.Compress(in, sizeof(in), ovec, nfrags, &clen, crcs, &scratch);
+    }
+    t[1] = NowNsecs() - start;
+
+    Split(cbuf, clen, nfrags, ivec);
+
+    start = NowNsecs();
+    for (int i = 0; i < iters; ++i) {
+      struct iovec outv;
+      outv.iov_base = out;
+      outv.iov_len = sizeof(out);
+      CacheArraySource src(ivec, nfrags);
+      CacheArraySink sink(&outv, 1);
+      snappy::Uncompress(&src, &sink);
+    }
+    t[2] = NowNsecs() - start;
+
+    start = NowNsecs();
+    for (int i = 0; i < iters; ++i) {
+      snappyc.Decompress(ivec, nfrags, out, sizeof(out), &scratch);
+    }
+    t[3] = NowNsecs() - start;
+
+    if (memcmp(in, out, sizeof(in)) != 0) {
+      fprintf(stderr, "%d fragments: data mismatch\n", nfrags);
+      return 1;
+    }
+    printf("%5d %14.0f %14.0f %14.0f %14.0f\n", nfrags,
+           (double) t[0] / iters, (double) t[1] / iters,
+           (double) t[2] / iters, (double) t[3] / iters);
+  }
+  return 0;
+}
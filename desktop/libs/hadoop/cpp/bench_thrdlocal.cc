@@ -0,0 +1,148 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+// FastThreadLocalStore check and benchmark.
+//
+// First checks that the fast path never hands out a store it should
+// not: Threads threads each create their own store and read it back
+// Reads times, half of them delete it and must then see no store, and
+// every store must be destroyed exactly once. Then an object is
+// destroyed with a store still cached and a new one made, which may get
+// the same registry slot; the new object must not see the old store.
+//
+// Then prints ns per getLocalStore() for FastThreadLocalStore and for a
+// plain ThreadLocalStore.
+//
+//   g++ -O2 -Iinclude -o bench_thrdlocal bench_thrdlocal.cc -lMapRClient -lpthread
+//   ./bench_thrdlocal [millions-of-gets]
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common/thrdlocal.h"
+
+using namespace mapr::fs;
+
+namespace {
+
+const int Threads = 50;
+const int Reads = 100;
+
+struct Store {
+  long                  owner;
+};
+
+FastThreadLocalStore *fast;
+volatile uint64_t destroyed;
+volatile uint64_t errors;
+
+uint64_t NowNsecs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void Destroy(void *p) {
+  if (((Store *) p)->owner < 0) {
+    atomic_add64(&errors, 1);
+  }
+  ((Store *) p)->owner = -1;
+  atomic_add64(&destroyed, 1);
+}
+
+void *Thread(void *arg) {
+  long id = (long) (intptr_t) arg;
+  for (int r = 0; r < Reads; ++r) {
+    Store *s = (Store *) fast->getLocalStore();
+    if (!s) {
+      s = (Store *) fast->createLocalStore(sizeof(Store));
+      s->owner = id;
+    }
+    if (s->owner != id) {
+      fprintf(stderr, "thread %ld got the store of %ld\n", id, s->owner);
+      atomic_add64(&errors, 1);
+      break;
+    }
+  }
+  if (id % 2) {
+    fast->deleteLocalStore();
+    if (fast->getLocalStore()) {
+      fprintf(stderr, "thread %ld still has a store after delete\n", id);
+      atomic_add64(&errors, 1);
+    }
+  }
+  return NULL;
+}
+
+bool Check() {
+  fast = new FastThreadLocalStore(Destroy);
+  pthread_t threads[Threads];
+  for (int i = 0; i < Threads; ++i) {
+    pthread_create(&threads[i], NULL, Thread, (void *) (intptr_t) i);
+  }
+  for (int i = 0; i < Threads; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  if (destroyed != (uint64_t) Threads) {
+    fprintf(stderr, "%llu of %d stores destroyed\n",
+            (unsigned long long) destroyed, Threads);
+    atomic_add64(&errors, 1);
+  }
+
+  Store *s = (Store *) fast->createLocalStore(sizeof(Store));
+  s->owner = 0;
+  if (fast->getLocalStore() != s) {
+    fprintf(stderr, "store not found right after create\n");
+    atomic_add64(&errors, 1);
+  }
+  delete fast;
+  fast = new FastThreadLocalStore(Destroy);
+  if (fast->getLocalStore()) {
+    fprintf(stderr, "new object sees the store of the one before\n");
+    atomic_add64(&errors, 1);
+  }
+  delete fast;
+  fast = NULL;
+  return errors == 0;
+}
+
+template <typename T>
+double NsecsPerGet(T *tls, int n) {
+  ((Store *) tls->createLocalStore(sizeof(Store)))->owner = 1;
+  long sum = 0;
+  uint64_t t0 = NowNsecs();
+  for (int i = 0; i < n; ++i) {
+    sum += ((Store *) tls->getLocalStore())->owner;
+  }
+  uint64_t t1 = NowNsecs();
+  if (sum != n) {
+    fprintf(stderr, "read %ld, not %d\n", sum, n);
+  }
+  return (double) (t1 - t0) / n;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  int millions = argc > 1 ? atoi(argv[1]) : 100;
+  if (millions < 1 || millions > 2000) {
+    fprintf(stderr, "millions-of-gets must be 1 to 2000\n");
+    return 1;
+  }
+  if (!Check()) {
+    fprintf(stderr, "check FAILED, %llu errors\n",
+            (unsigned long long) errors);
+    return 1;
+  }
+  printf("check: %d threads, no stale stores, each destroyed once\n",
+         Threads);
+
+  int n = millions * 1000000;
+  FastThreadLocalStore f(Destroy);
+  ThreadLocalStore plain(Destroy);
+  printf("%-22s %8.2f ns/get\n", "FastThreadLocalStore", NsecsPerGet(&f, n));
+  printf("%-22s %8.2f ns/get\n", "ThreadLocalStore", NsecsPerGet(&plain, n));
+  return 0;
+}
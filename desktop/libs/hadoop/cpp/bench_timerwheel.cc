@@ -0,0 +1,178 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+// TimerWheel check and benchmark.
+//
+// First checks that timers expire on their exact tick: timers with
+// deadlines spread over 2^26 ticks, and some past the 2^32 ticks the
+// levels cover, are inserted, a third of them removed again, and half
+// of the ones that fire re-armed from their callback. The wheel is
+// advanced a random number of ticks at a time. Every timer must fire
+// once on its tick and no removed timer may fire. Walking 2^32 ticks
+// takes a few seconds.
+//
+// Then prints the cost per timer of inserting, removing and expiring
+// large numbers of timers with deadlines of up to 60000 ticks, five
+// minutes of DispatchTimers ticks.
+//
+//   g++ -O2 -Iinclude -o bench_timerwheel bench_timerwheel.cc -lpthread
+//   ./bench_timerwheel [timers]
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rpc/timerwheel.h"
+
+using namespace mapr::fs;
+
+namespace {
+
+const uint64_t Horizon = 1ULL << 26;
+const uint64_t Span = 1ULL << (TimerWheel::Levels * TimerWheel::LevelBits);
+const uint64_t Timeouts = 60000;
+
+struct Timer {
+  DispatchTimer         t;
+  uint64_t              due;
+  int                   fired;
+  bool                  removed;
+  bool                  rearm;
+};
+
+TimerWheel *wheel;
+uint64_t errors;
+uint64_t expired;
+
+uint64_t NowNsecs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t Random64() {
+  return ((uint64_t) rand() << 32) ^ ((uint64_t) rand() << 16) ^ rand();
+}
+
+void Insert(Timer *x, uint64_t delta) {
+  x->due = wheel->Now() + delta;
+  x->t.expires = x->due;
+  wheel->Insert(&x->t);
+}
+
+void CheckExpire(void * /* arg */, DispatchTimer *t) {
+  Timer *x = (Timer *) t;
+  if (x->removed || wheel->Now() != x->due) {
+    if (errors++ < 10) {
+      fprintf(stderr, "timer due %llu fired at %llu%s\n",
+              (unsigned long long) x->due,
+              (unsigned long long) wheel->Now(),
+              x->removed ? " after removal" : "");
+    }
+  }
+  ++x->fired;
+  if (x->rearm) {
+    x->rearm = false;
+    x->fired = 0;
+    Insert(x, 1 + Random64() % Horizon);
+  }
+}
+
+int Check(int numTimers) {
+  Timer *timers = new Timer[numTimers];
+  memset((void *) timers, 0, numTimers * sizeof(Timer));
+  wheel = new TimerWheel();
+  wheel->Start(Random64() % Horizon);
+  for (int i = 0; i < numTimers; ++i) {
+    Timer *x = &timers[i];
+    x->rearm = rand() % 2 == 0;
+    Insert(x, i % 100 == 0 ? Span + Random64() % Horizon :
+                              1 + Random64() % Horizon);
+  }
+  for (int i = 0; i < numTimers; i += 3) {
+    timers[i].removed = true;
+    wheel->Remove(&timers[i].t);
+  }
+
+  uint64_t end = wheel->Now() + Span + 2 * Horizon;
+  while (wheel->Count() > 0 && wheel->Now() < end) {
+    wheel->Advance(wheel->Now() + 1 + rand() % 4096, CheckExpire, NULL);
+  }
+  for (int i = 0; i < numTimers; ++i) {
+    Timer *x = &timers[i];
+    if (x->fired != (x->removed ? 0 : 1)) {
+      if (errors++ < 10) {
+        fprintf(stderr, "timer due %llu fired %d times%s\n",
+                (unsigned long long) x->due, x->fired,
+                x->removed ? " after removal" : "");
+      }
+    }
+  }
+  if (wheel->Count() != 0) {
+    fprintf(stderr, "%llu timers left\n",
+            (unsigned long long) wheel->Count());
+    ++errors;
+  }
+  delete wheel;
+  delete [] timers;
+  return errors ? 1 : 0;
+}
+
+void CountExpire(void * /* arg */, DispatchTimer * /* t */) {
+  ++expired;
+}
+
+void Bench(int numTimers) {
+  Timer *timers = new Timer[numTimers];
+  memset((void *) timers, 0, numTimers * sizeof(Timer));
+  wheel = new TimerWheel();
+  wheel->Start(0);
+
+  uint64_t t0 = NowNsecs();
+  for (int i = 0; i < numTimers; ++i) {
+    timers[i].t.expires = 1 + Random64() % Timeouts;
+    wheel->Insert(&timers[i].t);
+  }
+  uint64_t t1 = NowNsecs();
+  for (int i = 0; i < numTimers; i += 2) {
+    wheel->Remove(&timers[i].t);
+  }
+  uint64_t t2 = NowNsecs();
+  expired = 0;
+  wheel->Advance(Timeouts + 1, CountExpire, NULL);
+  uint64_t t3 = NowNsecs();
+
+  int removed = (numTimers + 1) / 2;
+  printf("%10d %12.1f %12.1f %12.1f %12.1f\n", numTimers,
+         (double) (t1 - t0) / numTimers, (double) (t2 - t1) / removed,
+         expired ? (double) (t3 - t2) / expired : 0.0,
+         (double) (t3 - t2) / (Timeouts + 1));
+  delete wheel;
+  delete [] timers;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  int numTimers = argc > 1 ? atoi(argv[1]) : 100000;
+  if (numTimers < 1) {
+    fprintf(stderr, "timers must be at least 1\n");
+    return 1;
+  }
+  srand(1);
+  if (Check(numTimers)) {
+    fprintf(stderr, "check FAILED, %llu errors\n",
+            (unsigned long long) errors);
+    return 1;
+  }
+  printf("check: %d timers fired on their tick\n", numTimers);
+
+  printf("%10s %12s %12s %12s %12s\n", "timers", "insert ns", "remove ns",
+         "expire ns", "ns per tick");
+  for (int n = 1000; n < numTimers; n *= 10) {
+    Bench(n);
+  }
+  Bench(numTimers);
+  return 0;
+}
@@ -0,0 +1,128 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+// Work stealing benchmark: WorkStealDispatch::ExecuteAt on the Compress
+// queues, without and then with the Compress group enabled.
+//
+// Items are spread evenly over three Compress queues, but the callbacks
+// of the first queue sleep while the others only spin for a while, so
+// without stealing that queue holds everything up. Prints the time to
+// run all items, the longest an item waited to run, and where the items
+// ran, for each run.
+//
+//   g++ -O2 -Iinclude -o bench_workstealing bench_workstealing.cc -lMapRClient -lpthread
+//   ./bench_workstealing [items] [slow-usecs]
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rpc/dispatch.h"
+#include "rpc/workstealing.h"
+
+using namespace mapr::fs;
+
+namespace {
+
+const int First = GlobalDispatch::CpuQ_Compress1;
+const int Last = GlobalDispatch::CpuQ_Compress3;
+const int NumQueues = Last - First + 1;
+const int SpinIters = 20000;
+
+struct Item {
+  GlobalDispatchWA      wa;
+  uint64_t              submitted;
+};
+
+int slowUsecs;
+volatile uint64_t done;
+volatile uint64_t maxWait;
+volatile uint64_t ranOn[NumQueues];
+
+uint64_t NowNsecs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void Work(void *arg, int /* err */) {
+  Item *it = (Item *) arg;
+  uint64_t wait = NowNsecs() - it->submitted;
+  uint64_t old = maxWait;
+  while (wait > old && !atomic_cas64(&maxWait, old, wait)) {
+    old = maxWait;
+  }
+  int qid = GlobalDispatch::GetMyQid();
+  if (qid == First) {
+    usleep(slowUsecs);
+  } else {
+    volatile int x = 0;
+    for (int i = 0; i < SpinIters; ++i) {
+      x += i;
+    }
+  }
+  atomic_add64(&ranOn[qid - First], 1);
+  atomic_add64(&done, 1);
+}
+
+void *Consume(void *arg) {
+  GlobalDispatch::SetMyCpuQid((int) (intptr_t) arg);
+  g_Dispatch.Dispatch(true);
+  return NULL;
+}
+
+void Run(const char *name, Item *items, int numItems) {
+  done = 0;
+  maxWait = 0;
+  memset((void *) ranOn, 0, sizeof(ranOn));
+  WorkStealDispatch &ws = WorkStealDispatch::Instance();
+  uint64_t t0 = NowNsecs();
+  for (int i = 0; i < numItems; ++i) {
+    items[i].submitted = NowNsecs();
+    ws.ExecuteAt(First + i % NumQueues, Work, &items[i], 0, &items[i].wa);
+  }
+  while (done < (uint64_t) numItems) {
+    usleep(1000);
+  }
+  uint64_t t1 = NowNsecs();
+  printf("%-8s %8.2f %12.1f", name, (t1 - t0) / 1e9, maxWait / 1e6);
+  for (int q = 0; q < NumQueues; ++q) {
+    printf(" %8llu", (unsigned long long) ranOn[q]);
+  }
+  printf("\n");
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  int numItems = argc > 1 ? atoi(argv[1]) : 30000;
+  slowUsecs = argc > 2 ? atoi(argv[2]) : 200;
+  if (numItems < 1) {
+    fprintf(stderr, "items must be at least 1\n");
+    return 1;
+  }
+  Item *items = new Item[numItems];
+  memset((void *) items, 0, numItems * sizeof(Item));
+
+  for (int q = First; q <= Last; ++q) {
+    pthread_t t;
+    pthread_create(&t, NULL, Consume, (void *) (intptr_t) q);
+  }
+
+  printf("%d items, %d usecs each on the slow queue\n", numItems, slowUsecs);
+  printf("%-8s %8s %12s %8s %8s %8s\n", "", "secs", "max wait ms",
+         "slow", "fast", "fast");
+  Run("affinity", items, numItems);
+  int err = WorkStealDispatch::Instance().EnableGroup(First, Last);
+  if (err) {
+    fprintf(stderr, "cannot enable the group: %s\n", strerror(err));
+    return 1;
+  }
+  Run("stealing", items, numItems);
+  // the Compress queues' threads never return
+  fflush(stdout);
+  _exit(0);
+}
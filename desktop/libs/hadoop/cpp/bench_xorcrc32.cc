@@ -0,0 +1,153 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+// XorCrc32 throughput benchmark.
+//
+// Checks that every implementation this cpu supports matches the scalar
+// loop on aligned and unaligned buffers, that ComputeUnalign matches a
+// byte at a time reference, and that XorCrc32Stream over scattered
+// fragments matches ComputeUnalign over the same bytes. Then prints GB/s
+// for each implementation over a range of block sizes, from an aligned
+// and from an odd address.
+//
+//   g++ -O2 -Iinclude -o bench_xorcrc32 bench_xorcrc32.cc
+//   ./bench_xorcrc32 [megabytes-per-run]
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common/xorcrc32.h"
+
+using namespace mapr::fs;
+
+namespace {
+
+const int MaxBlock = 1 << 20;
+const int Slack = 64;
+const int MaxFrags = 8;
+
+uint64_t NowNsecs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// byte at stream position p lands in byte lane p % 4
+uint32_t Reference(const uint8_t *b, int off, int len) {
+  uint32_t crc = 0;
+  for (int i = 0; i < len; ++i) {
+    crc ^= (uint32_t) b[off + i] << (8 * ((off + i) & 3));
+  }
+  return crc;
+}
+
+int Verify(const uint8_t *buf) {
+  int bad = 0;
+  for (int impl = 0; impl < XorCrc32::ImplMax; ++impl) {
+    if (!XorCrc32::ImplSupported((XorCrc32::Impl) impl)) {
+      continue;
+    }
+    for (int align = 0; align < Slack; ++align) {
+      for (size_t n = 0; n < 300; ++n) {
+        uint32_t want = XorCrc32::ComputeWords(XorCrc32::ImplScalar,
+                                               buf + align, n);
+        uint32_t got = XorCrc32::ComputeWords((XorCrc32::Impl) impl,
+                                              buf + align, n);
+        if (want != got) {
+          printf("%s: align %d words %zu: %08x != %08x\n",
+                 XorCrc32::ImplName((XorCrc32::Impl) impl), align, n,
+                 got, want);
+          ++bad;
+        }
+      }
+    }
+  }
+
+  for (int off = 0; off < Slack; ++off) {
+    for (int len = 0; len < 1200; len += (len < 64) ? 1 : 37) {
+      uint32_t want = Reference(buf, off, len);
+      uint32_t got = XorCrc32::ComputeUnalign(buf, off, len);
+      if (want != got) {
+        printf("ComputeUnalign: off %d len %d: %08x != %08x\n",
+               off, len, got, want);
+        ++bad;
+      }
+    }
+  }
+
+  // the same bytes scattered over fragments at odd addresses
+  static uint8_t frags[MaxFrags * 3 * Slack];
+  for (int trial = 0; trial < 2000; ++trial) {
+    struct iovec iov[MaxFrags];
+    int niov = 1 + rand() % MaxFrags;
+    int len = 0;
+    for (int i = 0; i < niov; ++i) {
+      int flen = rand() % (2 * Slack);
+      uint8_t *dst = frags + i * 3 * Slack + rand() % Slack;
+      memcpy(dst, buf + len, flen);
+      iov[i].iov_base = dst;
+      iov[i].iov_len = flen;
+      len += flen;
+    }
+
+    uint32_t want = XorCrc32::ComputeUnalign(buf, 0, len);
+    XorCrc32Stream stream;
+    stream.Update(iov, niov);
+    if (stream.Value() != want || XorCrc32::VerifyCRC(iov, niov, want)) {
+      printf("XorCrc32Stream: %d fragments, %d bytes: %08x != %08x\n",
+             niov, len, stream.Value(), want);
+      ++bad;
+    }
+  }
+  return bad;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  size_t perRun = (argc > 1 ? atoi(argv[1]) : 512) * (size_t) (1 << 20);
+  static const int sizes[] = { 64, 512, 4096, 8192, 65536, MaxBlock };
+  const int numSizes = sizeof(sizes) / sizeof(sizes[0]);
+
+  uint8_t *buf = (uint8_t *) malloc(MaxBlock + Slack);
+  for (int i = 0; i < MaxBlock + Slack; ++i) {
+    buf[i] = rand();
+  }
+
+  int bad = Verify(buf);
+  if (bad) {
+    printf("%d mismatches\n", bad);
+    return 1;
+  }
+  printf("all implementations match, best is %s\n",
+         XorCrc32::ImplName(XorCrc32::BestImpl()));
+
+  printf("%-8s %8s %12s %12s\n", "impl", "block", "GB/s", "GB/s +1");
+  for (int impl = 0; impl < XorCrc32::ImplMax; ++impl) {
+    if (!XorCrc32::ImplSupported((XorCrc32::Impl) impl)) {
+      continue;
+    }
+    for (int s = 0; s < numSizes; ++s) {
+      double gbs[2];
+      for (int unaligned = 0; unaligned < 2; ++unaligned) {
+        const uint8_t *b = buf + unaligned;
+        size_t iters = perRun / sizes[s];
+        volatile uint32_t sink = 0;
+        uint64_t start = NowNsecs();
+        for (size_t i = 0; i < iters; ++i) {
+          sink ^= XorCrc32::ComputeWords((XorCrc32::Impl) impl, b,
+                                         sizes[s] / 4);
+        }
+        uint64_t ns = NowNsecs() - start;
+        gbs[unaligned] = (double) iters * sizes[s] / ns;
+      }
+      printf("%-8s %8d %12.2f %12.2f\n",
+             XorCrc32::ImplName((XorCrc32::Impl) impl), sizes[s],
+             gbs[0], gbs[1]);
+    }
+  }
+  free(buf);
+  return 0;
+}
@@ -0,0 +1,269 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+// Renders binary gtrace files as text: logs written in GTraceMode::BINARY
+// (<log>.<n>.gtb) and ring files kept by GTraceRingSet::MapFile
+// (gtrace.<pid>.ring), including those left behind by a crash.
+//
+// Reads the format records of each file first, then prints its entries
+// one line each, a log in the order it was appended and a ring file
+// merged across threads by time:
+//   2012-03-04 05:06:07,123456 <level> m<module> <fileid>:<line> <id> text
+// With -n only the last n entries of each file are printed.
+//
+//   g++ -O2 -Iinclude -o gtracedecode gtracedecode.cc
+//   ./gtracedecode [-n last] file ...
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "common/gtrace.h"
+
+using namespace mapr::fs;
+
+namespace {
+
+typedef GTraceBinLog::RawEntry RawEntry;
+typedef GTraceBinLog::Record Record;
+typedef std::map<uint64_t, const char *> FormatMap;
+
+const int MaxArgs = 4 + 2 * MAXSTRLEN_UINT64 + 16;
+
+const char *LevelName(int level) {
+  static const char *names[TraceLevel::Total] = {
+    "FATAL", "ERROR", "WARN", "INFO", "DEBUG"
+  };
+  return (level < TraceLevel::Total) ? names[level] : "?";
+}
+
+// printf arguments in the order the format expects them; on LP64 a
+// string pointer is passed the same way as a uint64_t
+int Args(const RawEntry *e, const uint64_t *data, uint64_t *args) {
+  const char *str = (const char *) data;
+  int nstr = 0;
+  bool tail = false;
+  switch (e->type) {
+    case ONE_STR_TYPE:      nstr = 1; break;
+    case TWO_STR_TYPE:      nstr = 2; break;
+    case THREE_STR_TYPE:    nstr = 3; break;
+    case FOUR_STR_TYPE:     nstr = 4; break;
+    case ONE_TAIL_STR_TYPE: nstr = 1; tail = true; break;
+    case TWO_TAIL_STR_TYPE: nstr = 2; tail = true; break;
+    default:                break;
+  }
+  int nints = e->length - nstr * MAXSTRLEN_UINT64;
+  if (nints < 0 || nints > 16) {
+    return -1;
+  }
+  const uint64_t *ints = data + nstr * MAXSTRLEN_UINT64;
+
+  int n = 0;
+  if (!tail) {
+    for (int i = 0; i < nstr; ++i) {
+      args[n++] = (uint64_t) (uintptr_t) (str + i * MAXSTRLEN_BYTES);
+    }
+  }
+  for (int i = 0; i < nints; ++i) {
+    args[n++] = ints[i];
+  }
+  if (tail) {
+    for (int i = 0; i < nstr; ++i) {
+      args[n++] = (uint64_t) (uintptr_t) (str + i * MAXSTRLEN_BYTES);
+    }
+  }
+  return n;
+}
+
+void Print(const RawEntry *e, const FormatMap &formats) {
+  const uint64_t *data = (const uint64_t *) (e + 1);
+  char when[32];
+  time_t sec = e->tvSec;
+  struct tm tm;
+  localtime_r(&sec, &tm);
+  strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+  printf("%s,%06u %s m%u %u:%u 0x%llx ", when, (unsigned) e->tvUsec,
+         LevelName(e->level), e->module, e->fileId, e->lineNo,
+         (unsigned long long) e->userDefID);
+
+  uint64_t a[MaxArgs];
+  memset(a, 0, sizeof(a));
+  FormatMap::const_iterator f = formats.find(e->fmt);
+  if (f == formats.end() || Args(e, data, a) < 0) {
+    printf("<format 0x%llx type %u:", (unsigned long long) e->fmt, e->type);
+    for (int i = 0; i < e->length; ++i) {
+      printf(" %llx", (unsigned long long) data[i]);
+    }
+    printf(">\n");
+    return;
+  }
+  printf(f->second, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8],
+         a[9], a[10], a[11], a[12], a[13], a[14], a[15], a[16], a[17],
+         a[18], a[19]);
+  printf("\n");
+}
+
+// walks the records in [p, p + len), up to the first zero length; a
+// zero kind was never finished
+void ReadRecords(const uint8_t *p, size_t len, FormatMap *formats,
+                 std::vector<const RawEntry *> *entries) {
+  size_t off = 0;
+  while (off + sizeof(Record) <= len) {
+    const Record *r = (const Record *) (p + off);
+    if (r->len < sizeof(Record) || r->len > len - off) {
+      break;
+    }
+    const uint8_t *payload = (const uint8_t *) (r + 1);
+    uint32_t plen = r->len - sizeof(Record);
+    if (r->kind == GTraceBinLog::FormatRecord && plen > sizeof(uint64_t) &&
+        memchr(payload + sizeof(uint64_t), '\0', plen - sizeof(uint64_t))) {
+      uint64_t key;
+      memcpy(&key, payload, sizeof(key));
+      (*formats)[key] = (const char *) payload + sizeof(key);
+    } else if (r->kind == GTraceBinLog::EntryRecord && entries &&
+               plen >= sizeof(RawEntry) &&
+               plen >= sizeof(RawEntry) +
+                       ((const RawEntry *) payload)->length * 8) {
+      entries->push_back((const RawEntry *) payload);
+    }
+    off += r->len;
+  }
+}
+
+void PrintLast(const std::vector<const RawEntry *> &entries, long last,
+               const FormatMap &formats) {
+  size_t first = (last > 0 && (size_t) last < entries.size()) ?
+                 entries.size() - last : 0;
+  for (size_t i = first; i < entries.size(); ++i) {
+    Print(entries[i], formats);
+  }
+}
+
+// a .gtb file from GTraceMode::BINARY
+int DecodeLog(const uint8_t *map, size_t size, long last) {
+  const GTraceBinLog::FileHeader *h = (const GTraceBinLog::FileHeader *) map;
+  if (size < sizeof(*h) || h->version != GTraceBinLog::Version ||
+      h->entrySize != sizeof(RawEntry)) {
+    return EINVAL;
+  }
+  FormatMap formats;
+  std::vector<const RawEntry *> entries;
+  size_t off = GTraceBinLog::Padded(sizeof(*h));
+  ReadRecords(map + off, size - off, &formats, &entries);
+  PrintLast(entries, last, formats);
+  return 0;
+}
+
+struct Stamped {
+  uint64_t          stamp;
+  size_t            seq;  // keeps a ring's order on equal stamps
+  const RawEntry    *e;
+  bool operator<(const Stamped &o) const {
+    return stamp < o.stamp || (stamp == o.stamp && seq < o.seq);
+  }
+};
+
+void CollectEntry(void *arg, const uint8_t *rec, uint32_t len,
+                  uint64_t stamp) {
+  std::vector<Stamped> *out = (std::vector<Stamped> *) arg;
+  const RawEntry *e = (const RawEntry *) rec;
+  if (len >= sizeof(RawEntry) + e->length * 8) {
+    Stamped s = { stamp, out->size(), e };
+    out->push_back(s);
+  }
+}
+
+// a .ring file from GTraceRingSet::MapFile, after a crash or not
+int DecodeRings(const uint8_t *map, size_t size, long last) {
+  const GTraceRingSet::FileHeader *h =
+    (const GTraceRingSet::FileHeader *) map;
+  if (size < sizeof(*h) || h->version != GTraceBinLog::Version ||
+      h->entrySize != sizeof(RawEntry) ||
+      GTraceRingSet::FileSize(h) > size ||
+      h->formatUsed > h->formatSize ||
+      h->ringSize != GTraceRing::RoundSize(h->ringSize)) {
+    return EINVAL;
+  }
+  FormatMap formats;
+  ReadRecords(map + GTraceRingSet::FormatsOffset, h->formatUsed, &formats,
+              NULL);
+
+  std::vector<Stamped> all;
+  uint32_t n = h->numRings < h->maxRings ? h->numRings : h->maxRings;
+  for (uint32_t i = 0; i < n; ++i) {
+    const uint8_t *slot = map + GTraceRingSet::SlotOffset(h, i);
+    GTraceRing::ForEach(slot + sizeof(GTraceRing::Cursors), h->ringSize,
+                        (const GTraceRing::Cursors *) slot, CollectEntry,
+                        &all);
+  }
+  std::sort(all.begin(), all.end());
+
+  std::vector<const RawEntry *> entries(all.size());
+  for (size_t i = 0; i < all.size(); ++i) {
+    entries[i] = all[i].e;
+  }
+  PrintLast(entries, last, formats);
+  return 0;
+}
+
+int Decode(const char *path, long last) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(path);
+    return errno;
+  }
+  size_t size = st.st_size;
+  uint8_t *map = (uint8_t *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror(path);
+    return errno;
+  }
+
+  int err = EINVAL;
+  if (size >= 8 && !memcmp(map, GTraceBinLog::Magic(), 8)) {
+    err = DecodeLog(map, size, last);
+  } else if (size >= 8 && !memcmp(map, GTraceRingSet::Magic(), 8)) {
+    err = DecodeRings(map, size, last);
+  }
+  if (err) {
+    fprintf(stderr, "%s: not a gtrace log or ring file of this version\n",
+            path);
+  }
+  munmap(map, size);
+  return err;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  long last = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    if (opt == 'n') {
+      last = atol(optarg);
+    } else {
+      optind = argc + 1;
+      break;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-n last] file.gtb|file.ring ...\n",
+            argv[0]);
+    return 1;
+  }
+  int err = 0;
+  for (int i = optind; i < argc; ++i) {
+    err |= Decode(argv[i], last);
+  }
+  return err ? 1 : 0;
+}
@@ -25,12 +25,18 @@ struct LZ4ScratchMem {
   byte_t ioBuf[2 * CompressChunkSize];
 };
 
+// room for snappy::MaxCompressedLength(CompressChunkSize)
+struct SnappyScratchMem {
+  byte_t ioBuf[2 * CompressChunkSize];
+};
+
 struct CompressorScratchMem {
   union {
     byte_t scratch[16 * 1024];
     void *ptr;
     LZ4ScratchMem lz4Scratch;
     ZLIBScratchMem zlibScratch;
+    SnappyScratchMem snappyScratch;
   };
 };
 
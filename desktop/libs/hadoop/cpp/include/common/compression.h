@@ -5,8 +5,11 @@
 
 #include <pthread.h>
 #include "common/compressor.h"
+#include "common/compressionselector.h"
 #include "common/credentials.h"
+#include "common/xorcrc32.h"
 #include "rpc/dispatch.h"
+#include "rpc/workstealing.h"
 
 typedef void (WorkerFunc)(void *arg, void *lzstate);
 
@@ -58,6 +61,50 @@ class SecurityWA {
   friend class Compression;
 };
 
+// One CompressChunkSize block of a CompressStream. compressionType is
+// CompressionType::OFF when the block did not compress and is stored
+// as is. crc covers the len bytes at buf.
+struct CompressStreamBlock {
+  uint8_t                *buf;
+  uint16_t               len;
+  uint16_t               origLen;
+  uint8_t                compressionType;
+  uint32_t               crc;
+};
+
+class Compression;
+
+class CompressStreamWA {
+  static const int MaxGroups = GlobalDispatch::CpuQ_CompressMax -
+                               GlobalDispatch::CpuQ_Compress1 + 1;
+
+  // a run of consecutive blocks handled by one compress thread
+  struct Group {
+    CompressionWA        compressionwa;
+    CompressStreamWA     *stream;
+    int                  firstBlock;
+    int                  numBlocks;
+  };
+
+  Group                  groups[MaxGroups];
+  bool                   isCompress;
+  bool                   sampling;  // blocks go through selector
+  uint32_t               compressionType;
+  CompressionSelector    *selector;
+  Compression            *compression;
+  const uint8_t          *inBuf;
+  unsigned int           inLen;
+  uint8_t                *outBuf;
+  CompressStreamBlock    *blocks;
+  int                    startBlock;  // first block not yet handed out
+  int                    numBlocks;
+  volatile int           pendingGroups;
+  volatile int           err;
+  CallbackFunc           *cb;
+  void                   *cbarg;
+  friend class Compression;
+};
+
 
 class Compression {
 public:
@@ -205,6 +252,108 @@ public:
       cb, cbarg, wa);
   }
 
+  static inline int NumStreamBlocks(unsigned int len) {
+    return (len + CompressChunkSize - 1) / CompressChunkSize;
+  }
+
+  // CompressStream
+  // Splits inBuf into CompressChunkSize blocks and compresses them on all
+  // the compress queues. blocks must have NumStreamBlocks(inLen) entries
+  // and outBuf room for NumStreamBlocks(inLen) * CompressChunkSize bytes;
+  // block i is written at outBuf + i * CompressChunkSize. cb is called
+  // once, after the last block is done.
+  void CompressStream(uint32_t compressionType,
+                      const uint8_t *inBuf,
+                      unsigned int inLen,
+                      uint8_t *outBuf,
+                      CompressStreamBlock *blocks,  // out
+                      CallbackFunc *cb,
+                      void *cbarg,
+                      CompressStreamWA *wa) {
+    wa->isCompress = true;
+    wa->sampling = false;
+    wa->compressionType = compressionType;
+    wa->selector = NULL;
+    wa->inBuf = inBuf;
+    wa->inLen = inLen;
+    wa->outBuf = outBuf;
+    wa->blocks = blocks;
+    wa->startBlock = 0;
+    wa->numBlocks = NumStreamBlocks(inLen);
+    StartStream(cb, cbarg, wa);
+  }
+
+  // CompressStream
+  // Same as above, but the codec is picked by selector. While the
+  // selector is still sampling, the first blocks are compressed on one
+  // compress queue with every candidate codec, and the rest of the
+  // stream is then spread out with the codec it settled on. Each block
+  // records its own compressionType, so DecompressStream is unchanged.
+  // selector may be shared by successive streams of the same file, but
+  // not by concurrent ones.
+  void CompressStream(CompressionSelector *selector,
+                      const uint8_t *inBuf,
+                      unsigned int inLen,
+                      uint8_t *outBuf,
+                      CompressStreamBlock *blocks,  // out
+                      CallbackFunc *cb,
+                      void *cbarg,
+                      CompressStreamWA *wa) {
+    wa->isCompress = true;
+    wa->selector = selector;
+    wa->compression = this;
+    wa->inBuf = inBuf;
+    wa->inLen = inLen;
+    wa->outBuf = outBuf;
+    wa->blocks = blocks;
+    wa->startBlock = 0;
+    wa->numBlocks = NumStreamBlocks(inLen);
+
+    int numSample = MIN(selector->SampleBlocksLeft(), wa->numBlocks);
+    if (numSample <= 0) {
+      wa->sampling = false;
+      wa->compressionType = selector->GetType();
+      StartStream(cb, cbarg, wa);
+      return;
+    }
+
+    wa->sampling = true;
+    wa->cb = cb;
+    wa->cbarg = cbarg;
+    wa->err = 0;
+    wa->startBlock = numSample;
+
+    CompressStreamWA::Group *g = &wa->groups[0];
+    g->stream = wa;
+    g->firstBlock = 0;
+    g->numBlocks = numSample;
+    RunWorker(g, StreamWorker, StreamSampleDone, g, &g->compressionwa);
+  }
+
+  // DecompressStream
+  // Verifies the crc of each block produced by CompressStream and
+  // decompresses block i to outBuf + i * CompressChunkSize, spread over
+  // all the compress queues. cb is called once, with EIO if any crc
+  // did not match.
+  void DecompressStream(CompressStreamBlock *blocks,
+                        int numBlocks,
+                        uint8_t *outBuf,
+                        CallbackFunc *cb,
+                        void *cbarg,
+                        CompressStreamWA *wa) {
+    wa->isCompress = false;
+    wa->sampling = false;
+    wa->compressionType = CompressionType::OFF;
+    wa->selector = NULL;
+    wa->inBuf = NULL;
+    wa->inLen = 0;
+    wa->outBuf = outBuf;
+    wa->blocks = blocks;
+    wa->startBlock = 0;
+    wa->numBlocks = numBlocks;
+    StartStream(cb, cbarg, wa);
+  }
+
   void    Initialize(int numBgThreads);
 
   Compression(){}
@@ -219,11 +368,156 @@ private:
   pthread_t           *tids_;
   int                 numCalls_[GlobalDispatch::CpuQ_Max];
 
+  // Round robin over the compress queues; with their group enabled in
+  // WorkStealDispatch an idle compress thread may take it instead.
   void                Enq(CompressionWA *wa) {
     int nc = ++numCalls_[wa->cbQid];
     int qid = GlobalDispatch::CpuQ_Compress1 + nc % numThreads_;
 
-    g_Dispatch.ExecuteAt(qid, HandleCompressionWork, wa, 0, &wa->globWA);
+    WorkStealDispatch::Instance().ExecuteAt(qid, HandleCompressionWork, wa,
+                                            0, &wa->globWA);
+  }
+
+  void                StartStream(CallbackFunc *cb, void *cbarg,
+                                  CompressStreamWA *wa) {
+    wa->cb = cb;
+    wa->cbarg = cbarg;
+    wa->err = 0;
+
+    int remaining = wa->numBlocks - wa->startBlock;
+    int numGroups = MIN(MIN(numThreads_, CompressStreamWA::MaxGroups),
+                        remaining);
+    if (numGroups <= 0) {
+      cb(cbarg, 0);
+      return;
+    }
+
+    // Hand each compress thread one run of consecutive blocks. RunWorker
+    // rotates over the compress queues, so the runs land on different
+    // threads.
+    wa->pendingGroups = numGroups;
+    int first = wa->startBlock;
+    for (int i = 0; i < numGroups; ++i) {
+      CompressStreamWA::Group *g = &wa->groups[i];
+      g->stream = wa;
+      g->firstBlock = first;
+      g->numBlocks = (wa->numBlocks - first) / (numGroups - i);
+      first += g->numBlocks;
+      RunWorker(g, StreamWorker, StreamGroupDone, g, &g->compressionwa);
+    }
+  }
+
+  static int          CompressStreamBlockI(CompressStreamWA *wa, int i,
+                                           CompressorScratchMem *scratch) {
+    unsigned int off = i * CompressChunkSize;
+    unsigned int len = MIN((unsigned int) CompressChunkSize, wa->inLen - off);
+    CompressStreamBlock *b = &wa->blocks[i];
+    b->buf = wa->outBuf + off;
+    b->origLen = len;
+
+    struct iovec ovec;
+    ovec.iov_base = b->buf;
+    ovec.iov_len = CompressChunkSize;
+    uint16_t retLen = 0;
+    uint32_t crc = 0;
+    uint8_t type = wa->compressionType;
+    int err = 0;
+    if (wa->sampling) {
+      err = wa->selector->SampleBlock(wa->inBuf + off, len, &ovec, &retLen,
+                                      &type, scratch);
+    } else if (type != CompressionType::OFF) {
+      err = Compressor::Compress(type, wa->inBuf + off, len,
+                                 &ovec, 1, &retLen, &crc, scratch);
+    }
+
+    if (type == CompressionType::OFF) {
+      // selector found the data incompressible, do not try
+      memcpy(b->buf, wa->inBuf + off, len);
+      b->len = len;
+      b->compressionType = CompressionType::OFF;
+      CountBlock(&FileserverStats::unCompressedBlocks);
+    } else if (err || retLen == 0 ||
+               retLen > BaseCompressor::MinCompressSavings(len)) {
+      memcpy(b->buf, wa->inBuf + off, len);
+      b->len = len;
+      b->compressionType = CompressionType::OFF;
+      CountBlock(&FileserverStats::compressFailedBlocks);
+    } else {
+      b->len = retLen;
+      b->compressionType = type;
+      CountBlock(&FileserverStats::compressedBlocks);
+    }
+    b->crc = XorCrc32::ComputeUnalign(b->buf, 0, b->len);
+    return 0;
+  }
+
+  static int          DecompressStreamBlockI(CompressStreamWA *wa, int i,
+                                             CompressorScratchMem *scratch) {
+    const CompressStreamBlock *b = &wa->blocks[i];
+    uint8_t *out = wa->outBuf + i * CompressChunkSize;
+
+    if (XorCrc32::ComputeUnalign(b->buf, 0, b->len) != b->crc) {
+      return EIO;
+    }
+    if (b->compressionType == CompressionType::OFF) {
+      memcpy(out, b->buf, b->origLen);
+      return 0;
+    }
+
+    struct iovec ivec;
+    ivec.iov_base = b->buf;
+    ivec.iov_len = b->len;
+    return Compressor::Decompress(b->compressionType, &ivec, 1,
+                                  out, b->origLen, scratch);
+  }
+
+  static void         StreamWorker(void *arg, void *lzstate) {
+    CompressStreamWA::Group *g = static_cast <CompressStreamWA::Group *> (arg);
+    CompressStreamWA *wa = g->stream;
+    CompressorScratchMem *scratch =
+      static_cast <CompressorScratchMem *> (lzstate);
+    int err = 0;
+
+    int end = g->firstBlock + g->numBlocks;
+    for (int i = g->firstBlock; i < end && !err; ++i) {
+      err = wa->isCompress ? CompressStreamBlockI(wa, i, scratch)
+                           : DecompressStreamBlockI(wa, i, scratch);
+    }
+    g->compressionwa.err = err;
+  }
+
+  static inline void  CountBlock(uint64_t FileserverStats::*stat) {
+    if (serverStats) {
+      atomic_add64(&(ServerStats().fs.*stat), 1);
+    }
+  }
+
+  // the sampling run of a selector CompressStream is done, spread the
+  // remaining blocks with the codec it picked
+  static void         StreamSampleDone(void *arg, int err) {
+    CompressStreamWA::Group *g = static_cast <CompressStreamWA::Group *> (arg);
+    CompressStreamWA *wa = g->stream;
+
+    if (err || wa->startBlock >= wa->numBlocks) {
+      wa->cb(wa->cbarg, err);
+      return;
+    }
+    wa->sampling = false;
+    wa->compressionType = wa->selector->GetType();
+    wa->compression->StartStream(wa->cb, wa->cbarg, wa);
+  }
+
+  static void         StreamGroupDone(void *arg, int err) {
+    CompressStreamWA::Group *g = static_cast <CompressStreamWA::Group *> (arg);
+    CompressStreamWA *wa = g->stream;
+
+    // any one error is good enough to report
+    if (err) {
+      wa->err = err;
+    }
+    if (atomic_sub32(&wa->pendingGroups, 1) == 1) {
+      wa->cb(wa->cbarg, wa->err);
+    }
   }
 
   static void         HandleCompressionWork(void *arg, int err);
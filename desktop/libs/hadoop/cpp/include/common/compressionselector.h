@@ -0,0 +1,195 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+#ifndef COMPRESSIONSELECTOR_H__
+#define COMPRESSIONSELECTOR_H__
+
+#include "common/nonlinuxsupport.h"
+
+#ifndef __WINDOWS__
+#include <sys/uio.h>
+#include <time.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include "common/common.h"
+#include "common/compressor.h"
+#include "common/stats.h"
+
+namespace mapr {
+namespace fs {
+
+// Picks the codec for a stream of CompressChunkSize blocks.
+//
+// The first sampleBlocks blocks of the stream are compressed with every
+// candidate codec while the compressed size and time are recorded. After
+// that the candidate with the best ratio whose cost stays within
+// maxNsPerByte is used for the rest of the stream. If no candidate fits
+// the budget the cheapest one that still compresses is used, and if none
+// of them saved BaseCompressor::MinCompressSavings on the samples the
+// stream is stored uncompressed (CompressionType::OFF) without any
+// further compression attempts.
+//
+// A selector is not thread safe; Compression::CompressStream samples on
+// one compress thread and only reads the decision afterwards.
+class CompressionSelector {
+public:
+  static const int      NumCandidates = 3;
+  static const int      DefaultSampleBlocks = 8;
+  static const uint32_t DefaultMaxNsPerByte = 20;
+
+  CompressionSelector() {
+    Init(DefaultSampleBlocks, DefaultMaxNsPerByte);
+  }
+
+  void Init(int sampleBlocks, uint32_t maxNsPerByte) {
+    static const uint8_t candidates[NumCandidates] = {
+      CompressionType::LZF,
+      CompressionType::LZ4,
+      CompressionType::ZLIB,
+    };
+
+    for (int i = 0; i < NumCandidates; ++i) {
+      samples_[i].type = candidates[i];
+      samples_[i].inBytes = 0;
+      samples_[i].outBytes = 0;
+      samples_[i].nsecs = 0;
+    }
+    sampleBlocks_ = sampleBlocks;
+    sampledBlocks_ = 0;
+    maxNsPerByte_ = maxNsPerByte;
+    chosenType_ = CompressionType::OFF;
+    decided_ = (sampleBlocks <= 0);
+    if (decided_) {
+      chosenType_ = DefaultCompressionType;
+    }
+  }
+
+  inline bool IsSampling() const { return !decided_; }
+  inline int SampleBlocksLeft() const {
+    return decided_ ? 0 : sampleBlocks_ - sampledBlocks_;
+  }
+
+  // Codec for the blocks following the samples. Only meaningful once
+  // IsSampling() returns false.
+  inline uint8_t GetType() const { return chosenType_; }
+
+  // SampleBlock
+  // Compresses one block with every candidate and records the result.
+  // ovec receives the block compressed with the smallest result and
+  // *type its codec, or CompressionType::OFF if no candidate saved
+  // enough, in which case the caller stores the block as is.
+  int SampleBlock(const uint8_t *inBuf, unsigned int inLen,
+                  struct iovec *ovec, uint16_t *retLen, uint8_t *type,
+                  CompressorScratchMem *scratch) {
+    uint16_t best = 0;
+    uint16_t maxLen = BaseCompressor::MinCompressSavings(inLen);
+    *type = CompressionType::OFF;
+
+    for (int i = 0; i < NumCandidates; ++i) {
+      uint16_t len = 0;
+      uint32_t crc = 0;
+      uint64_t start = NowNsecs();
+      int err = Compressor::Compress(samples_[i].type, inBuf, inLen,
+                                     ovec, 1, &len, &crc, scratch);
+      samples_[i].nsecs += NowNsecs() - start;
+      samples_[i].inBytes += inLen;
+      // a failed attempt counts as storing the block as is
+      samples_[i].outBytes += (err || len == 0) ? inLen : len;
+
+      if (!err && len && len <= maxLen && (!best || len < best)) {
+        best = len;
+        *type = samples_[i].type;
+      }
+    }
+
+    *retLen = 0;
+    int err = 0;
+    if (*type != CompressionType::OFF) {
+      // the last candidate overwrote the output, redo the winner
+      uint32_t crc = 0;
+      err = Compressor::Compress(*type, inBuf, inLen, ovec, 1,
+                                 retLen, &crc, scratch);
+    }
+
+    if (++sampledBlocks_ >= sampleBlocks_) {
+      Decide();
+    }
+    return err;
+  }
+
+private:
+  struct Sample {
+    uint8_t   type;
+    uint64_t  inBytes;
+    uint64_t  outBytes;
+    uint64_t  nsecs;
+  };
+
+  static inline uint64_t NowNsecs() {
+#ifndef __WINDOWS__
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((uint64_t) tv.tv_sec * 1000000000ULL) + tv.tv_usec * 1000ULL;
+#endif
+  }
+
+  void Decide() {
+    int best = -1;
+    int cheapest = -1;
+
+    for (int i = 0; i < NumCandidates; ++i) {
+      Sample *s = &samples_[i];
+      // same 1/8 savings rule as BaseCompressor::MinCompressSavings
+      if (!s->inBytes || s->outBytes > s->inBytes - (s->inBytes >> 3)) {
+        continue;  // did not compress
+      }
+      if (cheapest < 0 || s->nsecs < samples_[cheapest].nsecs) {
+        cheapest = i;
+      }
+      if (s->nsecs <= s->inBytes * maxNsPerByte_ &&
+          (best < 0 || s->outBytes < samples_[best].outBytes)) {
+        best = i;
+      }
+    }
+
+    if (best < 0) {
+      best = cheapest;
+    }
+    chosenType_ = (best < 0) ? (uint8_t) CompressionType::OFF
+                             : samples_[best].type;
+    decided_ = true;
+
+    if (serverStats) {
+      CompressionStats *cs = &ServerStats().compress;
+      for (int i = 0; i < NumCandidates; ++i) {
+        Sample *s = &samples_[i];
+        atomic_add64(&cs->sampledBlocks[s->type], sampledBlocks_);
+        atomic_add64(&cs->sampledBytesIn[s->type], s->inBytes);
+        atomic_add64(&cs->sampledBytesOut[s->type], s->outBytes);
+        atomic_add64(&cs->sampledNsecs[s->type], s->nsecs);
+      }
+      if (chosenType_ == CompressionType::OFF) {
+        atomic_add64(&cs->streamsUncompressed, 1);
+      } else {
+        atomic_add64(&cs->streamsChosen[chosenType_], 1);
+      }
+    }
+  }
+
+  Sample    samples_[NumCandidates];
+  int       sampleBlocks_;
+  int       sampledBlocks_;
+  uint32_t  maxNsPerByte_;
+  uint8_t   chosenType_;
+  bool      decided_;
+};
+
+} // namespace fs
+} // namespace mapr
+
+#endif  // COMPRESSIONSELECTOR_H__
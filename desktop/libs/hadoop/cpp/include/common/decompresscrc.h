@@ -0,0 +1,49 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+#ifndef DECOMPRESSCRC_H__
+#define DECOMPRESSCRC_H__
+
+#include "common/nonlinuxsupport.h"
+
+#ifndef __WINDOWS__
+#include <sys/uio.h>
+#endif
+
+#include "common/common.h"
+#include "common/compressor.h"
+#include "common/lzf.h"
+#include "common/xorcrc32.h"
+
+namespace mapr {
+namespace fs {
+
+// DecompressCRC
+// Compressor::Decompress that also returns the XorCrc32 of the output in
+// crcOut, so a read can be verified without a second pass over outBuf
+// once it has left the cache. LZF folds the checksum into its own output
+// loop, see LZF::DecompressCRC(); the other codecs' loops are in
+// libMapRClient or upstream, so their blocks are checksummed right after
+// they are decompressed, while still in cache.
+inline int DecompressCRC(uint32_t compressionType,
+                         const struct iovec *ivec,
+                         int nvec,
+                         uint8_t *outBuf,
+                         int outLen,
+                         uint32_t *crcOut,
+                         CompressorScratchMem *scratch) {
+  if (compressionType == CompressionType::LZF) {
+    LZF lzf;
+    return lzf.DecompressCRC(ivec, nvec, outBuf, outLen, crcOut, scratch);
+  }
+  int err = Compressor::Decompress(compressionType, ivec, nvec, outBuf,
+                                   outLen, scratch);
+  if (!err) {
+    *crcOut = XorCrc32::ComputeUnalign(outBuf, 0, outLen);
+  }
+  return err;
+}
+
+} // namespace fs
+} // namespace mapr
+
+#endif  // DECOMPRESSCRC_H__
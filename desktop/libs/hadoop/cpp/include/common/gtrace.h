@@ -17,6 +17,10 @@
 #include "common/gtracelevel.h"
 #include "common/modules.h"
 #include "common/fileids.h"
+#include "common/gtracebinlog.h"
+#include "common/gtracering.h"
+#include "common/gtracestate.h"
+#include "common/gtracewriter.h"
 #include "rpc/dispatch.h"
 
 #if __GNUC__ >= 3
@@ -222,10 +226,31 @@ namespace GTraceMode {
   enum {
     DEFAULT = 0, // Keep everything in memory
     CONTINUOUS, // Keep flushing new traces on stdout
-    CONTINUOUS_SHORT // Keep flushing new traces to stdout but keep em short
+    CONTINUOUS_SHORT, // Keep flushing new traces to stdout but keep em short
+    BINARY // Keep appending raw entries to a mapped file, see gtracedecode
   };
 }
 
+// What a GTraceSingleThread keeps beyond the layout libMapRClient has
+// for it, in a GTraceStateTable.
+struct GTraceThreadState {
+  GTraceRingSet         *rings;  // entries go there instead of inMemBuffer_
+  GTraceBinLog          *binLog;  // opened by the first StartBinaryLog()
+  GTraceBinLog * volatile binary; // binLog while BINARY mode is on
+  GTraceAsyncWriter     *writer;  // made by the first StartAsyncWriter()
+  GTraceAsyncWriter * volatile async; // writer while it is running
+};
+
+// Sampling and rate limit of a module's Info and Debug entries, 0 is
+// off. Kept beside ModuleInfo, whose layout libMapRClient has.
+struct GTraceModuleLimits {
+  uint32_t              sampleEvery;  // keep one in sampleEvery entries
+  uint32_t              ratePerSec;   // keep at most this many a second
+  volatile uint64_t     sampleCount;  // entries seen while sampling
+  volatile uint64_t     rateTat;      // next free slot of the rate, nsecs
+  volatile uint64_t     suppressed;   // entries dropped by either
+};
+
 class GTraceSingleThread {
 
 // header information per process
@@ -292,6 +317,9 @@ private:
   int    maxSizePerLogFile_;
   int    maxNumOfLogFiles_;
 
+  // nextEntry of an entry that lives in a ring, never a buffer index
+  static const uint32_t RingEntry = ~0U;
+
   Entry* AllocEntry(uint8_t len, uint64_t **data);
   /* Bunch of internally used functions */
   void FormatTime(struct timeval *time);
@@ -314,6 +342,141 @@ private:
   void RenameOldLogFiles();
   bool IsLogFileReachedLimit();
 
+  typedef GTraceStateTable<GTraceThreadState, 9> StateTable;
+
+  static StateTable &States() {
+    static StateTable table;
+    return table;
+  }
+
+  // State
+  // NULL until rings, BINARY mode or the async writer are used.
+  inline GTraceThreadState *State() { return States().Find(this); }
+
+  // where Alloc() put an entry, for Commit()
+  struct Slot {
+    GTraceThreadState   *state;
+    GTraceRing          *ring;   // NULL for an entry in inMemBuffer_
+  };
+
+  // Alloc
+  // Entry in the calling thread's ring, no lock taken. Falls back to the
+  // shared buffer without rings or when the thread cannot get one.
+  inline Entry *Alloc(uint8_t len, uint64_t **data, Slot *slot) {
+    GTraceThreadState *st = State();
+    GTraceRing *r = (st && st->rings) ? st->rings->Mine() : NULL;
+    slot->state = st;
+    slot->ring = r;
+    if (!r) {
+      return AllocEntry(len, data);
+    }
+    Entry *e = (Entry *) r->Reserve(Estimate(len));
+    e->nextEntry = e->prevEntry = RingEntry;
+    *data = (uint64_t *) (e + 1);
+    return e;
+  }
+
+  // Commit
+  // Publishes an entry from Alloc() and writes it out when the mode or
+  // level asks for it. In BINARY mode the entry is copied to the log as
+  // is and only forced entries are formatted. With an async writer the
+  // entry is queued for it instead of written here, and FlushEntry()
+  // only finishes an entry from AllocEntry().
+  inline void Commit(Entry *e, uint64_t *data, const Slot &slot,
+                     bool forceFlush) {
+    GTraceBinLog *bin = slot.state ? slot.state->binary : NULL;
+    if (bin) {
+      bin->Append(e, Estimate(e->length), e->fmt);
+    }
+    GTraceAsyncWriter *w = slot.state ? slot.state->async : NULL;
+    if (w && (forceFlush || !bin)) {
+      w->Push(e, Estimate(e->length), forceFlush);
+      forceFlush = false;
+    }
+    if (!slot.ring) {
+      FlushEntry(e, data, forceFlush);
+      return;
+    }
+    slot.ring->Commit(GTraceRingSet::Stamp(e->timestamp));
+    slot.state->rings->NoteFormat(e->fmt);
+    // FlushEntry() ends AllocEntry()'s locked section, so a ring entry
+    // is written out here
+    if (forceFlush || (!bin && mode_ != GTraceMode::DEFAULT)) {
+      WriteEntry(e, data, forceFlush);
+    }
+  }
+
+  // WriteEntry
+  // Formats an entry that is not in inMemBuffer_ and writes it to the
+  // log, or to stdout.
+  void WriteEntry(Entry *e, uint64_t *data, bool flush) {
+    char line[2048];
+    int n = PrintEntry(line, sizeof(line), e, data);
+    if (n <= 0) {
+      return;
+    }
+    FILE *fp = outfp ? outfp : stdout;
+    fwrite(line, 1, MIN(n, (int) sizeof(line) - 1), fp);
+    if (flush) {
+      fflush(fp);
+    }
+  }
+
+  // Admit
+  // Applies the module's sampling and rate limit to an entry that passed
+  // the level check. Warn and more severe entries are always kept.
+  static inline bool Admit(uint8_t module, uint8_t level) {
+    GTraceModuleLimits &m = ModuleLimits()[module];
+    if (likely((m.sampleEvery | m.ratePerSec) == 0) ||
+        level <= TraceLevel::Warn) {
+      return true;
+    }
+    return AdmitLimited(m);
+  }
+
+  static bool AdmitLimited(GTraceModuleLimits &m) {
+    uint32_t every = m.sampleEvery;
+    if (every > 1 && atomic_add64(&m.sampleCount, 1) % every != 0) {
+      atomic_add64(&m.suppressed, 1);
+      return false;
+    }
+    uint32_t rate = m.ratePerSec;
+    if (!rate) {
+      return true;
+    }
+    // token bucket of one second worth of entries, kept as the time the
+    // next entry is due: each entry moves it on by 1/rate seconds
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t now = ((uint64_t) tv.tv_sec * 1000000 + tv.tv_usec) * 1000;
+    uint64_t step = 1000000000ULL / rate;
+    for (;;) {
+      uint64_t tat = m.rateTat;
+      uint64_t next = MAX(tat, now) + step;
+      if (next > now + 1000000000ULL) {
+        atomic_add64(&m.suppressed, 1);
+        return false;
+      }
+      if (atomic_cas64(&m.rateTat, tat, next)) {
+        return true;
+      }
+    }
+  }
+
+  static int FormatRecord(void *arg, char *buf, int size, const uint8_t *rec,
+                          uint32_t /* len */) {
+    GTraceSingleThread *gt = (GTraceSingleThread *) arg;
+    Entry *e = (Entry *) rec;
+    int n = gt->PrintEntry(buf, size, e, (uint64_t *) (e + 1));
+    return MIN(n, size - 1);
+  }
+
+  static void PrintRecord(void *arg, uint8_t *rec, uint32_t /* len */) {
+    GTraceSingleThread *gt = (GTraceSingleThread *) arg;
+    Entry *e = (Entry *) rec;
+    gt->WriteEntry(e, (uint64_t *) (e + 1), false);
+  }
+
 
 public:
   void SetFile(FILE *fp);
@@ -341,13 +504,168 @@ public:
   
   int Resize(uint32_t newsize);
   void SetMode(uint8_t mode);
+
+  // UseRings
+  // From now on every thread traces into its own ring of ringSize bytes
+  // and Dump() merges them by time. With mapDir the rings of the first
+  // maxRings threads are kept in a file there that outlives a crash.
+  // Call it once, after Initialize().
+  int UseRings(uint32_t ringSize, const char *mapDir = NULL,
+               int maxRings = GTraceRingSet::DefaultMappedRings) {
+    GTraceThreadState *st = States().Get(this);
+    if (!st) {
+      return ENOSPC;
+    }
+    if (st->rings) {
+      return EEXIST;
+    }
+    GTraceRingSet *rings = new GTraceRingSet();
+    rings->SetRingSize(ringSize);
+    if (mapDir) {
+      int err = rings->MapFile(mapDir, maxRings);
+      if (err) {
+        delete rings;
+        return err;
+      }
+    }
+    st->rings = rings;
+    return 0;
+  }
+  inline bool UsingRings() {
+    GTraceThreadState *st = State();
+    return st && st->rings;
+  }
+
+  // StartBinaryLog
+  // Appends every entry to <base>.<n>.gtb files of fileSize bytes, the
+  // last numFiles kept, instead of formatting it. The caller puts mode_
+  // back to DEFAULT. The log is opened once: starting it again after
+  // StopBinaryLog() goes on appending where it stopped, to the files it
+  // was first opened with.
+  int StartBinaryLog(const char *base, uint32_t fileSize, int numFiles) {
+    typedef char EntryMatchesRawEntry[
+      (sizeof(Entry) == sizeof(GTraceBinLog::RawEntry)) ? 1 : -1];
+    (void) sizeof(EntryMatchesRawEntry);
+
+    GTraceThreadState *st = States().Get(this);
+    if (!st) {
+      return ENOSPC;
+    }
+    if (!st->binLog) {
+      GTraceBinLog *bin = new GTraceBinLog();
+      int err = bin->Open(base, fileSize, numFiles);
+      if (err) {
+        delete bin;
+        return err;
+      }
+      st->binLog = bin;
+    }
+    st->binary = st->binLog;
+    return 0;
+  }
+
+  // StopBinaryLog
+  // Tracing threads may still be appending, so the log stays open and
+  // mapped for the next StartBinaryLog().
+  void StopBinaryLog() {
+    GTraceThreadState *st = State();
+    if (st) {
+      st->binary = NULL;
+    }
+  }
+
+  inline GTraceBinLog *GetBinaryLog() {
+    GTraceThreadState *st = State();
+    return st ? st->binary : NULL;
+  }
+
+  // StartAsyncWriter
+  // Hands CONTINUOUS mode output to a writer thread through a queue of
+  // queueSlots entries. It appends to the log file, or stdout, and
+  // rotates it as the log would be. The caller puts mode_ back to
+  // DEFAULT. The writer is made once: starting it again after
+  // StopAsyncWriter() reuses it, and its queue.
+  int StartAsyncWriter(uint32_t queueSlots) {
+    GTraceThreadState *st = States().Get(this);
+    if (!st) {
+      return ENOSPC;
+    }
+    if (st->async) {
+      return 0;
+    }
+    bool toFile = !useStdOut && logFileName[0];
+    uint64_t maxBytes = (toFile && shouldRotateLog) ?
+                          (uint64_t) maxSizePerLogFile_ << 20 : 0;
+    fflush(outfp ? outfp : stdout);
+    GTraceAsyncWriter *w = st->writer;
+    if (!w) {
+      w = new GTraceAsyncWriter(FormatRecord, this);
+    }
+    int err = w->Start(toFile ? logFileName : NULL, maxBytes,
+                       maxNumOfLogFiles_, queueSlots);
+    if (err) {
+      if (w != st->writer) {
+        delete w;
+      }
+      return err;
+    }
+    st->writer = w;
+    st->async = w;
+    return 0;
+  }
+
+  // StopAsyncWriter
+  // Writes out what is queued. Tracing threads may still hold the
+  // writer, so it is kept for the next StartAsyncWriter(). The writer
+  // may have rotated the log from under outfp, which is then moved to
+  // the current one.
+  void StopAsyncWriter() {
+    GTraceThreadState *st = State();
+    GTraceAsyncWriter *w = st ? st->async : NULL;
+    if (!w) {
+      return;
+    }
+    st->async = NULL;
+    w->Stop();
+#ifndef __WINDOWS__
+    if (outfp && outfp != stdout && !useStdOut && logFileName[0]) {
+      int fd = open(logFileName, O_WRONLY | O_CREAT | O_APPEND, 0644);
+      if (fd >= 0) {
+        fflush(outfp);
+        dup2(fd, fileno(outfp));
+        close(fd);
+      }
+    }
+#endif
+  }
+
+  inline GTraceAsyncWriter *GetAsyncWriter() {
+    GTraceThreadState *st = State();
+    return st ? st->async : NULL;
+  }
+
+  // DumpRings
+  // Prints and consumes what is in the rings, oldest first, or only the
+  // calling thread's ring.
+  void DumpRings(bool currentOnly) {
+    GTraceRingSet *rings = State()->rings;
+    GTraceRing *only = currentOnly ? rings->Mine() : NULL;
+    if (!currentOnly || only) {
+      rings->Merge(PrintRecord, this, only);
+    }
+    fflush(outfp ? outfp : stdout);
+  }
   // Use stdout. Must be called before Initialize().
   void UseStdOut() {
     useStdOut = true;
   }
 
   inline const char * GetModeStr() {
-    if (mode_ == GTraceMode::DEFAULT) {
+    if (GetBinaryLog()) {
+      return "BINARY";
+    } else if (GetAsyncWriter()) {
+      return "CONTINUOUS";
+    } else if (mode_ == GTraceMode::DEFAULT) {
       return "DEFAULT";
     } else if (mode_ == GTraceMode::CONTINUOUS) {
       return "CONTINUOUS";
@@ -373,6 +691,41 @@ public:
     }
   }
 
+  // ModuleLimits
+  // The limits of each module, indexed like ModuleInfo. All off until
+  // SetSampling() or SetRateLimit().
+  static inline GTraceModuleLimits *ModuleLimits() {
+    static GTraceModuleLimits limits[Module::Total];
+    return limits;
+  }
+
+  // SetSampling
+  // Keeps one in every Info and Debug entries of the module, or of all
+  // modules for Module::Total. 0 or 1 keeps them all.
+  static void SetSampling(uint8_t module, uint32_t every) {
+    GTraceModuleLimits *limits = ModuleLimits();
+    for (int i = 0; i < (uint8_t) Module::Total; ++i) {
+      if (module == i || module == (uint8_t) Module::Total) {
+        limits[i].sampleCount = 0;
+        limits[i].sampleEvery = every;
+      }
+    }
+  }
+
+  // SetRateLimit
+  // Keeps at most perSec Info and Debug entries a second of the module,
+  // or of each module for Module::Total, with bursts of up to perSec.
+  // 0 removes the limit.
+  static void SetRateLimit(uint8_t module, uint32_t perSec) {
+    GTraceModuleLimits *limits = ModuleLimits();
+    for (int i = 0; i < (uint8_t) Module::Total; ++i) {
+      if (module == i || module == (uint8_t) Module::Total) {
+        limits[i].rateTat = 0;
+        limits[i].ratePerSec = perSec;
+      }
+    }
+  }
+
   inline void SetHeader(const char *host, uint32_t ip, uint32_t port, uint32_t pid,
                         const char *prg, const char *custMsg=NULL) {
     header_= new Header;
@@ -386,6 +739,11 @@ public:
   }
 
   inline void Reset(bool shouldLock) {
+    GTraceThreadState *st = State();
+    if (st && st->rings) {
+      st->rings->Skip();
+      return;
+    }
     if (shouldLock)
       LOCK_BUF;
     prev_ = next_ = current_ = 0;
@@ -410,647 +768,698 @@ public:
 
   /* no argument */
   inline void Gtrace(TRACE_FUNC_SIGNATURE) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       uint64_t *data = NULL;
-      Entry *e = AllocEntry(0, &data);
+      Slot slot;
+      Entry *e = Alloc(0, &data, &slot);
       SETENTRY(0);
       e->type = NOVAL;
-      FlushEntry(e, data, level <= TraceLevel::Err);
+      Commit(e, data, slot, level <= TraceLevel::Err);
     }
   }
 
   /* one int arg */
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_1) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       uint64_t *data = NULL;
-      Entry *e = AllocEntry(1, &data);
+      Slot slot;
+      Entry *e = Alloc(1, &data, &slot);
       SETENTRY(1);
       SAVEDATA_1;
       e->type = INTVAL_1;
-      FlushEntry(e, data, level <= TraceLevel::Err);
+      Commit(e, data, slot, level <= TraceLevel::Err);
     }
   }
   
   /* two int args */
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_2) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       uint64_t *data = NULL;
-      Entry *e = AllocEntry(2, &data);
+      Slot slot;
+      Entry *e = Alloc(2, &data, &slot);
       SETENTRY(2);
       SAVEDATA_2;
       e->type = INTVAL_2;
-      FlushEntry(e, data, level <= TraceLevel::Err);
+      Commit(e, data, slot, level <= TraceLevel::Err);
     }
   }
 
   /* three int args */
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_3) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       uint64_t *data = NULL;
-      Entry *e = AllocEntry(3, &data);
+      Slot slot;
+      Entry *e = Alloc(3, &data, &slot);
       SETENTRY(3);
       SAVEDATA_3;
       e->type = INTVAL_3;
-      FlushEntry(e, data, level <= TraceLevel::Err);
+      Commit(e, data, slot, level <= TraceLevel::Err);
     }
   }
 
   /* four int args */
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_4) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       uint64_t *data = NULL;
-      Entry *e = AllocEntry(4, &data);
+      Slot slot;
+      Entry *e = Alloc(4, &data, &slot);
       SETENTRY(4);
       SAVEDATA_4;
       e->type = INTVAL_4;
-      FlushEntry(e, data, level <= TraceLevel::Err);
+      Commit(e, data, slot, level <= TraceLevel::Err);
     }
   }
 
   /* five int args */
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_5) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       uint64_t *data = NULL;
-      Entry *e = AllocEntry(5, &data);
+      Slot slot;
+      Entry *e = Alloc(5, &data, &slot);
       SETENTRY(5);
       SAVEDATA_5;
       e->type = INTVAL_5;
-      FlushEntry(e, data, level <= TraceLevel::Err);
+      Commit(e, data, slot, level <= TraceLevel::Err);
     }
   }
 
   /* six int args */
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_6) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       uint64_t *data = NULL;
-      Entry *e = AllocEntry(6, &data);
+      Slot slot;
+      Entry *e = Alloc(6, &data, &slot);
       SETENTRY(6);
       SAVEDATA_6;
       e->type = INTVAL_6;
-      FlushEntry(e, data, level <= TraceLevel::Err);
+      Commit(e, data, slot, level <= TraceLevel::Err);
     }
   }
 
   /* seven int args */
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_7) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       uint64_t *data = NULL;
-      Entry *e = AllocEntry(7, &data);
+      Slot slot;
+      Entry *e = Alloc(7, &data, &slot);
       SETENTRY(7);
       SAVEDATA_7;
       e->type = INTVAL_7;
-      FlushEntry(e, data, level <= TraceLevel::Err);
+      Commit(e, data, slot, level <= TraceLevel::Err);
     }
   }
 
   /* eight int args */
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_8) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       uint64_t *data = NULL;
-      Entry *e = AllocEntry(8, &data);
+      Slot slot;
+      Entry *e = Alloc(8, &data, &slot);
       SETENTRY(8);
       SAVEDATA_8;
       e->type = INTVAL_8;
-      FlushEntry(e, data, level <= TraceLevel::Err);
+      Commit(e, data, slot, level <= TraceLevel::Err);
     }  
   }
 
   /* nine int args */
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_9) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       uint64_t *data = NULL;
-      Entry *e = AllocEntry(9, &data);
+      Slot slot;
+      Entry *e = Alloc(9, &data, &slot);
       SETENTRY(9);
       SAVEDATA_9;
       e->type = INTVAL_9;
-      FlushEntry(e, data, level <= TraceLevel::Err);
+      Commit(e, data, slot, level <= TraceLevel::Err);
     }  
   }
   
   /* ten int args */
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_10) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       uint64_t *data = NULL;
-      Entry *e = AllocEntry(10, &data);
+      Slot slot;
+      Entry *e = Alloc(10, &data, &slot);
       SETENTRY(10);
       SAVEDATA_10;
       e->type = INTVAL_10;
-      FlushEntry(e, data, level <= TraceLevel::Err);
+      Commit(e, data, slot, level <= TraceLevel::Err);
     }  
   }
 
   /* 11 int args */
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_11) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       uint64_t *data = NULL;
-      Entry *e = AllocEntry(11, &data);
+      Slot slot;
+      Entry *e = Alloc(11, &data, &slot);
       SETENTRY(11);
       SAVEDATA_11;
       e->type = INTVAL_11;
-      FlushEntry(e, data, level <= TraceLevel::Err);
+      Commit(e, data, slot, level <= TraceLevel::Err);
     }  
   }
  
   /* 12 int args */
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_12) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       uint64_t *data = NULL;
-      Entry *e = AllocEntry(12, &data);
+      Slot slot;
+      Entry *e = Alloc(12, &data, &slot);
       SETENTRY(12);
       SAVEDATA_12;
       e->type = INTVAL_12;
-      FlushEntry(e, data, level <= TraceLevel::Err);
+      Commit(e, data, slot, level <= TraceLevel::Err);
     }  
   }
 
   /* 13 int args */
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_13) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       uint64_t *data = NULL;
-      Entry *e = AllocEntry(13, &data);
+      Slot slot;
+      Entry *e = Alloc(13, &data, &slot);
       SETENTRY(13);
       SAVEDATA_13;
       e->type = INTVAL_13;
-      FlushEntry(e, data, level <= TraceLevel::Err);
+      Commit(e, data, slot, level <= TraceLevel::Err);
     }  
   }
 
   /* 14 int args */
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_14) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       uint64_t *data = NULL;
-      Entry *e = AllocEntry(14, &data);
+      Slot slot;
+      Entry *e = Alloc(14, &data, &slot);
       SETENTRY(14);
       SAVEDATA_14;
       e->type = INTVAL_14;
-      FlushEntry(e, data, level <= TraceLevel::Err);
+      Commit(e, data, slot, level <= TraceLevel::Err);
     }  
   }
 
   /* 15 int args */
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_15) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       uint64_t *data = NULL;
-      Entry *e = AllocEntry(15, &data);
+      Slot slot;
+      Entry *e = Alloc(15, &data, &slot);
       SETENTRY(15);
       SAVEDATA_15;
       e->type = INTVAL_15;
-      FlushEntry(e, data, level <= TraceLevel::Err);
+      Commit(e, data, slot, level <= TraceLevel::Err);
     }  
   }
   
   /* 16 int args */
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_16) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       uint64_t *data = NULL;
-      Entry *e = AllocEntry(16, &data);
+      Slot slot;
+      Entry *e = Alloc(16, &data, &slot);
       SETENTRY(16);
       SAVEDATA_16;
       e->type = INTVAL_16;
-      FlushEntry(e, data, level <= TraceLevel::Err);
+      Commit(e, data, slot, level <= TraceLevel::Err);
     }  
   }
 
   /* String functions 
    * one string 0 or 16 integers*/
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_1) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64);
       SAVESTR_1;
       e->type = ONE_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_1, INTPARAM_1) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 1, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 1, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 1);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_1;
       e->type = ONE_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_1, INTPARAM_2) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 2, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 2, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 2);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_2;
       e->type = ONE_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
  
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_1, INTPARAM_3) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 3, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 3, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 3);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_3;
       e->type = ONE_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_1, INTPARAM_4) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 4, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 4, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 4);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_4;
       e->type = ONE_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_1, INTPARAM_5) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 5, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 5, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 5);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_5;
       e->type = ONE_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_1, INTPARAM_6) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 6, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 6, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 6);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_6;
       e->type = ONE_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_1, INTPARAM_7) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 7, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 7, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 7);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_7;
       e->type = ONE_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_1, INTPARAM_8) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 8, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 8, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 8);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_8;
       e->type = ONE_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_1, INTPARAM_9) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 9, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 9, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 9);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_9;
       e->type = ONE_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_1, INTPARAM_10) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 10, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 10, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 10);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_10;
       e->type = ONE_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_1, INTPARAM_11) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 11, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 11, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 11);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_11;
       e->type = ONE_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_1, INTPARAM_12) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 12, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 12, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 12);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_12;
       e->type = ONE_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_1, INTPARAM_13) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 13, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 13, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 13);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_13;
       e->type = ONE_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_1, INTPARAM_14) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 14, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 14, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 14);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_14;
       e->type = ONE_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_1, INTPARAM_15) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 15, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 15, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 15);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_15;
       e->type = ONE_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_1, INTPARAM_16) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 16, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 16, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 16);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_16;
       e->type = ONE_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   /* String functions 
    * two strings 0 or 16 integers*/
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_2) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64);      
       SAVESTR_2;
       e->type = TWO_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_2, INTPARAM_1) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 1, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 1, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 1);      
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES);
       SAVEDATA_1;
       e->type = TWO_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_2, INTPARAM_2) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 2, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 2, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 2);      
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES);
       SAVEDATA_2;
       e->type = TWO_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_2, INTPARAM_3) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 3, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 3, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 3);      
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES);
       SAVEDATA_3;
       e->type = TWO_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_2, INTPARAM_4) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 4, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 4, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 4);      
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES);
       SAVEDATA_4;
       e->type = TWO_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_2, INTPARAM_5) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 5, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 5, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 5);      
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES);
       SAVEDATA_5;
       e->type = TWO_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_2, INTPARAM_6) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 6, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 6, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 6);      
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES);
       SAVEDATA_6;
       e->type = TWO_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_2, INTPARAM_7) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 7, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 7, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 7);      
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES);
       SAVEDATA_7;
       e->type = TWO_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_2, INTPARAM_8) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 8, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 8, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 8);      
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES);
       SAVEDATA_8;
       e->type = TWO_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_2, INTPARAM_9) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 9, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 9, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 9);      
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES);
       SAVEDATA_9;
       e->type = TWO_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_2, INTPARAM_10) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 10, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 10, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 10);      
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES);
       SAVEDATA_10;
       e->type = TWO_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_2, INTPARAM_11) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 11, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 11, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 11); 
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES);
       SAVEDATA_11;
       e->type = TWO_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_2, INTPARAM_12) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 12, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 12, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 12);      
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES);
       SAVEDATA_12;
       e->type = TWO_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_2, INTPARAM_13) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 13, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 13, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 13);      
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES);
       SAVEDATA_13;
       e->type = TWO_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_2, INTPARAM_14) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 14, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 14, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 14);
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES);
       SAVEDATA_14;
       e->type = TWO_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_2, INTPARAM_15) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 15, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 15, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 15);
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES);
       SAVEDATA_15;
       e->type = TWO_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_2, INTPARAM_16) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 16, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 16, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 16);
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES);
       SAVEDATA_16;
       e->type = TWO_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   
@@ -1058,210 +1467,226 @@ public:
    * 1 or 16 integers and 1 string */
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_1, STRPARAM_1) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 1, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 1, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 1);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_1;
       e->type = ONE_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_2, STRPARAM_1) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 2, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 2, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 2);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_2;
       e->type = ONE_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
  
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_3, STRPARAM_1) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 3, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 3, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 3);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_3;
       e->type = ONE_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_4, STRPARAM_1) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 4, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 4, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 4);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_4;
       e->type = ONE_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_5, STRPARAM_1) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 5, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 5, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 5);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_5;
       e->type = ONE_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_6, STRPARAM_1) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 6, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 6, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 6);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_6;
       e->type = ONE_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_7, STRPARAM_1) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 7, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 7, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 7);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_7;
       e->type = ONE_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_8, STRPARAM_1) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 8, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 8, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 8);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_8;
       e->type = ONE_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_9, STRPARAM_1) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 9, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 9, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 9);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_9;
       e->type = ONE_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_10, STRPARAM_1) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 10, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 10, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 10);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_10;
       e->type = ONE_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_11, STRPARAM_1) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 11, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 11, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 11);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_11;
       e->type = ONE_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_12, STRPARAM_1) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 12, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 12, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 12);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_12;
       e->type = ONE_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_13, STRPARAM_1) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 13, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 13, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 13);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_13;
       e->type = ONE_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_14, STRPARAM_1) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 14, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 14, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 14);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_14;
       e->type = ONE_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_15, STRPARAM_1) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 15, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 15, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 15);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_15;
       e->type = ONE_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_16, STRPARAM_1) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(MAXSTRLEN_UINT64 + 16, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(MAXSTRLEN_UINT64 + 16, (uint64_t **)&strdata, &slot);
       SETENTRY(MAXSTRLEN_UINT64 + 16);
       SAVESTR_1;
       uint64_t *data = (uint64_t *)(strdata + MAXSTRLEN_BYTES); 
       SAVEDATA_16;
       e->type = ONE_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   
@@ -1269,233 +1694,251 @@ public:
    * 1 or 16 integers and 2 strings */
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_1, STRPARAM_2) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 1, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 1, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 1);
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES); 
       SAVEDATA_1;
       e->type = TWO_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_2, STRPARAM_2) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 2, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 2, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 2);
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES); 
       SAVEDATA_2;
       e->type = TWO_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
  
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_3, STRPARAM_2) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 3, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 3, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 3);
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES); 
       SAVEDATA_3;
       e->type = TWO_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_4, STRPARAM_2) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 4, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 4, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 4);
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES); 
       SAVEDATA_4;
       e->type = TWO_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_5, STRPARAM_2) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 5, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 5, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 5);
       SAVESTR_2
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES); 
       SAVEDATA_5;
       e->type = TWO_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_6, STRPARAM_2) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 6, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 6, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 6);
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES); 
       SAVEDATA_6;
       e->type = TWO_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_7, STRPARAM_2) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 7, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 7, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 7);
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES); 
       SAVEDATA_7;
       e->type = TWO_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_8, STRPARAM_2) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 8, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 8, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 8);
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES); 
       SAVEDATA_8;
       e->type = TWO_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_9, STRPARAM_2) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 9, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 9, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 9);
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES); 
       SAVEDATA_9;
       e->type = TWO_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_10, STRPARAM_2) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 10, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 10, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 10);
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES); 
       SAVEDATA_10;
       e->type = TWO_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_11, STRPARAM_2) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 11, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 11, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 11);
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES); 
       SAVEDATA_11;
       e->type = TWO_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_12, STRPARAM_2) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 12, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 12, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 12);
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES); 
       SAVEDATA_12;
       e->type = TWO_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_13, STRPARAM_2) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 13, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 13, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 13);
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES); 
       SAVEDATA_13;
       e->type = TWO_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_14, STRPARAM_2) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 14, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 14, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 14);
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES); 
       SAVEDATA_14;
       e->type = TWO_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_15, STRPARAM_2) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 15, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 15, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 15);
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES); 
       SAVEDATA_15;
       e->type = TWO_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   
   inline void Gtrace(TRACE_FUNC_SIGNATURE, INTPARAM_16, STRPARAM_2) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(2*MAXSTRLEN_UINT64 + 16, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(2*MAXSTRLEN_UINT64 + 16, (uint64_t **)&strdata, &slot);
       SETENTRY(2*MAXSTRLEN_UINT64 + 16);
       SAVESTR_2;
       uint64_t *data = (uint64_t *)(strdata + 2*MAXSTRLEN_BYTES); 
       SAVEDATA_16;
       e->type = TWO_TAIL_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   /* String functions  */
   /* three strings */
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_3) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(3*MAXSTRLEN_UINT64, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(3*MAXSTRLEN_UINT64, (uint64_t **)&strdata, &slot);
       SETENTRY(3*MAXSTRLEN_UINT64);      
       SAVESTR_3;
       e->type = THREE_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
   /* four strings */
   inline void Gtrace(TRACE_FUNC_SIGNATURE, STRPARAM_4) {
-    if (level <= GetModuleLevel(module)) {
+    if (level <= GetModuleLevel(module) && Admit(module, level)) {
       char *strdata = NULL;
-      Entry *e = AllocEntry(4*MAXSTRLEN_UINT64, (uint64_t **)&strdata);
+      Slot slot;
+      Entry *e = Alloc(4*MAXSTRLEN_UINT64, (uint64_t **)&strdata, &slot);
       SETENTRY(4*MAXSTRLEN_UINT64);      
       SAVESTR_4;
       e->type = FOUR_STR_TYPE;
-      FlushEntry(e, (uint64_t *) strdata, level <= TraceLevel::Err);
+      Commit(e, (uint64_t *) strdata, slot, level <= TraceLevel::Err);
     }
   }
 
@@ -1514,6 +1957,13 @@ public:
 
 }; // class GTraceSingleThread
 
+// What a GTrace keeps beyond the layout libMapRClient has for it, in a
+// GTraceStateTable.
+struct GTraceState {
+  char                  logBase[FILE_NAME_LEN];  // names the BINARY files
+  uint32_t              asyncSlots;  // CONTINUOUS goes through writers if set
+};
+
 class GTrace {
   static bool debugTraceEnabled_;
   GTraceSingleThread *GTArray;
@@ -1596,21 +2046,35 @@ public:
     int retVal = 0;
     char thrLogFile[FILE_NAME_LEN];
     thrCount_ = thrCount;
+    GTraceState *st = States().Get(this);
+    if (st) {
+      snprintf(st->logBase, FILE_NAME_LEN, "%s", logFile ? logFile : "");
+    }
+    // the library only knows the text modes
+    uint8_t textMode = (mode == GTraceMode::BINARY) ?
+                         (uint8_t) GTraceMode::DEFAULT : mode;
     if (thrCount_ == 1) {
       //Dont malloc. It has a problem in multi entrant jni calls.
       GTArray = &gtSingleObj;
-      return GTArray[0].Initialize(size, mode, isFileClient, 
+      retVal = GTArray[0].Initialize(size, textMode, isFileClient, 
         logFile, maxLogSize);
+      if (retVal == 0 && mode == GTraceMode::BINARY) {
+        SetMode(mode);
+      }
+      return retVal;
     }
 
     GTArray = new GTraceSingleThread[thrCount_];
     for (uint8_t i = 0; i < thrCount_; i++) {
       snprintf(thrLogFile, FILE_NAME_LEN, "%s-%d", logFile, i);
       if ((retVal = GTArray[i].Initialize(
-                size, mode, isFileClient, thrLogFile, maxLogSize)) != 0 ) {
+                size, textMode, isFileClient, thrLogFile, maxLogSize)) != 0 ) {
         return retVal; 
       }  
     }
+    if (mode == GTraceMode::BINARY) {
+      SetMode(mode);
+    }
 
     if (isFileClient) {
       shutdown_ = false;
@@ -1624,6 +2088,32 @@ public:
     return 0;
   }
   
+  // Initialize with one lock-free ring per tracing thread instead of a
+  // locked buffer per CpuQ. ringSize is per thread. With mapDir the rings
+  // are kept in a file there for post-mortem use by gtracedecode.
+  int InitializeRings(uint32_t size, uint8_t mode, bool isFileClient,
+                      const char *logFile, uint32_t maxLogSize,
+                      uint32_t ringSize = GTraceRingSet::DefaultRingSize,
+                      const char *mapDir = NULL,
+                      int maxRings = GTraceRingSet::DefaultMappedRings) {
+    int retVal = Initialize(size, mode, isFileClient, logFile, maxLogSize);
+    if (retVal != 0) {
+      return retVal;
+    }
+    if ((retVal = GTArray[0].UseRings(ringSize, mapDir, maxRings)) != 0) {
+      return retVal;
+    }
+    if (isFileClient) {
+      shutdown_ = false;
+      pthread_attr_t attr;
+      pthread_attr_init(&attr);
+      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+      pthread_t threadId;
+      (void)pthread_create(&threadId, &attr, FlusherThread, (void *)this);
+    }
+    return 0;
+  }
+
   int Resize(uint32_t newsize) {
     int retVal = 0;
     for (uint8_t i = 0; i < thrCount_; i++) {
@@ -1633,9 +2123,99 @@ public:
     }
     return 0;
   }
+  // BINARY starts a binary log per GTraceSingleThread next to the text
+  // log, any other mode stops it. A log that cannot be created leaves
+  // that mode as it was.
+  // CONTINUOUS starts the async writers when they were asked for.
   void SetMode(uint8_t mode) {
+    GTraceState *st = States().Find(this);
     for (uint8_t i = 0; i < thrCount_; i++) {
-      GTArray[i].SetMode(mode);
+      if (mode != GTraceMode::BINARY) {
+        GTArray[i].StopBinaryLog();
+        if (mode == GTraceMode::CONTINUOUS && st && st->asyncSlots) {
+          StartWriter(i, st->asyncSlots);
+        } else {
+          GTArray[i].StopAsyncWriter();
+          GTArray[i].SetMode(mode);
+        }
+        continue;
+      }
+      GTArray[i].StopAsyncWriter();
+      const char *logBase = st ? st->logBase : "";
+      char base[FILE_NAME_LEN];
+      if (!logBase[0]) {
+        snprintf(base, FILE_NAME_LEN, "/tmp/gtrace.%d", (int) getpid());
+      } else if (thrCount_ > 1) {
+        snprintf(base, FILE_NAME_LEN, "%s-%d", logBase, i);
+      } else {
+        snprintf(base, FILE_NAME_LEN, "%s", logBase);
+      }
+      if (GTArray[i].StartBinaryLog(base, GTraceBinLog::DefaultFileSize,
+                                    GTraceBinLog::DefaultNumFiles) == 0) {
+        GTArray[i].SetMode(GTraceMode::DEFAULT);
+      }
+    }
+  }
+
+  // StartAsyncWriter
+  // Switches to CONTINUOUS mode with a writer thread per log, fed by a
+  // queue of queueSlots entries, so tracing threads never wait for the
+  // disk. Returns the first error; a log whose writer could not start
+  // is written synchronously.
+  int StartAsyncWriter(
+                  uint32_t queueSlots = GTraceAsyncWriter::DefaultSlots) {
+    GTraceState *st = States().Get(this);
+    if (!st) {
+      return ENOSPC;
+    }
+    st->asyncSlots = queueSlots;
+    int err = 0;
+    for (uint8_t i = 0; i < thrCount_; i++) {
+      GTArray[i].StopBinaryLog();
+      int e = StartWriter(i, queueSlots);
+      if (e && !err) {
+        err = e;
+      }
+    }
+    return err;
+  }
+
+  // StopAsyncWriter
+  // Writes out what the writers hold and goes back to synchronous
+  // CONTINUOUS mode where they were running.
+  void StopAsyncWriter() {
+    GTraceState *st = States().Find(this);
+    if (st) {
+      st->asyncSlots = 0;
+    }
+    for (uint8_t i = 0; i < thrCount_; i++) {
+      if (GTArray[i].GetAsyncWriter()) {
+        GTArray[i].StopAsyncWriter();
+        GTArray[i].SetMode(GTraceMode::CONTINUOUS);
+      }
+    }
+  }
+
+  // GetAsyncWriterStats
+  // Sum over all writers, zero when there are none.
+  void GetAsyncWriterStats(GTraceAsyncWriter::Stats *out) {
+    memset(out, 0, sizeof(*out));
+    for (uint8_t i = 0; i < thrCount_; i++) {
+      GTraceAsyncWriter *w = GTArray[i].GetAsyncWriter();
+      if (!w) {
+        continue;
+      }
+      GTraceAsyncWriter::Stats s;
+      w->GetStats(&s);
+      out->posted += s.posted;
+      out->written += s.written;
+      out->dropped += s.dropped;
+      out->lost += s.lost;
+      out->bytes += s.bytes;
+      out->batches += s.batches;
+      out->rotations += s.rotations;
+      out->depth += s.depth;
+      out->maxDepth = MAX(out->maxDepth, s.maxDepth);
     }
   }
 
@@ -1652,6 +2232,14 @@ public:
     }
   }
 
+  // Sampling and rate limits are per module, not per GTraceSingleThread.
+  void SetSampling(uint8_t module, uint32_t every) {
+    GTraceSingleThread::SetSampling(module, every);
+  }
+  void SetRateLimit(uint8_t module, uint32_t perSec) {
+    GTraceSingleThread::SetRateLimit(module, perSec);
+  }
+
   inline void SetHeader(const char *host, uint32_t ip, uint32_t port,
     uint32_t pid, const char *prg, const char *custMsg=NULL) {
     for (uint8_t i = 0; i < thrCount_; i++) {
@@ -1667,6 +2255,10 @@ public:
 
   // printing
   void Dump(bool shouldLock) {
+    if (GTArray[0].UsingRings()) {
+      GTArray[0].DumpRings(false);
+      return;
+    }
     for (uint8_t i = 0; i < thrCount_; i++) {
       GTArray[i].Dump(shouldLock);
     }
@@ -1682,6 +2274,10 @@ public:
   }
 
   void DumpCurrentThread(bool shouldLock) {
+    if (GTArray[0].UsingRings()) {
+      GTArray[0].DumpRings(true);
+      return;
+    }
     GTArray[THR_IDX].Dump(shouldLock);
   }
 
@@ -1968,6 +2564,20 @@ public:
   }
 
 private:
+  typedef GTraceStateTable<GTraceState, 4> StateTable;
+
+  static StateTable &States() {
+    static StateTable table;
+    return table;
+  }
+
+  int StartWriter(uint8_t i, uint32_t queueSlots) {
+    int err = GTArray[i].StartAsyncWriter(queueSlots);
+    GTArray[i].SetMode(err ? (uint8_t) GTraceMode::CONTINUOUS :
+                             (uint8_t) GTraceMode::DEFAULT);
+    return err;
+  }
+
   static void *FlusherThread(void *arg) {
     GTrace *ptr = (GTrace *)arg;
     while (!ptr->shutdown_) {
@@ -0,0 +1,388 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+#ifndef COMMON_GTRACEBINLOG_H__
+#define COMMON_GTRACEBINLOG_H__
+
+#include "common/nonlinuxsupport.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef __WINDOWS__
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "common/common.h"
+
+namespace mapr {
+namespace fs {
+
+// Which format strings have been written out, and to which file.
+// Lookups take no lock; Add() is serialized by the caller's lock.
+class GTraceFormatSet {
+public:
+  GTraceFormatSet() {
+    memset(slots_, 0, sizeof(slots_));
+  }
+
+  inline bool Has(const char *fmt, uint32_t seq) const {
+    uint32_t h = Hash(fmt);
+    for (int i = 0; i < MaxProbe; ++i) {
+      const Slot &s = slots_[(h + i) & (NumSlots - 1)];
+      if (s.fmt == fmt) {
+        return s.seq == seq;
+      }
+      if (!s.fmt) {
+        return false;
+      }
+    }
+    return false;
+  }
+
+  // a full neighbourhood just means the format is written again
+  void Add(const char *fmt, uint32_t seq) {
+    uint32_t h = Hash(fmt);
+    for (int i = 0; i < MaxProbe; ++i) {
+      Slot &s = slots_[(h + i) & (NumSlots - 1)];
+      if (!s.fmt || s.fmt == fmt) {
+        s.seq = seq;
+        s.fmt = fmt;
+        return;
+      }
+    }
+  }
+
+private:
+  struct Slot {
+    const char * volatile fmt;
+    volatile uint32_t   seq;          // file it was written to
+  };
+
+  static const int      NumSlots = 8192;  // power of two
+  static const int      MaxProbe = 64;
+
+  static inline uint32_t Hash(const char *fmt) {
+    uint64_t v = (uint64_t) (uintptr_t) fmt;
+    return (uint32_t) ((v >> 3) * 0x9E3779B97F4A7C15ULL >> 40);
+  }
+
+  Slot                  slots_[NumSlots];
+};
+
+// Binary gtrace log.
+//
+// Entries are appended to a memory mapped file as they are, the same
+// bytes the in memory buffer holds, and rendered to text offline by
+// gtracedecode. An entry's fmt is a pointer into this process, so the
+// first time a format is seen in a file it is also written, once, as a
+// Format record keyed by that pointer. The decoder reads all formats of
+// a file before rendering, so a format may land after its first entry.
+//
+// A file is FileHeader followed by records, each a Record header and a
+// payload padded to RecordAlign. Writers reserve room with one atomic
+// add on a word that holds both the file number and the offset, store
+// the length at once, fill the payload and store the kind last. A zero
+// length ends the file, a zero kind is a record still being written.
+// When a file is full the log moves on to <base>.<n>.gtb and removes the
+// file numFiles back. Two files stay mapped, for writers that reserved
+// in the previous one just before the switch. Each mapping counts the
+// writers between Reserve() and Release() in it, and the switch that
+// reuses a mapping waits for its count to drain before unmapping it, so
+// a writer preempted in the middle of a record never writes to a file
+// that is gone.
+class GTraceBinLog {
+public:
+  static const uint32_t Version = 1;
+  static const uint32_t RecordAlign = 8;
+  static const uint32_t DefaultFileSize = 256 * 1024 * 1024;
+  static const int      DefaultNumFiles = 4;
+
+  enum RecordKind {
+    EntryRecord = 1,        // RawEntry and its data words
+    FormatRecord = 2,       // uint64_t fmt pointer, NUL terminated string
+  };
+
+  struct FileHeader {
+    char                magic[8];     // "GTRACEB"
+    uint32_t            version;
+    uint32_t            entrySize;    // sizeof(RawEntry)
+    uint64_t            startUsecs;
+    uint32_t            pid;
+    uint32_t            seq;          // file number
+  };
+
+  struct Record {
+    uint32_t            len;          // including this header, 0: unused
+    uint32_t            kind;         // 0: not finished
+  };
+
+  // GTraceSingleThread::Entry as it sits in the log
+  struct RawEntry {
+    uint8_t             level;
+    uint8_t             module;
+    uint8_t             length;       // data words that follow
+    uint8_t             type;
+    uint16_t            fileId;
+    uint16_t            lineNo;
+    uint32_t            nextEntry;
+    uint32_t            prevEntry;
+    uint64_t            tvSec;        // struct timeval on LP64
+    uint64_t            tvUsec;
+    uint64_t            userDefID;
+    uint64_t            fmt;          // key of a FormatRecord
+  };
+
+  struct Stats {
+    uint64_t            entries;
+    uint64_t            formats;
+    uint64_t            bytes;
+    uint64_t            files;
+    uint64_t            dropped;      // no file to write to
+  };
+
+  static const char *Magic() { return "GTRACEB"; }
+
+  GTraceBinLog() : pos_(0), size_(0), numFiles_(0) {
+    memset((void *) maps_, 0, sizeof(maps_));
+    maps_[0].seq = maps_[1].seq = NoFile;
+    memset(&stats_, 0, sizeof(stats_));
+    base_[0] = '\0';
+    pthread_mutex_init(&lock_, NULL);
+  }
+
+  // Open
+  // Starts <base>.0.gtb, fileSize bytes each, at most numFiles kept.
+  int Open(const char *base, uint32_t fileSize, int numFiles) {
+    if (!base || strlen(base) + 1 > sizeof(base_) ||
+        fileSize < 64 * 1024 || numFiles < 1) {
+      return EINVAL;
+    }
+    pthread_mutex_lock(&lock_);
+    strcpy(base_, base);
+    size_ = fileSize;
+    numFiles_ = numFiles;
+    int err = NextFile(0);
+    pthread_mutex_unlock(&lock_);
+    return err;
+  }
+
+  // Append
+  // Writes one entry of len bytes, and its format if this file does not
+  // have it yet. Never blocks on I/O, the kernel writes the pages back.
+  void Append(const void *entry, uint32_t len, const char *fmt) {
+    uint32_t seq;
+    uint8_t *p = Reserve(Padded(sizeof(Record) + len), &seq);
+    if (!p) {
+      return;
+    }
+    memcpy(p + sizeof(Record), entry, len);
+    Publish(p, EntryRecord);
+    Release(seq);
+    atomic_add64(&stats_.entries, 1);
+    if (!formats_.Has(fmt, seq)) {
+      AddFormat(fmt, seq);
+    }
+  }
+
+  const Stats &GetStats() const { return stats_; }
+
+  static inline uint32_t Padded(uint32_t n) {
+    return (n + RecordAlign - 1) & ~(RecordAlign - 1);
+  }
+
+  // Publish
+  // Marks the record at p finished, after its payload.
+  static inline void Publish(uint8_t *p, uint32_t kind) {
+    atomic_barrier();
+    ((Record *) p)->kind = kind;
+  }
+
+  // FormatRecordSize
+  // Bytes of the FormatRecord for a format of slen bytes with its NUL.
+  static inline uint32_t FormatRecordSize(uint32_t slen) {
+    return Padded(sizeof(Record) + sizeof(uint64_t) + slen);
+  }
+
+  // FillFormat
+  // Payload of a FormatRecord at p; the caller publishes it.
+  static inline void FillFormat(uint8_t *p, const char *fmt, uint32_t slen) {
+    uint64_t key = (uint64_t) (uintptr_t) fmt;
+    memcpy(p + sizeof(Record), &key, sizeof(key));
+    memcpy(p + sizeof(Record) + sizeof(key), fmt, slen);
+  }
+
+private:
+  static const int      SeqShift = 40;          // pos_ is seq:offset
+  static const uint64_t OffsetMask = (1ULL << SeqShift) - 1;
+  static const uint64_t NoFile = ~0ULL;
+
+  // a mapped file, in maps_[seq & 1]
+  struct Map {
+    uint8_t * volatile  base;         // NULL when the file could not open
+    volatile uint64_t   seq;          // NoFile while being replaced
+    volatile uint64_t   users;        // writers in Reserve() .. Release()
+  };
+
+  // Writes the format record, then remembers which file has it. Two
+  // threads may both write the same format, the decoder does not mind.
+  void AddFormat(const char *fmt, uint32_t seq) {
+    uint32_t slen = strlen(fmt) + 1;
+    uint8_t *p = Reserve(FormatRecordSize(slen), &seq);
+    if (!p) {
+      return;
+    }
+    FillFormat(p, fmt, slen);
+    Publish(p, FormatRecord);
+    Release(seq);
+    atomic_add64(&stats_.formats, 1);
+
+    pthread_mutex_lock(&lock_);
+    formats_.Add(fmt, seq);
+    pthread_mutex_unlock(&lock_);
+  }
+
+  // Reserve
+  // Room for n bytes in the current file, switching files when full.
+  // The file stays mapped until Release(*seqOut).
+  uint8_t *Reserve(uint32_t n, uint32_t *seqOut) {
+    for (;;) {
+      uint64_t pos = atomic_add64(&pos_, n);
+      uint32_t seq = pos >> SeqShift;
+      uint64_t off = pos & OffsetMask;
+      Map *m = &maps_[seq & 1];
+      atomic_add64(&m->users, 1);
+      if (atomic_load_acquire64(&m->seq) != seq) {
+        // being replaced or replaced, pos_ has moved on
+        atomic_sub64(&m->users, 1);
+        continue;
+      }
+      uint8_t *map = m->base;
+      if (!map) {
+        atomic_sub64(&m->users, 1);
+        atomic_add64(&stats_.dropped, 1);
+        return NULL;
+      }
+      if (off + n <= size_) {
+        ((Record *) (map + off))->len = n;
+        atomic_add64(&stats_.bytes, n);
+        *seqOut = seq;
+        return map + off;
+      }
+      atomic_sub64(&m->users, 1);
+      // full; the first one here under the lock moves to the next file
+      pthread_mutex_lock(&lock_);
+      if ((pos_ >> SeqShift) == seq) {
+        NextFile(seq + 1);
+      }
+      pthread_mutex_unlock(&lock_);
+    }
+  }
+
+  inline void Release(uint32_t seq) {
+    atomic_sub64(&maps_[seq & 1].users, 1);
+  }
+
+  // Maps file seq in maps_[seq & 1] and points pos_ at it, lock_ held.
+  // On failure the log stops and everything after counts as dropped.
+  int NextFile(uint32_t seq) {
+    int err = OpenFile(seq);
+    if (err) {
+      Map *m = &maps_[seq & 1];
+      Unmap(m);
+      atomic_store_release64(&m->seq, seq);
+      atomic_store_release64(&pos_, (uint64_t) seq << SeqShift);
+    }
+    return err;
+  }
+
+  // Unmap
+  // Takes m away from new writers, waits for the ones in it to finish
+  // their record and unmaps it, lock_ held. Writers stay in a mapping
+  // for one memcpy, the wait is only long when one of them is preempted.
+  void Unmap(Map *m) {
+    atomic_store_release64(&m->seq, NoFile);
+    atomic_barrier();
+#ifndef __WINDOWS__
+    while (atomic_load_acquire64(&m->users) != 0) {
+      sched_yield();
+    }
+    if (m->base) {
+      munmap(m->base, size_);
+    }
+#endif
+    m->base = NULL;
+  }
+
+  int OpenFile(uint32_t seq) {
+#ifndef __WINDOWS__
+    char path[sizeof(base_) + 32];
+    if (seq >= (uint32_t) numFiles_) {
+      snprintf(path, sizeof(path), "%s.%u.gtb", base_, seq - numFiles_);
+      unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s.%u.gtb", base_, seq);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      return errno;
+    }
+    int err = 0;
+    uint8_t *map = NULL;
+    if (ftruncate(fd, size_) != 0) {
+      err = errno;
+    } else {
+      map = (uint8_t *) mmap(NULL, size_, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, fd, 0);
+      if (map == MAP_FAILED) {
+        err = errno;
+        map = NULL;
+      }
+    }
+    close(fd);
+    if (!map) {
+      return err;
+    }
+
+    FileHeader *h = (FileHeader *) map;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    memcpy(h->magic, Magic(), sizeof(h->magic));
+    h->version = Version;
+    h->entrySize = sizeof(RawEntry);
+    h->startUsecs = (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+    h->pid = getpid();
+    h->seq = seq;
+
+    // the file two back is done with once its writers are
+    Map *m = &maps_[seq & 1];
+    Unmap(m);
+    m->base = map;
+    atomic_store_release64(&m->seq, seq);
+    atomic_store_release64(&pos_, ((uint64_t) seq << SeqShift) |
+                                  Padded(sizeof(FileHeader)));
+    atomic_add64(&stats_.files, 1);
+    return 0;
+#else
+    return ENOSYS;
+#endif
+  }
+
+  volatile uint64_t     pos_;
+  Map                   maps_[2];
+  uint32_t              size_;
+  int                   numFiles_;
+  char                  base_[1024];
+  Stats                 stats_;
+  pthread_mutex_t       lock_;
+  GTraceFormatSet       formats_;
+};
+
+} // namespace fs
+} // namespace mapr
+
+#endif // COMMON_GTRACEBINLOG_H__
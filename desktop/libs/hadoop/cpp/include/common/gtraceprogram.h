@@ -7,6 +7,7 @@
 #include "rpc/rpcbinding.h"
 #include "rpc/rpcprogram.h"
 #include "rpc/rpcserver.h"
+#include "rpc/dispatchstats.h"
 #include "common/gtrace.h"
 #include "common/modules.h"
 #include "common/gtracelevel.h"
@@ -49,6 +50,9 @@ public:
     if (strcasecmp(name, "CONTINUOUS") == 0) {
       return GTraceMode::CONTINUOUS;
     }
+    if (strcasecmp(name, "BINARY") == 0) {
+      return GTraceMode::BINARY;
+    }
     return -1;
   }
 
@@ -77,6 +81,36 @@ public:
     return -1;
   }
   
+  // ParseLimit
+  // "<key>=<n>" in a setLevel request's level sets a sampling or rate
+  // limit instead of the level, e.g. "sample=100" or "rate=5000".
+  static bool ParseLimit(const char *level, const char *key, uint32_t *val) {
+    size_t klen = strlen(key);
+    if (strncasecmp(level, key, klen) != 0 || level[klen] != '=') {
+      return false;
+    }
+    char *end = NULL;
+    unsigned long v = strtoul(level + klen + 1, &end, 10);
+    if (end == level + klen + 1 || *end != '\0' || v > 0xffffffffUL) {
+      return false;
+    }
+    *val = (uint32_t) v;
+    return true;
+  }
+
+  // level of a module for the info reply, with its limits if it has any
+  static const char *LevelDetail(int i, char *buf, int len) {
+    const GTraceModuleLimits &m = GTraceSingleThread::ModuleLimits()[i];
+    const char *level = LevelInfo[ModuleInfo[i].level];
+    if (!m.sampleEvery && !m.ratePerSec && !m.suppressed) {
+      return level;
+    }
+    snprintf(buf, len, "%s sample=%u rate=%u suppressed=%llu",
+             level, m.sampleEvery, m.ratePerSec,
+             (unsigned long long) m.suppressed);
+    return buf;
+  }
+
   virtual void  RequestArrived(RpcBinding *binding,
                                RpcCallContext *ctx,
                                uint16_t procedureId,
@@ -130,7 +164,14 @@ public:
             {
               int moduleId = FindModuleId(req.module().c_str());
               int levelId = FindLevelId(req.level().c_str()); 
-              if (moduleId != -1 && levelId != -1) {
+              uint32_t limit = 0;
+              if (moduleId != -1 &&
+                  ParseLimit(req.level().c_str(), "sample", &limit)) {
+                GTG.SetSampling((uint8_t) moduleId, limit);
+              } else if (moduleId != -1 &&
+                         ParseLimit(req.level().c_str(), "rate", &limit)) {
+                GTG.SetRateLimit((uint8_t) moduleId, limit);
+              } else if (moduleId != -1 && levelId != -1) {
                 GTG.SetLevel((uint8_t) moduleId, (uint8_t) levelId);
               } else {
                 ret = EINVAL;
@@ -154,8 +195,9 @@ public:
               // modules
               for (int i = 0; i< Module::Total; ++i) {
                 ModuleDetail *md = wa->reply.add_modules();
+                char detail[128];
                 md->set_name(ModuleInfo[i].name);
-                md->set_level(LevelInfo[ModuleInfo[i].level]);
+                md->set_level(LevelDetail(i, detail, sizeof(detail)));
               }
             }
 #else
@@ -171,8 +213,9 @@ public:
               // modules
               for (int i = 0; i< Module::Total; ++i) {
                 ModuleDetail *md = reply.add_modules();
+                char detail[128];
                 md->set_name(ModuleInfo[i].name);
-                md->set_level(LevelInfo[ModuleInfo[i].level]);
+                md->set_level(LevelDetail(i, detail, sizeof(detail)));
               }
             }
 #endif
@@ -183,7 +226,17 @@ public:
               if (sz > 64*1024) 
                 sz = 64*1024;
               char *buffer = new char[sz];
-              int dataLength = GTG.Print(buffer, sz);
+              int dataLength;
+              if (strcasecmp(req.module().c_str(), "dispatch") == 0) {
+                // dispatch queue histograms, "reset" starts them over
+                DispatchProfile &dp = DispatchProfile::Instance();
+                dataLength = dp.Print(buffer, sz);
+                if (strcasecmp(req.level().c_str(), "reset") == 0) {
+                  dp.Reset();
+                }
+              } else {
+                dataLength = GTG.Print(buffer, sz);
+              }
 #ifndef GT_RPC_THR
               wa->reply.set_tracedata(buffer, dataLength);
 #else
@@ -0,0 +1,581 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+#ifndef COMMON_GTRACERING_H__
+#define COMMON_GTRACERING_H__
+
+#include "common/nonlinuxsupport.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef __WINDOWS__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "common/common.h"
+#include "common/gtracebinlog.h"
+#include "common/thrdlocal.h"
+
+namespace mapr {
+namespace fs {
+
+// Trace ring written by one thread and read by one dumper.
+//
+// Records are variable length and never wrap: a record that does not
+// fit before the end of the buffer is preceded by a padding record. The
+// writer never waits for the reader. When it needs room it moves oldest
+// past the records it is about to overwrite, publishes that, and only
+// then writes. The reader copies a record out and checks oldest again
+// afterwards; if the writer has moved past the record in the meantime
+// the copy is thrown away and the reader skips ahead. Positions are byte
+// counts since the ring was created and never wrap.
+//
+// The buffer and the writer's Cursors may live in a mapped file (see
+// GTraceRingSet::MapFile), in which case everything before head is
+// still there to read after a crash.
+class GTraceRing {
+public:
+  static const uint32_t MaxRecord = 512;  // payload bytes
+  static const uint32_t MinSize = 16 * 1024;
+  static const uint32_t PadRecord = 1;
+  static const uint32_t RecordAlign = 16;
+
+  struct Record {
+    uint32_t            len;    // including this header
+    uint32_t            flags;
+    uint64_t            stamp;
+  };
+
+  // written by the writer, one cache line
+  struct Cursors {
+    volatile uint64_t   head;   // end of the last committed record
+    volatile uint64_t   oldest; // first record not overwritten
+    uint64_t            pad[6];
+  };
+
+  // RoundSize
+  // Ring sizes are powers of two of at least MinSize.
+  static uint32_t RoundSize(uint32_t size) {
+    uint32_t sz = MinSize;
+    while (sz < size && sz < (1U << 31)) {
+      sz <<= 1;
+    }
+    return sz;
+  }
+
+  // Create
+  // Returns a ring of size bytes rounded up by RoundSize(), NULL when
+  // out of memory.
+  static GTraceRing *Create(uint32_t size) {
+    uint32_t sz = RoundSize(size);
+    uint8_t *buf = (uint8_t *) malloc(sz);
+    if (!buf) {
+      return NULL;
+    }
+    GTraceRing *r = new GTraceRing();
+    r->buf_ = buf;
+    r->size_ = sz;
+    r->cur_ = &r->ownCursors_;
+    return r;
+  }
+
+  // Create
+  // Ring over memory the caller owns, size from RoundSize(). A ring
+  // that already holds records carries on after them.
+  static GTraceRing *Create(uint8_t *buf, uint32_t size, Cursors *cur) {
+    GTraceRing *r = new GTraceRing();
+    r->buf_ = buf;
+    r->size_ = size;
+    r->cur_ = cur;
+    r->tail_ = cur->oldest;
+    return r;
+  }
+
+  // ForEach
+  // Calls fn on the payload of every record in [oldest, head) of a ring
+  // image that nobody writes to any more, e.g. one left by a crash.
+  typedef void RecordFunc(void *arg, const uint8_t *rec, uint32_t len,
+                          uint64_t stamp);
+  static void ForEach(const uint8_t *buf, uint32_t size,
+                      const Cursors *cur, RecordFunc *fn, void *arg) {
+    uint64_t pos = cur->oldest;
+    while (pos < cur->head) {
+      const Record *r = (const Record *) (buf + (pos & (size - 1)));
+      if (r->len < sizeof(Record) || r->len > cur->head - pos ||
+          r->len - sizeof(Record) > MaxRecord) {
+        return;  // not a ring this code wrote
+      }
+      if (!(r->flags & PadRecord)) {
+        fn(arg, (const uint8_t *) (r + 1), r->len - sizeof(Record),
+           r->stamp);
+      }
+      pos += r->len;
+    }
+  }
+
+  // Reserve
+  // Returns room for len payload bytes, len <= MaxRecord. Writer only,
+  // the record is not visible until Commit().
+  void *Reserve(uint32_t len) {
+    debug_assert(len <= MaxRecord);
+    uint32_t n = (sizeof(Record) + len + RecordAlign - 1) & ~(RecordAlign - 1);
+    uint64_t pos = cur_->head;
+    uint32_t off = pos & (size_ - 1);
+
+    if (off + n > size_) {
+      uint32_t pad = size_ - off;
+      MakeRoom(pos + pad);
+      Record *r = At(pos);
+      r->len = pad;
+      r->flags = PadRecord;
+      pos += pad;
+    }
+    MakeRoom(pos + n);
+    Record *r = At(pos);
+    r->len = n;
+    r->flags = 0;
+    reserved_ = pos;
+    return r + 1;
+  }
+
+  // Commit
+  // Publishes the record from the last Reserve(), stamp orders it
+  // against the other rings when they are merged.
+  void Commit(uint64_t stamp) {
+    Record *r = At(reserved_);
+    r->stamp = stamp;
+    atomic_store_release64(&cur_->head, reserved_ + r->len);
+  }
+
+  // Next
+  // Copies the next record before limit into out (MaxRecord bytes) and
+  // returns its length, 0 when there is none. Reader only.
+  uint32_t Next(uint8_t *out, uint64_t *stamp, uint64_t limit) {
+    for (;;) {
+      uint64_t head = atomic_load_acquire64(&cur_->head);
+      uint64_t oldest = atomic_load_acquire64(&cur_->oldest);
+      if (tail_ < oldest) {
+        overruns_++;
+        tail_ = oldest;
+      }
+      if (tail_ >= head || tail_ >= limit) {
+        return 0;
+      }
+
+      Record r = *At(tail_);
+      uint32_t len = 0;
+      bool sane = r.len >= sizeof(Record) && r.len <= head - tail_ &&
+                  r.len - sizeof(Record) <= MaxRecord;
+      if (sane && !(r.flags & PadRecord)) {
+        len = r.len - sizeof(Record);
+        memcpy(out, At(tail_) + 1, len);
+      }
+      atomic_barrier();
+      if (atomic_load_acquire64(&cur_->oldest) > tail_ || !sane) {
+        continue;  // overwritten while we copied it
+      }
+      tail_ += r.len;
+      if (r.flags & PadRecord) {
+        continue;
+      }
+      *stamp = r.stamp;
+      return len;
+    }
+  }
+
+  // Head
+  // Where the writer is now, a limit for Next() so that a busy writer
+  // cannot keep a dump going forever.
+  uint64_t Head() const { return atomic_load_acquire64(&cur_->head); }
+
+  // Skip
+  // Drops everything written so far. Reader only.
+  void Skip() { tail_ = Head(); }
+
+  // times the reader fell behind and lost records
+  uint64_t Overruns() const { return overruns_; }
+  uint32_t Size() const { return size_; }
+
+  bool Claim() { return atomic_cas64(&owned_, 0, 1); }
+  void Release() { atomic_store_release64(&owned_, 0); }
+
+  GTraceRing *next;  // GTraceRingSet list
+
+private:
+  GTraceRing() : next(NULL), buf_(NULL), size_(0), cur_(NULL),
+                 reserved_(0), owned_(0), tail_(0), overruns_(0) {
+    memset(&ownCursors_, 0, sizeof(ownCursors_));
+  }
+
+  inline Record *At(uint64_t pos) const {
+    return (Record *) (buf_ + (pos & (size_ - 1)));
+  }
+
+  // moves oldest so that [oldest, end) fits in the buffer
+  void MakeRoom(uint64_t end) {
+    uint64_t oldest = cur_->oldest;
+    if (end - oldest <= size_) {
+      return;
+    }
+    while (end - oldest > size_) {
+      oldest += At(oldest)->len;
+    }
+    atomic_store_release64(&cur_->oldest, oldest);
+    atomic_barrier();  // oldest is visible before the bytes change
+  }
+
+  uint8_t               *buf_;
+  uint32_t              size_;
+
+  // writer
+  Cursors               *cur_;      // ownCursors_ or in a mapped file
+  uint64_t              reserved_;  // start of the uncommitted record
+  volatile uint64_t     owned_;
+  char                  pad_[64];  // keep the reader off the writer's line
+
+  // reader
+  uint64_t              tail_;
+  uint64_t              overruns_;
+
+  Cursors               ownCursors_;
+};
+
+// One GTraceRing per tracing thread.
+//
+// A thread gets its ring the first time it traces and keeps it in a
+// FastThreadLocalStore slot, so tracing takes no lock. When the thread
+// exits the ring is released, keeping its records, and handed to the
+// next new thread. Rings are never freed. Merge() reads every ring in timestamp
+// order; dumpers are serialized against each other, never against the
+// writers.
+//
+// After MapFile() the first maxRings rings live in a shared file mapping
+// instead of the heap, a flight recorder that survives the process.
+// The file is a FileHeader, the FormatRecords (as in GTraceBinLog) of
+// every format traced so far, and maxRings slots of GTraceRing::Cursors
+// followed by the ring buffer. gtracedecode reads it back.
+class GTraceRingSet {
+public:
+  static const uint32_t DefaultRingSize = 256 * 1024;
+  static const int      DefaultMappedRings = 64;
+  static const uint32_t FormatsOffset = 4096;
+  static const uint32_t DefaultFormatSize = 1024 * 1024;
+
+  struct FileHeader {
+    char                magic[8];     // "GTRACER"
+    uint32_t            version;
+    uint32_t            entrySize;    // sizeof(GTraceBinLog::RawEntry)
+    uint64_t            startUsecs;
+    uint32_t            pid;
+    uint32_t            maxRings;
+    uint32_t            ringSize;
+    uint32_t            formatSize;   // bytes for FormatRecords
+    volatile uint32_t   numRings;     // slots handed out, may pass maxRings
+    uint32_t            pad;
+    volatile uint64_t   formatUsed;
+  };
+
+  static const char *Magic() { return "GTRACER"; }
+
+  // where slot i starts in a mapped file
+  static inline uint64_t SlotOffset(const FileHeader *h, uint32_t i) {
+    return FormatsOffset + (uint64_t) h->formatSize +
+           i * (uint64_t) (sizeof(GTraceRing::Cursors) + h->ringSize);
+  }
+
+  static inline uint64_t FileSize(const FileHeader *h) {
+    return SlotOffset(h, h->maxRings);
+  }
+
+  // called by Merge() for every record, oldest first
+  typedef void RecordFunc(void *arg, uint8_t *rec, uint32_t len);
+
+  GTraceRingSet() : tls_(RingReleased), ringSize_(DefaultRingSize),
+                    rings_(NULL), numRings_(0), map_(NULL) {
+    pthread_mutex_init(&readLock_, NULL);
+    pthread_mutex_init(&formatLock_, NULL);
+  }
+
+  void SetRingSize(uint32_t size) { ringSize_ = GTraceRing::RoundSize(size); }
+
+  // MapFile
+  // Puts the rings of the first maxRings threads in dir/gtrace.<pid>.ring.
+  // Call it before any thread traces. Threads past maxRings get heap
+  // rings, which are dumped but not kept after a crash.
+  int MapFile(const char *dir, int maxRings) {
+#ifndef __WINDOWS__
+    if (!dir || maxRings < 1 || map_) {
+      return EINVAL;
+    }
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/gtrace.%d.ring", dir, (int) getpid());
+
+    FileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, Magic(), sizeof(h.magic));
+    h.version = GTraceBinLog::Version;
+    h.entrySize = sizeof(GTraceBinLog::RawEntry);
+    h.pid = getpid();
+    h.maxRings = maxRings;
+    h.ringSize = ringSize_;
+    h.formatSize = DefaultFormatSize;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    h.startUsecs = Stamp(now);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      return errno;
+    }
+    int err = 0;
+    uint64_t len = FileSize(&h);
+    uint8_t *map = NULL;
+    if (ftruncate(fd, len) != 0) {
+      err = errno;
+    } else {
+      map = (uint8_t *) mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                             fd, 0);
+      if (map == MAP_FAILED) {
+        err = errno;
+        map = NULL;
+      }
+    }
+    close(fd);
+    if (!map) {
+      unlink(path);
+      return err;
+    }
+    memcpy(map, &h, sizeof(h));
+    map_ = map;
+    return 0;
+#else
+    return ENOSYS;
+#endif
+  }
+
+  // NoteFormat
+  // Makes sure a mapped file can render entries with this format.
+  inline void NoteFormat(const char *fmt) {
+    if (map_ && !formats_.Has(fmt, 0)) {
+      AddFormat(fmt);
+    }
+  }
+
+  // Mine
+  // The calling thread's ring, NULL only when out of memory.
+  inline GTraceRing *Mine() {
+    GTraceRing **slot = (GTraceRing **) tls_.getLocalStore();
+    if (slot) {
+      return *slot;
+    }
+    return Attach();
+  }
+
+  // Merge
+  // Calls fn on every record written so far, across all rings (or only
+  // the one given) in timestamp order, and consumes them.
+  int Merge(RecordFunc *fn, void *arg, GTraceRing *only) {
+    pthread_mutex_lock(&readLock_);
+    // new rings go on the front, walk from a snapshot of it
+    GTraceRing *first = only ? only : rings_;
+    int n = 0;
+    for (GTraceRing *r = first; r; r = only ? NULL : r->next) {
+      ++n;
+    }
+    Cursor *c = (Cursor *) malloc(MAX(n, 1) * sizeof(Cursor));
+    int *heap = (int *) malloc(MAX(n, 1) * sizeof(int));
+    if (!c || !heap) {
+      free(c);
+      free(heap);
+      pthread_mutex_unlock(&readLock_);
+      return ENOMEM;
+    }
+
+    int k = 0;
+    GTraceRing *r = first;
+    for (int i = 0; i < n; ++i, r = r->next) {
+      c[i].ring = r;
+      c[i].limit = r->Head();
+      if (Fill(&c[i])) {
+        heap[k++] = i;
+        SiftUp(c, heap, k - 1);
+      }
+    }
+
+    while (k > 0) {
+      Cursor *top = &c[heap[0]];
+      fn(arg, (uint8_t *) top->rec, top->len);
+      if (!Fill(top)) {
+        heap[0] = heap[--k];
+      }
+      SiftDown(c, heap, k, 0);
+    }
+
+    free(c);
+    free(heap);
+    pthread_mutex_unlock(&readLock_);
+    return 0;
+  }
+
+  // Skip
+  // Drops everything written so far in all rings.
+  void Skip() {
+    pthread_mutex_lock(&readLock_);
+    for (GTraceRing *r = rings_; r; r = r->next) {
+      r->Skip();
+    }
+    pthread_mutex_unlock(&readLock_);
+  }
+
+  int NumRings() const { return numRings_; }
+
+  uint64_t Overruns() const {
+    uint64_t n = 0;
+    for (GTraceRing *r = rings_; r; r = r->next) {
+      n += r->Overruns();
+    }
+    return n;
+  }
+
+  static inline uint64_t Stamp(const struct timeval &tv) {
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+  }
+
+private:
+  struct Cursor {
+    GTraceRing          *ring;
+    uint64_t            limit;
+    uint64_t            stamp;
+    uint32_t            len;
+    uint64_t            rec[GTraceRing::MaxRecord / sizeof(uint64_t)];
+  };
+
+  // slow path of Mine(): reuse a released ring or make a new one,
+  // in the mapped file while it has slots
+  GTraceRing *Attach() {
+    GTraceRing *r;
+    for (r = rings_; r; r = r->next) {
+      if (r->Claim()) {
+        break;
+      }
+    }
+    if (!r) {
+      FileHeader *h = (FileHeader *) map_;
+      uint32_t slot = h ? atomic_add32(&h->numRings, 1) : 0;
+      if (h && slot < h->maxRings) {
+        uint8_t *p = map_ + SlotOffset(h, slot);
+        r = GTraceRing::Create(p + sizeof(GTraceRing::Cursors), h->ringSize,
+                               (GTraceRing::Cursors *) p);
+      } else {
+        r = GTraceRing::Create(ringSize_);
+      }
+      if (!r) {
+        return NULL;
+      }
+      r->Claim();
+      GTraceRing *head;
+      do {
+        head = rings_;
+        r->next = head;
+      } while (!atomic_casptr(&rings_, head, r));
+      atomic_add32(&numRings_, 1);
+    }
+
+    GTraceRing **slot = (GTraceRing **) tls_.createLocalStore(sizeof(*slot));
+    if (!slot) {
+      r->Release();
+      return NULL;
+    }
+    *slot = r;
+    return r;
+  }
+
+  void AddFormat(const char *fmt) {
+    pthread_mutex_lock(&formatLock_);
+    FileHeader *h = (FileHeader *) map_;
+    if (!formats_.Has(fmt, 0)) {
+      uint32_t slen = strlen(fmt) + 1;
+      uint32_t n = GTraceBinLog::FormatRecordSize(slen);
+      if (h->formatUsed + n <= h->formatSize) {
+        uint8_t *p = map_ + FormatsOffset + h->formatUsed;
+        ((GTraceBinLog::Record *) p)->len = n;
+        GTraceBinLog::FillFormat(p, fmt, slen);
+        GTraceBinLog::Publish(p, GTraceBinLog::FormatRecord);
+        h->formatUsed += n;
+      }
+      // when the area is full the decoder prints the raw words instead
+      formats_.Add(fmt, 0);
+    }
+    pthread_mutex_unlock(&formatLock_);
+  }
+
+  static void RingReleased(void *store) {
+    GTraceRing **slot = (GTraceRing **) store;
+    if (slot && *slot) {
+      (*slot)->Release();
+    }
+  }
+
+  static bool Fill(Cursor *c) {
+    c->len = c->ring->Next((uint8_t *) c->rec, &c->stamp, c->limit);
+    return c->len != 0;
+  }
+
+  // older first, ties go to the lower ring index
+  static inline bool Before(const Cursor *c, int a, int b) {
+    return c[a].stamp < c[b].stamp || (c[a].stamp == c[b].stamp && a < b);
+  }
+
+  static void SiftUp(const Cursor *c, int *heap, int i) {
+    while (i > 0) {
+      int parent = (i - 1) / 2;
+      if (!Before(c, heap[i], heap[parent])) {
+        break;
+      }
+      int t = heap[i];
+      heap[i] = heap[parent];
+      heap[parent] = t;
+      i = parent;
+    }
+  }
+
+  static void SiftDown(const Cursor *c, int *heap, int k, int i) {
+    for (;;) {
+      int least = i;
+      int l = 2 * i + 1;
+      int r = l + 1;
+      if (l < k && Before(c, heap[l], heap[least])) {
+        least = l;
+      }
+      if (r < k && Before(c, heap[r], heap[least])) {
+        least = r;
+      }
+      if (least == i) {
+        break;
+      }
+      int t = heap[i];
+      heap[i] = heap[least];
+      heap[least] = t;
+      i = least;
+    }
+  }
+
+  FastThreadLocalStore  tls_;
+  uint32_t              ringSize_;
+  GTraceRing * volatile rings_;
+  volatile int          numRings_;
+  pthread_mutex_t       readLock_;
+  uint8_t               *map_;
+  pthread_mutex_t       formatLock_;
+  GTraceFormatSet       formats_;
+};
+
+} // namespace fs
+} // namespace mapr
+
+#endif // COMMON_GTRACERING_H__
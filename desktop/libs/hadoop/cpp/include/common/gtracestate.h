@@ -0,0 +1,84 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+#ifndef COMMON_GTRACESTATE_H__
+#define COMMON_GTRACESTATE_H__
+
+#include "common/nonlinuxsupport.h"
+
+#include <stdint.h>
+
+#include "common/common.h"
+
+namespace mapr {
+namespace fs {
+
+// State kept on the side for objects whose layout is fixed.
+//
+// GTraceSingleThread and GTrace are laid out as libMapRClient was built
+// with them, so what the ring, BINARY and async CONTINUOUS modes need
+// per object lives here instead, keyed by the object's address. The
+// table is open addressed and lock free. An entry is never removed:
+// GTrace keeps its GTraceSingleThreads for the life of the process.
+//
+// A table must have static storage duration and T must be plain data;
+// both start out zeroed, and so does every new entry's T.
+template <typename T, int SlotBits>
+class GTraceStateTable {
+public:
+  static const int      Slots = 1 << SlotBits;
+
+  // Find
+  // key's state, NULL if it has none. This is on the tracing path: until
+  // the first Get() it is one load of a flag, and with the table mostly
+  // empty it takes one probe after that.
+  inline T *Find(const void *key) {
+    if (!used_) {
+      return NULL;
+    }
+    uint32_t i = Hash(key);
+    for (int n = 0; n < Slots; ++n) {
+      const void *k = keys_[i];
+      if (k == key) {
+        return &vals_[i];
+      }
+      if (!k) {
+        return NULL;
+      }
+      i = (i + 1) & (Slots - 1);
+    }
+    return NULL;
+  }
+
+  // Get
+  // key's state, added if it has none. NULL once the table is full.
+  T *Get(const void *key) {
+    uint32_t i = Hash(key);
+    for (int n = 0; n < Slots; ++n) {
+      const void *k = keys_[i];
+      if (!k && atomic_casptr(&keys_[i], (const void *) NULL, key)) {
+        used_ = true;
+        return &vals_[i];
+      }
+      if (keys_[i] == key) {
+        return &vals_[i];
+      }
+      i = (i + 1) & (Slots - 1);
+    }
+    return NULL;
+  }
+
+private:
+  static inline uint32_t Hash(const void *key) {
+    return ((uint32_t) ((uintptr_t) key >> 4) * 0x9E3779B1U) >>
+           (32 - SlotBits);
+  }
+
+  volatile bool         used_;        // any key added yet
+  const void * volatile keys_[Slots];
+  T                     vals_[Slots];
+};
+
+} // namespace fs
+} // namespace mapr
+
+#endif // COMMON_GTRACESTATE_H__
@@ -0,0 +1,413 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+#ifndef COMMON_GTRACEWRITER_H__
+#define COMMON_GTRACEWRITER_H__
+
+#include "common/nonlinuxsupport.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef __WINDOWS__
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include "common/common.h"
+
+namespace mapr {
+namespace fs {
+
+// Background writer for CONTINUOUS mode gtrace logs.
+//
+// Tracing threads copy each entry, unformatted, into a bounded queue
+// and return. A writer thread takes up to BatchEntries entries at a
+// time, formats them and hands the lines to the kernel with one writev.
+// When the queue is full the entry is dropped and counted; a tracing
+// thread never waits for the writer or for the disk.
+//
+// The queue is an array of fixed size slots, each with a sequence
+// number that says whose turn it is: slot i is free for the producer
+// at position p when its seq is p, and ready for the writer when it is
+// p + 1. Producers claim positions with a CAS, so the only shared word
+// they write is the tail.
+//
+// The log is rotated by the byte count the writer keeps, which starts
+// from the file size when it is opened: <log> is renamed to <log>.1,
+// <log>.1 to <log>.2 and so on, numFiles files in all.
+class GTraceAsyncWriter {
+public:
+  static const uint32_t SlotData = 512;          // largest entry
+  static const uint32_t DefaultSlots = 16384;    // power of two
+  static const uint32_t BatchEntries = 256;      // lines per writev
+  static const uint32_t LineSize = 2048;
+  static const int      FlushIntervalMs = 100;
+
+  // formats the entry at rec into buf, returns the length written
+  typedef int FormatFunc(void *arg, char *buf, int size, const uint8_t *rec,
+                         uint32_t len);
+
+  struct Stats {
+    uint64_t            posted;
+    uint64_t            written;
+    uint64_t            dropped;      // queue full or entry too long
+    uint64_t            lost;         // taken, but the write failed
+    uint64_t            bytes;
+    uint64_t            batches;
+    uint64_t            rotations;
+    uint64_t            depth;        // entries queued right now
+    uint64_t            maxDepth;
+  };
+
+  GTraceAsyncWriter(FormatFunc *fn, void *arg)
+    : fn_(fn), arg_(arg), slots_(NULL), mask_(0), tail_(0), head_(0),
+      sleeping_(0), stop_(false), started_(false), fd_(-1), fileBytes_(0),
+      maxFileBytes_(0), numFiles_(0), lines_(NULL) {
+    memset(&stats_, 0, sizeof(stats_));
+    path_[0] = '\0';
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&wake_, NULL);
+  }
+
+  ~GTraceAsyncWriter() {
+    Stop();
+    free(slots_);
+    free(lines_);
+    pthread_mutex_destroy(&lock_);
+    pthread_cond_destroy(&wake_);
+  }
+
+  // Start
+  // Appends to path, or to stdout when path is NULL, rotating after
+  // maxFileBytes (0: never). numSlots is rounded up to a power of two.
+  // A writer can be started again after Stop(): it keeps the queue of
+  // its first Start(), and writes out what was pushed in between.
+  int Start(const char *path, uint64_t maxFileBytes, int numFiles,
+            uint32_t numSlots) {
+#ifndef __WINDOWS__
+    if (started_ || (path && strlen(path) + 1 > sizeof(path_)) ||
+        numSlots < 2) {
+      return EINVAL;
+    }
+    bool fresh = !slots_;
+    if (fresh) {
+      uint32_t n = 2;
+      while (n < numSlots && n < (1U << 30)) {
+        n <<= 1;
+      }
+      slots_ = (Slot *) calloc(n, sizeof(Slot));
+      lines_ = (char *) malloc(BatchEntries * LineSize);
+      if (!slots_ || !lines_) {
+        FreeQueue();
+        return ENOMEM;
+      }
+      for (uint32_t i = 0; i < n; ++i) {
+        slots_[i].seq = i;
+      }
+      mask_ = n - 1;
+    }
+
+    int err = 0;
+    if (path) {
+      strcpy(path_, path);
+      maxFileBytes_ = maxFileBytes;
+      numFiles_ = MAX(numFiles, 1);
+      err = OpenFile();
+    } else {
+      path_[0] = '\0';
+      maxFileBytes_ = 0;
+      fd_ = STDOUT_FILENO;
+    }
+
+    if (!err) {
+      stop_ = false;
+      pthread_attr_t attr;
+      pthread_attr_init(&attr);
+      err = pthread_create(&thread_, &attr, Run, this);
+      pthread_attr_destroy(&attr);
+      if (err && path_[0]) {
+        close(fd_);
+      }
+    }
+    if (err) {
+      // nobody can hold a writer that never ran, so its queue can go
+      if (fresh) {
+        FreeQueue();
+      }
+      return err;
+    }
+    started_ = true;
+    return 0;
+#else
+    return ENOSYS;
+#endif
+  }
+
+  // Push
+  // Queues len bytes of entry for the writer, or drops it when the
+  // queue is full. urgent wakes the writer at once, otherwise it is
+  // woken when a batch is waiting or after FlushIntervalMs.
+  inline bool Push(const void *entry, uint32_t len, bool urgent) {
+    if (len > SlotData) {
+      atomic_add64(&stats_.dropped, 1);
+      return false;
+    }
+    uint64_t pos = atomic_load_acquire64(&tail_);
+    Slot *s;
+    for (;;) {
+      s = &slots_[pos & mask_];
+      int64_t diff = (int64_t) (atomic_load_acquire64(&s->seq) - pos);
+      if (diff == 0) {
+        if (atomic_cas64(&tail_, pos, pos + 1)) {
+          break;
+        }
+        pos = atomic_load_acquire64(&tail_);
+      } else if (diff < 0) {
+        atomic_add64(&stats_.dropped, 1);
+        if (sleeping_) {
+          Wake();
+        }
+        return false;
+      } else {
+        pos = atomic_load_acquire64(&tail_);
+      }
+    }
+    memcpy(s->data, entry, len);
+    s->len = len;
+    atomic_store_release64(&s->seq, pos + 1);
+    atomic_add64(&stats_.posted, 1);
+
+    // pairs with the barrier in Sleep(), so an urgent entry is never
+    // left behind by a writer that is just going to sleep
+    atomic_barrier();
+    if (sleeping_ && (urgent || pos + 1 - head_ >= BatchEntries)) {
+      Wake();
+    }
+    return true;
+  }
+
+  // Stop
+  // Writes out what is queued and ends the writer thread. Entries
+  // pushed after that stay in the queue for the next Start(), or are
+  // dropped once it is full, so threads still holding the writer are
+  // harmless.
+  void Stop() {
+    if (!started_) {
+      return;
+    }
+    pthread_mutex_lock(&lock_);
+    stop_ = true;
+    pthread_cond_signal(&wake_);
+    pthread_mutex_unlock(&lock_);
+    pthread_join(thread_, NULL);
+    started_ = false;
+  }
+
+  void GetStats(Stats *out) const {
+    *out = stats_;
+    uint64_t tail = tail_;
+    uint64_t head = head_;
+    out->depth = tail > head ? tail - head : 0;
+  }
+
+private:
+  struct Slot {
+    volatile uint64_t   seq;
+    uint32_t            len;
+    uint32_t            pad;
+    uint8_t             data[SlotData];
+  };
+
+  void FreeQueue() {
+    free(slots_);
+    free(lines_);
+    slots_ = NULL;
+    lines_ = NULL;
+    mask_ = 0;
+  }
+
+  static void *Run(void *arg) {
+    ((GTraceAsyncWriter *) arg)->Loop();
+    return NULL;
+  }
+
+#ifndef __WINDOWS__
+  void Loop() {
+    struct iovec iov[BatchEntries];
+    for (;;) {
+      int n = Take(iov);
+      if (n > 0) {
+        WriteBatch(iov, n);
+        continue;
+      }
+      if (stop_) {
+        break;
+      }
+      Sleep();
+    }
+    if (path_[0]) {
+      close(fd_);
+    }
+  }
+
+  // formats up to BatchEntries ready entries and frees their slots
+  int Take(struct iovec *iov) {
+    uint64_t depth = tail_ - head_;
+    if (depth > stats_.maxDepth) {
+      stats_.maxDepth = depth;
+    }
+    int n = 0;
+    while (n < (int) BatchEntries) {
+      Slot *s = &slots_[head_ & mask_];
+      if (atomic_load_acquire64(&s->seq) != head_ + 1) {
+        break;
+      }
+      char *line = lines_ + n * LineSize;
+      int len = fn_(arg_, line, LineSize, s->data, s->len);
+      atomic_store_release64(&s->seq, head_ + mask_ + 1);
+      atomic_store_release64(&head_, head_ + 1);
+      if (len <= 0) {
+        continue;
+      }
+      iov[n].iov_base = line;
+      iov[n].iov_len = MIN(len, (int) LineSize - 1);
+      ++n;
+    }
+    return n;
+  }
+
+  bool Ready() {
+    return atomic_load_acquire64(&slots_[head_ & mask_].seq) == head_ + 1;
+  }
+
+  // Wake
+  // Under lock_, so the signal cannot slip in between the writer's
+  // Ready() check in Sleep() and its wait, and be lost.
+  void Wake() {
+    pthread_mutex_lock(&lock_);
+    pthread_cond_signal(&wake_);
+    pthread_mutex_unlock(&lock_);
+  }
+
+  void Sleep() {
+    pthread_mutex_lock(&lock_);
+    sleeping_ = 1;
+    atomic_barrier();
+    if (!Ready() && !stop_) {
+      struct timeval now;
+      gettimeofday(&now, NULL);
+      uint64_t ns = (uint64_t) now.tv_usec * 1000 +
+                    (uint64_t) FlushIntervalMs * 1000000;
+      struct timespec until;
+      until.tv_sec = now.tv_sec + ns / 1000000000;
+      until.tv_nsec = ns % 1000000000;
+      pthread_cond_timedwait(&wake_, &lock_, &until);
+    }
+    sleeping_ = 0;
+    pthread_mutex_unlock(&lock_);
+  }
+
+  void WriteBatch(struct iovec *iov, int n) {
+    int lines = n;
+    uint64_t bytes = 0;
+    while (n > 0) {
+      ssize_t w = writev(fd_, iov, n);
+      if (w < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      bytes += w;
+      while (n > 0 && (size_t) w >= iov->iov_len) {
+        w -= iov->iov_len;
+        ++iov;
+        --n;
+      }
+      if (n > 0) {
+        iov->iov_base = (char *) iov->iov_base + w;
+        iov->iov_len -= w;
+      }
+    }
+    // lines not written in full are lost, the next batch goes on
+    stats_.lost += n;
+    stats_.written += lines - n;
+    stats_.bytes += bytes;
+    ++stats_.batches;
+    fileBytes_ += bytes;
+    if (maxFileBytes_ && fileBytes_ >= maxFileBytes_) {
+      Rotate();
+    }
+  }
+
+  int OpenFile() {
+    fd_ = open(path_, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0) {
+      return errno;
+    }
+    struct stat st;
+    fileBytes_ = (fstat(fd_, &st) == 0) ? st.st_size : 0;
+    return 0;
+  }
+
+  // <log>.<numFiles - 2> becomes <log>.<numFiles - 1> and so on down to
+  // <log> itself; the oldest is overwritten. A file that cannot be
+  // opened leaves the old one in use.
+  void Rotate() {
+    char from[sizeof(path_) + 16];
+    char to[sizeof(path_) + 16];
+    for (int i = numFiles_ - 1; i > 0; --i) {
+      if (i == 1) {
+        snprintf(from, sizeof(from), "%s", path_);
+      } else {
+        snprintf(from, sizeof(from), "%s.%d", path_, i - 1);
+      }
+      snprintf(to, sizeof(to), "%s.%d", path_, i);
+      rename(from, to);
+    }
+    int old = fd_;
+    if (numFiles_ == 1 && ftruncate(old, 0) == 0) {
+      fileBytes_ = 0;
+    } else if (OpenFile() == 0) {
+      close(old);
+    } else {
+      fd_ = old;
+      fileBytes_ = 0;
+    }
+    ++stats_.rotations;
+  }
+#else
+  void Loop() {}
+#endif
+
+  FormatFunc            *fn_;
+  void                  *arg_;
+  Slot                  *slots_;
+  uint64_t              mask_;
+  volatile uint64_t     tail_;        // next position to claim
+  char                  pad_[64];     // keeps producers off the writer's line
+  volatile uint64_t     head_;        // next position to write
+  volatile int          sleeping_;
+  volatile bool         stop_;
+  bool                  started_;
+  int                   fd_;
+  uint64_t              fileBytes_;
+  uint64_t              maxFileBytes_;
+  int                   numFiles_;
+  char                  *lines_;
+  char                  path_[1024];
+  Stats                 stats_;
+  pthread_t             thread_;
+  pthread_mutex_t       lock_;
+  pthread_cond_t        wake_;
+};
+
+} // namespace fs
+} // namespace mapr
+
+#endif // COMMON_GTRACEWRITER_H__
@@ -92,8 +92,11 @@
 # define CHECK_INPUT 1
 #endif
 
+#include <string.h>
+
 #include "common/common.h"
 #include "common/compressor.h"
+#include "common/xorcrc32.h"
 
 /*****************************************************************************/
 /* nothing should be changed below */
@@ -133,7 +136,93 @@ class LZF : public BaseCompressor {
                    uint8_t *outBuf, int outLen,
                    CompressorScratchMem *scratch);
 
+    // DecompressCRC
+    // Decompress that also returns the XorCrc32 of the output in crcOut:
+    // the lzf_decompress loop, taking the crc of every FuseChunk of
+    // output as soon as it is complete, while it is still in L1.
+    // Fragmented input that does not fit the scratch is decompressed
+    // first and checksummed after. Not virtual, the BaseCompressor
+    // vtable is the library's; see mapr::fs::DecompressCRC().
+    int DecompressCRC(const struct iovec *ivec, int nvec,
+                      uint8_t *outBuf, int outLen, uint32_t *crcOut,
+                      CompressorScratchMem *scratch) {
+      const u8 *ip = (const u8 *) ivec[0].iov_base;
+      unsigned int inLen = ivec[0].iov_len;
+      if (nvec != 1) {
+        inLen = 0;
+        for (int i = 0; i < nvec; ++i) {
+          if (inLen + ivec[i].iov_len > sizeof(scratch->scratch)) {
+            int err = Decompress(ivec, nvec, outBuf, outLen, scratch);
+            if (!err) {
+              *crcOut = mapr::fs::XorCrc32::ComputeUnalign(outBuf, 0,
+                                                           outLen);
+            }
+            return err;
+          }
+          memcpy(scratch->scratch + inLen, ivec[i].iov_base,
+                 ivec[i].iov_len);
+          inLen += ivec[i].iov_len;
+        }
+        ip = scratch->scratch;
+      }
+
+      const u8 *inEnd = ip + inLen;
+      u8 *op = outBuf;
+      u8 *outEnd = outBuf + outLen;
+      u8 *crcDone = outBuf;  // output before this is in crc
+      uint32_t crc = 0;
+
+      while (ip < inEnd) {
+        unsigned int ctrl = *ip++;
+
+        if (ctrl < (1 << 5)) {  // literal run
+          ++ctrl;
+          if (op + ctrl > outEnd || ip + ctrl > inEnd) {
+            return EIO;
+          }
+          memcpy(op, ip, ctrl);
+          op += ctrl;
+          ip += ctrl;
+        } else {  // back reference
+          unsigned int len = ctrl >> 5;
+          const u8 *ref = op - ((ctrl & 0x1f) << 8) - 1;
+          if (len == 7) {
+            if (ip >= inEnd) {
+              return EIO;
+            }
+            len += *ip++;
+          }
+          if (ip >= inEnd) {
+            return EIO;
+          }
+          ref -= *ip++;
+          len += 2;
+          if (op + len > outEnd || ref < outBuf) {
+            return EIO;
+          }
+          do {  // may overlap, must go forward a byte at a time
+            *op++ = *ref++;
+          } while (--len);
+        }
+
+        if (op - crcDone >= FuseChunk) {
+          int words = (op - crcDone) / 4;
+          crc ^= mapr::fs::XorCrc32::ComputeWords(crcDone, words);
+          crcDone += words * 4;
+        }
+      }
+
+      if (op != outEnd) {
+        return EIO;
+      }
+      crc ^= mapr::fs::XorCrc32::ComputeUnalign(outBuf, crcDone - outBuf,
+                                                op - crcDone);
+      *crcOut = crc;
+      return 0;
+    }
+
   private:
+    static const int FuseChunk = 1024;
 
     struct Vec {
       u8 	*base;
@@ -222,11 +222,31 @@ IgnoreSignal(int signum)
 #define atomic_sub32(ptr, val) __sync_fetch_and_sub ((ptr), (val))
 #define atomic_add64(ptr, val) __sync_fetch_and_add ((ptr), (val))
 #define atomic_sub64(ptr, val) __sync_fetch_and_sub ((ptr), (val))
+#define atomic_casptr(ptr, oldval, newval) \
+  __sync_bool_compare_and_swap ((ptr), (oldval), (newval))
+#define atomic_xchgptr(ptr, val) __sync_lock_test_and_set ((ptr), (val))
+#define atomic_cas64(ptr, oldval, newval) \
+  __sync_bool_compare_and_swap ((ptr), (oldval), (newval))
+#define atomic_load_acquire64(ptr) __atomic_load_n ((ptr), __ATOMIC_ACQUIRE)
+#define atomic_store_release64(ptr, val) \
+  __atomic_store_n ((ptr), (val), __ATOMIC_RELEASE)
+#define atomic_barrier() __sync_synchronize ()
 #elif defined (__WINDOWS__)
 #define atomic_add32(ptr, val) InterlockedExchangeAdd ((ptr), (val))
 #define atomic_sub32(ptr, val) InterlockedExchangeAdd ((ptr), -(val)) 
 #define atomic_add64(ptr, val) InterlockedExchangeAdd64 ((long long *)(ptr), (val))
 #define atomic_sub64(ptr, val) InterlockedExchangeAdd64 ((long long *)(ptr), -(val))
+#define atomic_casptr(ptr, oldval, newval) \
+  (InterlockedCompareExchangePointer ((PVOID volatile *)(ptr), (newval), (oldval)) == (oldval))
+#define atomic_xchgptr(ptr, val) \
+  InterlockedExchangePointer ((PVOID volatile *)(ptr), (val))
+#define atomic_cas64(ptr, oldval, newval) \
+  (InterlockedCompareExchange64 ((long long *)(ptr), (newval), (oldval)) == (oldval))
+#define atomic_load_acquire64(ptr) \
+  InterlockedCompareExchange64 ((long long *)(ptr), 0, 0)
+#define atomic_store_release64(ptr, val) \
+  InterlockedExchange64 ((long long *)(ptr), (val))
+#define atomic_barrier() MemoryBarrier ()
 #else
 #error "Need to port atomic_add32 on this platform"
 #endif
@@ -0,0 +1,246 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+#ifndef COMMON_SCRATCHPOOL_H__
+#define COMMON_SCRATCHPOOL_H__
+
+#include "common/nonlinuxsupport.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef __WINDOWS__
+#include <sys/mman.h>
+#endif
+
+#include "common/common.h"
+#include "common/basecompressor.h"
+#include "rpc/dispatch.h"
+#include "rpc/dispatchaffinity.h"
+
+namespace mapr {
+namespace fs {
+
+// Pool of CompressorScratchMem with one free list per CpuQ.
+//
+// Scratch areas are carved out of SlabSize slabs (huge pages when the
+// kernel has them). A queue only grows its own list, from its own thread,
+// so first touch keeps the slab on that thread's node, and a queue that
+// DispatchAffinity gives a memory node has its slabs bound there. Once a
+// queue has reached its high-water mark, Get() and Put() on that
+// queue's thread only touch its private list. A scratch area released
+// from another thread is pushed back on its home queue's remote list
+// with a CAS, and the owner takes that whole list the next time its
+// private list is empty. Only the owner pops, so there is no ABA.
+//
+// Threads that are not a CpuQ (GetMyQid() == 0) share queue 0 under a
+// mutex. Slabs are never returned to the system.
+class CompressScratchPool {
+public:
+  static const int    SlabSize = 2 * 1024 * 1024;  // one huge page
+  static const int    NumQueues = GlobalDispatch::CpuQ_Max;
+
+  struct QueueStats {
+    uint64_t          slabs;        // slabs carved for this queue
+    uint64_t          entries;      // scratch areas in those slabs
+    uint64_t          inUse;
+    uint64_t          highWater;    // max inUse seen
+    uint64_t          remoteFrees;  // Put() from another queue
+  };
+
+  static CompressScratchPool &Instance() {
+    static CompressScratchPool pool;
+    return pool;
+  }
+
+  CompressScratchPool() {
+    memset(queues_, 0, sizeof(queues_));
+    pthread_mutex_init(&sharedLock_, NULL);
+  }
+
+  // Get
+  // Returns a scratch area owned by the calling thread's queue, carving a
+  // new slab only when the queue has none left. NULL if the slab
+  // allocation failed.
+  CompressorScratchMem *Get() {
+    int qid = MyQid();
+    Queue *q = &queues_[qid];
+    Entry *e;
+
+    if (qid == 0) {
+      pthread_mutex_lock(&sharedLock_);
+    }
+    if (!q->local) {
+      q->local = (Entry *) atomic_xchgptr(&q->remote, (Entry *) NULL);
+    }
+    if (!q->local) {
+      Grow(qid);
+    }
+    e = q->local;
+    if (e) {
+      q->local = e->next;
+      uint64_t inUse = atomic_add64(&q->stats.inUse, 1) + 1;
+      if (inUse > q->stats.highWater) {
+        q->stats.highWater = inUse;
+      }
+    }
+    if (qid == 0) {
+      pthread_mutex_unlock(&sharedLock_);
+    }
+    return e ? &e->mem : NULL;
+  }
+
+  // Put
+  // Returns a scratch area to the queue it was carved for.
+  void Put(CompressorScratchMem *mem) {
+    if (!mem) {
+      return;
+    }
+    Entry *e = reinterpret_cast <Entry *> (mem);
+    Queue *q = &queues_[e->homeQid];
+    int qid = MyQid();
+
+    if (qid != 0 && qid == e->homeQid) {
+      e->next = q->local;
+      q->local = e;
+    } else {
+      if (e->homeQid != 0) {
+        atomic_add64(&q->stats.remoteFrees, 1);
+      }
+      Entry *head;
+      do {
+        head = q->remote;
+        e->next = head;
+      } while (!atomic_casptr(&q->remote, head, e));
+    }
+    atomic_sub64(&q->stats.inUse, 1);
+  }
+
+  // Prefill
+  // Grows the calling thread's queue to at least count free scratch
+  // areas. Call it from each compress thread at startup so that no
+  // worker allocates once the system is running.
+  void Prefill(int count) {
+    int qid = MyQid();
+    if (qid == 0) {
+      pthread_mutex_lock(&sharedLock_);
+    }
+    Queue *q = &queues_[qid];
+    while ((int) (q->stats.entries - q->stats.inUse) < count) {
+      if (!Grow(qid)) {
+        break;
+      }
+    }
+    if (qid == 0) {
+      pthread_mutex_unlock(&sharedLock_);
+    }
+  }
+
+  void GetStats(int qid, QueueStats *out) const {
+    debug_assert(qid >= 0 && qid < NumQueues);
+    *out = queues_[qid].stats;
+  }
+
+private:
+  // mem must stay first, Put() maps it back to its Entry
+  struct Entry {
+    CompressorScratchMem  mem;
+    Entry                 *next;
+    int                   homeQid;
+  };
+
+  struct Queue {
+    Entry                 *local;   // owner thread only
+    Entry * volatile      remote;   // pushed by others, drained by owner
+    QueueStats            stats;
+    char                  pad[64];  // keep queues off each other's lines
+  };
+
+  static const int        CacheLineSize = 64;
+  static const int        EntrySize =
+    (sizeof(Entry) + CacheLineSize - 1) & ~(CacheLineSize - 1);
+
+  static inline int MyQid() {
+    int qid = GlobalDispatch::GetMyQid();
+    return (qid > 0 && qid < NumQueues) ? qid : 0;
+  }
+
+#ifndef __WINDOWS__
+  // len bytes starting on a SlabSize boundary, so that transparent huge
+  // pages can back the whole slab; over-maps by SlabSize and unmaps the
+  // unaligned head and tail
+  static void *AllocAligned(size_t len) {
+    size_t mapLen = len + SlabSize;
+    void *m = mmap(NULL, mapLen, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) {
+      return NULL;
+    }
+    uintptr_t start = (uintptr_t) m;
+    uintptr_t aligned = (start + SlabSize - 1) & ~((uintptr_t) SlabSize - 1);
+    size_t head = aligned - start;
+    size_t tail = mapLen - head - len;
+    if (head) {
+      munmap(m, head);
+    }
+    if (tail) {
+      munmap((char *) aligned + len, tail);
+    }
+    return (void *) aligned;
+  }
+#endif
+
+  static void *AllocSlab(size_t len, int qid) {
+#ifndef __WINDOWS__
+    void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED) {
+      p = AllocAligned(len);
+      if (!p) {
+        return NULL;
+      }
+#ifdef MADV_HUGEPAGE
+      madvise(p, len, MADV_HUGEPAGE);
+#endif
+    }
+    // before first touch, so nothing has to move
+    DispatchAffinity::BindToNode(p, len,
+                                 DispatchAffinity::Instance().NodeOf(qid));
+    return p;
+#else
+    return _aligned_malloc(len, SlabSize);
+#endif
+  }
+
+  // carves one slab onto qid's private list, called by the owner only
+  bool Grow(int qid) {
+    size_t len = MAX((size_t) SlabSize,
+                     ((size_t) EntrySize + SlabSize - 1) & ~(SlabSize - 1));
+    char *slab = (char *) AllocSlab(len, qid);
+    if (!slab) {
+      return false;
+    }
+
+    Queue *q = &queues_[qid];
+    int n = len / EntrySize;
+    for (int i = n - 1; i >= 0; --i) {
+      Entry *e = reinterpret_cast <Entry *> (slab + i * EntrySize);
+      e->homeQid = qid;
+      e->next = q->local;
+      q->local = e;
+    }
+    ++q->stats.slabs;
+    q->stats.entries += n;
+    return true;
+  }
+
+  Queue                   queues_[NumQueues];
+  pthread_mutex_t         sharedLock_;  // queue 0, non CpuQ threads
+};
+
+} // namespace fs
+} // namespace mapr
+
+#endif  // COMMON_SCRATCHPOOL_H__
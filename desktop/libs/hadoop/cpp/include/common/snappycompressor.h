@@ -3,9 +3,20 @@
 #ifndef SNAPPYCOMPRESSOR_H__
 #define SNAPPYCOMPRESSOR_H__
 
+#include <errno.h>
+#include <string.h>
+
 #include "common/basecompressor.h"
+#include "common/xorcrc32.h"
+#include "common/snappy/snappy.h"
 #include "common/snappy/snappy-sinksource.h"
 
+#ifdef __GNUC__
+#define SnappyPrefetch(addr, rw) __builtin_prefetch((addr), (rw))
+#else
+#define SnappyPrefetch(addr, rw)
+#endif
+
 #if 0
 #define LPrint(fmt, ...) \
   printf(fmt, ## __VA_ARGS__)
@@ -30,6 +41,104 @@ class SnappyCompressor : public BaseCompressor {
                    CompressorScratchMem *scratch);
 };
 
+// Snappy over iovecs with snappy::RawCompress/RawUncompress, for callers
+// that opt in; SnappyCompressor itself is implemented in libMapRClient.
+//
+// With a single vector snappy reads and writes the caller's buffers
+// directly. For Compress that vector must have room for
+// snappy::MaxCompressedLength(inLen), 32 + inLen + inLen / 6 bytes, which
+// is 9589 for a CompressChunkSize block, since RawCompress does not stop
+// at the end of its output. Anything else, several vectors or a smaller
+// single one, is gathered into, or scattered from, the scratch ioBuf with
+// one memcpy per fragment, prefetching the next fragment, instead of
+// going through the Source/Sink Peek/Skip calls below.
+class SnappyIovecCompressor : public BaseCompressor {
+  public:
+    // Compress
+    // ovec: is the array of output vector
+    // crc: is the array of crcs IN/OUT
+    // nvec: size of ovec and crc arrays
+    // retLen: size of compressed data OUT
+    int Compress(const uint8_t *const inBuf, unsigned int inLen,
+                 struct iovec *ovec, int nvec,
+                 uint16_t *retLen, uint32_t *crc,
+                 CompressorScratchMem *scratch) {
+      SnappyScratchMem *ss = &scratch->snappyScratch;
+      size_t maxLen = snappy::MaxCompressedLength(inLen);
+      size_t n = 0;
+      *retLen = 0;
+
+      if (nvec == 1 && ovec[0].iov_len >= maxLen) {
+        snappy::RawCompress((const char *) inBuf, inLen,
+                            (char *) ovec[0].iov_base, &n);
+        if (n > 0xFFFF) {
+          return ENOSPC;
+        }
+        crc[0] ^= mapr::fs::XorCrc32::ComputeUnalign(
+                    (uint8_t *) ovec[0].iov_base, 0, n);
+        *retLen = n;
+        return 0;
+      }
+
+      if (maxLen > sizeof(ss->ioBuf)) {
+        return EINVAL;
+      }
+      snappy::RawCompress((const char *) inBuf, inLen,
+                          (char *) ss->ioBuf, &n);
+      if (n > 0xFFFF) {
+        return ENOSPC;
+      }
+
+      size_t done = 0;
+      for (int i = 0; i < nvec && done < n; ++i) {
+        if (i + 1 < nvec) {
+          SnappyPrefetch(ovec[i + 1].iov_base, 1);
+        }
+        size_t len = MIN(ovec[i].iov_len, n - done);
+        memcpy(ovec[i].iov_base, ss->ioBuf + done, len);
+        crc[i] ^= mapr::fs::XorCrc32::ComputeUnalign(
+                    (uint8_t *) ovec[i].iov_base, 0, len);
+        done += len;
+      }
+      if (done < n) {
+        return ENOSPC;
+      }
+      *retLen = n;
+      return 0;
+    }
+
+    int Decompress(const struct iovec *ivec, int nvec,
+                   uint8_t *outBuf, int outLen,
+                   CompressorScratchMem *scratch) {
+      SnappyScratchMem *ss = &scratch->snappyScratch;
+      const char *src = (const char *) ivec[0].iov_base;
+      size_t srcLen = ivec[0].iov_len;
+
+      if (nvec != 1) {
+        srcLen = 0;
+        for (int i = 0; i < nvec; ++i) {
+          if (srcLen + ivec[i].iov_len > sizeof(ss->ioBuf)) {
+            return EINVAL;
+          }
+          if (i + 1 < nvec) {
+            SnappyPrefetch(ivec[i + 1].iov_base, 0);
+          }
+          memcpy(ss->ioBuf + srcLen, ivec[i].iov_base, ivec[i].iov_len);
+          srcLen += ivec[i].iov_len;
+        }
+        src = (const char *) ss->ioBuf;
+      }
+
+      size_t len = 0;
+      if (!snappy::GetUncompressedLength(src, srcLen, &len) ||
+          len != (size_t) outLen ||
+          !snappy::RawUncompress(src, srcLen, (char *) outBuf)) {
+        return EIO;
+      }
+      return 0;
+    }
+};
+
 // namespace snappy {
 class CacheArraySource : public snappy::Source {
  public:
@@ -306,6 +306,34 @@ struct FileServerAddStats {
   uint64_t      faileddisks;
 };
 
+// adaptive compression sampling, indexed by CompressionType
+struct CompressionStats {
+  static const int     numTypes = 4;  // CompressionType::MaxVal + 1
+  uint64_t             sampledBlocks[ numTypes];
+  uint64_t             sampledBytesIn[ numTypes];
+  uint64_t             sampledBytesOut[ numTypes];
+  uint64_t             sampledNsecs[ numTypes];
+  uint64_t             streamsChosen[ numTypes];
+  uint64_t             streamsUncompressed;  // no codec saved enough
+};
+
+// dispatch queues, indexed by GlobalDispatch::CpuQid, see DispatchProfile
+struct DispatchQueueStats {
+  uint64_t             runs;
+  uint64_t             waitP50Usecs;  // enqueue to run
+  uint64_t             waitP99Usecs;
+  uint64_t             waitMaxUsecs;
+  uint64_t             runP99Usecs;   // in the callback
+  uint64_t             runMaxUsecs;
+  uint64_t             depthP99;      // queued when one more was added
+  uint64_t             depthMax;
+};
+
+struct DispatchStats {
+  static const int     numQueues = 18;  // GlobalDispatch::CpuQ_Max
+  DispatchQueueStats   queues[ numQueues];
+};
+
 #define LocalDiskStatsFlags_RootFull    (1<< 0)
 #define LocalDiskStatsFlags_OptMaprFull (1<< 1)
 #define LocalDiskStatsFlags_CorePresent (1<< 2)
@@ -328,6 +356,8 @@ struct Stats {
   LoadStats           load;
   FileServerAddStats  fsadd;
   DBStats             db;
+  CompressionStats    compress;  // appended to the shm layout
+  DispatchStats       dispatch;  // keep last, appended to the shm layout
 
   static const int    MaxStatsSize = 4096;
   static void         *CreateShm(int key, int size);
@@ -7,7 +7,9 @@
 #include <stddef.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <common/nonlinuxsupport.h>
 #include <common/linkedList2.h>
 
 namespace mapr {
@@ -90,6 +92,178 @@ private:
    */
   void deleteLocalStore(thrdMemPrefix *localStore);  
 };
+
+/* ThreadLocalStore with a compiler TLS fast path
+ * Same interface and destructor semantics as ThreadLocalStore, which
+ * still owns the pthread key and the memory. On Linux each object also
+ * claims one of FastSlots entries in a small static registry, and
+ * every thread caches its store for that entry in a __thread array, so
+ * getLocalStore() is a TLS load and a compare instead of a
+ * pthread_getspecific() call.
+ *
+ * Each store is created with a small header naming its owner. Every
+ * path that releases a store (thread exit, deleteLocalStore(),
+ * deleteAllLocalStoreForThread()) calls the destructor through
+ * storeReleased(), which drops the calling thread's cached entry
+ * before it calls the owner's destructor with the pointer
+ * createLocalStore() returned. Destroying the object bumps its
+ * registry entry's generation, so no thread can hit on an entry cached
+ * for an earlier owner of the same slot.
+ *
+ * When all FastSlots entries are taken, and on other platforms, the
+ * object works like a plain ThreadLocalStore.
+ */
+class FastThreadLocalStore
+{
+public:
+  static const int FastSlots = 64;
+
+  FastThreadLocalStore(thrdLclDestructor destr)
+    : base(storeReleased), thrdDestr(destr), fastSlot(claimSlot())
+  {
+  }
+
+  ~FastThreadLocalStore()
+  {
+    if (fastSlot >= 0) {
+      registry().gens[fastSlot] += 1;
+      atomic_barrier();
+      registry().inUse[fastSlot] = 0;
+    }
+  }
+
+  void *createLocalStore(int storeSize)
+  {
+    storeHeader *hdr = (storeHeader *)
+      base.createLocalStore(sizeof(storeHeader) + storeSize);
+    if (!hdr) {
+      return NULL;
+    }
+    hdr->owner = this;
+    remember(hdr + 1);
+    return hdr + 1;
+  }
+
+  inline void *getLocalStore()
+  {
+#ifdef __linux__
+    if (fastSlot >= 0) {
+      cacheEntry *e = &cache()[fastSlot];
+      if (e->gen == registry().gens[fastSlot]) {
+        return e->store;
+      }
+    }
+#endif
+    storeHeader *hdr = (storeHeader *) base.getLocalStore();
+    if (!hdr) {
+      return NULL;
+    }
+    remember(hdr + 1);
+    return hdr + 1;
+  }
+
+  void deleteLocalStore()
+  {
+    forget();
+    base.deleteLocalStore();
+  }
+
+  static int deleteAllLocalStoreForThread()
+  {
+    int ret = ThreadLocalStore::deleteAllLocalStoreForThread();
+#ifdef __linux__
+    memset(cache(), 0, FastSlots * sizeof(cacheEntry));
+#endif
+    return ret;
+  }
+
+private:
+  /* keeps the user's store 16 byte aligned */
+  struct storeHeader {
+    FastThreadLocalStore *owner;
+    void                 *pad;
+  };
+
+  struct cacheEntry {
+    uint64_t gen;      /* registry gen it was cached under, 0 for none */
+    void     *store;
+  };
+
+  struct slotRegistry {
+    volatile uint64_t gens[FastSlots];
+    volatile uint64_t inUse[FastSlots];
+  };
+
+  ThreadLocalStore   base;
+  thrdLclDestructor  thrdDestr;
+  int                fastSlot;   /* -1 when the registry was full */
+
+  static slotRegistry &registry()
+  {
+    static slotRegistry reg;
+    return reg;
+  }
+
+#ifdef __linux__
+  static inline cacheEntry *cache()
+  {
+    static __thread cacheEntry entries[FastSlots];
+    return entries;
+  }
+#endif
+
+  static int claimSlot()
+  {
+#ifdef __linux__
+    slotRegistry &reg = registry();
+    for (int i = 0; i < FastSlots; ++i) {
+      if (!reg.inUse[i] && atomic_cas64(&reg.inUse[i], 0, 1)) {
+        /* a fresh generation, never 0 */
+        reg.gens[i] += 1;
+        if (reg.gens[i] == 0) {
+          reg.gens[i] = 1;
+        }
+        return i;
+      }
+    }
+#endif
+    return -1;
+  }
+
+  inline void remember(void *store)
+  {
+#ifdef __linux__
+    if (fastSlot >= 0) {
+      cacheEntry *e = &cache()[fastSlot];
+      e->store = store;
+      e->gen = registry().gens[fastSlot];
+    }
+#endif
+  }
+
+  inline void forget()
+  {
+#ifdef __linux__
+    if (fastSlot >= 0) {
+      cache()[fastSlot].gen = 0;
+    }
+#endif
+  }
+
+  /* the destructor ThreadLocalStore sees, on the releasing thread */
+  static void storeReleased(void *localStore)
+  {
+    storeHeader *hdr = (storeHeader *) localStore;
+    if (!hdr) {
+      return;
+    }
+    FastThreadLocalStore *owner = hdr->owner;
+    owner->forget();
+    if (owner->thrdDestr) {
+      owner->thrdDestr(hdr + 1);
+    }
+  }
+};
 } // namespace fs
 } // namespace mapr
 #endif // ifndef MAPR_THRDLOCAL
@@ -22,16 +22,32 @@ extern mapr::fs::GTrace GT;
 #error Define FILEID__ before using trace in file __FILE__ at __LINE__ 
 #endif
 
+// Trace points above this level are compiled out, e.g. build with
+// -DGTRACE_COMPILED_LEVEL=mapr::fs::TraceLevel::Info to drop Debug.
+#ifndef GTRACE_COMPILED_LEVEL
+#define GTRACE_COMPILED_LEVEL mapr::fs::TraceLevel::Debug
+#endif
+
+// True when a trace point of this module and level would be kept. The
+// first test is a constant and the second one byte load, both made
+// before any argument of the trace point is evaluated.
+#define GTRACE_ON(mod, lvl)                                          \
+  ((lvl) <= GTRACE_COMPILED_LEVEL &&                                \
+   unlikely((lvl) <= mapr::fs::ModuleInfo[(mod)].level))
+
 //Macro for logging messages at module-specific trace-levels.
+//module and level are evaluated twice, arguments only when traced.
 
 // write dispatch id
 #define dwrite(module, level, customData, fmt, ...)                 \
-  GT.Gtrace(mapr::fs::FileId::FILEID__, __LINE__, module,   \
-            level, customData, fmt, ##__VA_ARGS__) 
+  (GTRACE_ON(module, level) ?                                       \
+   GT.Gtrace(mapr::fs::FileId::FILEID__, __LINE__, module,          \
+             level, customData, fmt, ##__VA_ARGS__) : (void) 0)
 
-#define lwrite(module, level, fmt, ...)                 \
-  GT.Gtrace(mapr::fs::FileId::FILEID__, __LINE__, module,   \
-            level, 0, fmt, ##__VA_ARGS__) 
+#define lwrite(module, level, fmt, ...)                             \
+  (GTRACE_ON(module, level) ?                                       \
+   GT.Gtrace(mapr::fs::FileId::FILEID__, __LINE__, module,          \
+             level, 0, fmt, ##__VA_ARGS__) : (void) 0)
 
 //Macro for logging global error messages.
 #define lerror(fmt, ...)                                      \
@@ -12,11 +12,83 @@
 
 #include "common/common.h"
 
+// SIMD kernels for the word loop, picked at first use with cpuid
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    !defined(__WINDOWS__)
+# define XORCRC32_SIMD 1
+# include <immintrin.h>
+# if (__GNUC__ >= 5) || defined(__clang__)
+#  define XORCRC32_AVX512 1
+# endif
+#endif
+
 namespace mapr {
 namespace fs {
 
 class XorCrc32 {
 public:
+  // word loop implementations, all give the same result
+  enum Impl {
+    ImplScalar,
+    ImplSSE2,
+    ImplAVX2,
+    ImplAVX512,
+    ImplMax
+  };
+
+  static const char *ImplName(Impl impl) {
+    static const char *names[ImplMax] = { "scalar", "sse2", "avx2", "avx512" };
+    return (impl < ImplMax) ? names[impl] : "unknown";
+  }
+
+  static bool ImplSupported(Impl impl) {
+    switch (impl) {
+    case ImplScalar:
+      return true;
+#if XORCRC32_SIMD
+    case ImplSSE2:
+      return __builtin_cpu_supports("sse2");
+    case ImplAVX2:
+      return __builtin_cpu_supports("avx2");
+#if XORCRC32_AVX512
+    case ImplAVX512:
+      return __builtin_cpu_supports("avx512f");
+#endif
+#endif
+    default:
+      return false;
+    }
+  }
+
+  // XOR of nwords 32-bit words at b, which need not be aligned
+  static inline uint32_t ComputeWords(Impl impl, const uint8_t *b,
+                                      size_t nwords) {
+    switch (impl) {
+#if XORCRC32_SIMD
+    case ImplSSE2:
+      return WordsSSE2(b, nwords);
+    case ImplAVX2:
+      return WordsAVX2(b, nwords);
+#if XORCRC32_AVX512
+    case ImplAVX512:
+      return WordsAVX512(b, nwords);
+#endif
+#endif
+    default:
+      return WordsScalar(b, nwords);
+    }
+  }
+
+  // the best implementation this cpu has, chosen once
+  static inline Impl BestImpl() {
+    static const Impl best = SelectImpl();
+    return best;
+  }
+
+  static inline uint32_t ComputeWords(const uint8_t *b, size_t nwords) {
+    return ComputeWords(BestImpl(), b, nwords);
+  }
+
   static inline uint16_t Align4Back(uint16_t x) {
     // return (x - (x % 4));
     return x & 0xfffc;
@@ -31,14 +103,7 @@ public:
     MemoryBarrier();
     debug_assert((off % 4) == 0);
     debug_assert((len % 4) == 0);
-    uint32_t *data = (uint32_t *)(buf + off);
-    uint32_t crc = 0;
-    for (int i = 0; i < len; i += 4) {
-      crc ^= *data;
-      ++data;
-    }
-
-    return crc;
+    return ComputeWords(buf + off, len / 4);
   }
 
   static inline uint32_t ComputeUnalignUnsafe(const byte_t *buf, 
@@ -120,46 +185,188 @@ public:
     }
 
     // compute rest
-    uint32_t *b32 = (uint32_t *) b;
-    while (k > 0) {
+    crc ^= ComputeWords(b, k);
+    return crc;
+  }
+
+  // same as ComputeUnalign over the concatenation of the vectors
+  static inline uint32_t Compute(const struct iovec *iov, int niov);
+
+  static inline int VerifyCRC(const struct iovec *iov, int niov,
+                              uint32_t crcIn);
+
+private:
+  static Impl SelectImpl() {
+#if XORCRC32_SIMD
+    __builtin_cpu_init();  // may run before constructors
+#endif
+    for (int impl = ImplMax - 1; impl > ImplScalar; --impl) {
+      if (ImplSupported((Impl) impl)) {
+        return (Impl) impl;
+      }
+    }
+    return ImplScalar;
+  }
+
+  static inline uint32_t WordsScalar(const uint8_t *b, size_t nwords) {
+    const uint32_t *b32 = (const uint32_t *) b;
+    uint32_t crc = 0;
+    while (nwords > 0) {
       crc ^= *b32;
       ++b32;
-      --k;
+      --nwords;
     }
     return crc;
   }
 
-  static inline uint32_t Compute(struct iovec *iov, int niov)
-  {
-    uint8_t *base = static_cast <uint8_t *> (iov[0].iov_base);
-    uint32_t crc =  XorCrc32::ComputeUnalign(base, 0, iov[0].iov_len);
+#if XORCRC32_SIMD
+  // Every vector lane holds the same byte positions mod 4 as the scalar
+  // words, so folding the lanes together gives the scalar result.
+  __attribute__((target("sse2")))
+  static inline uint32_t Fold128(__m128i x) {
+    x = _mm_xor_si128(x, _mm_srli_si128(x, 8));
+    x = _mm_xor_si128(x, _mm_srli_si128(x, 4));
+    return (uint32_t) _mm_cvtsi128_si32(x);
+  }
+
+  __attribute__((target("sse2")))
+  static uint32_t WordsSSE2(const uint8_t *b, size_t nwords) {
+    const __m128i *v = (const __m128i *) b;
+    __m128i x0 = _mm_setzero_si128();
+    __m128i x1 = _mm_setzero_si128();
+    __m128i x2 = _mm_setzero_si128();
+    __m128i x3 = _mm_setzero_si128();
+    size_t nvec = nwords / 4;
 
-    int off = 0, i = 1;
-    while (i < niov) {
-      off += iov[i - 1].iov_len;
-      base = static_cast <uint8_t *> (iov[i].iov_base);
-      crc ^=  ComputeUnalign(base - off, off, iov[i].iov_len);
-      ++i;
+    for (; nvec >= 4; nvec -= 4, v += 4) {
+      x0 = _mm_xor_si128(x0, _mm_loadu_si128(v));
+      x1 = _mm_xor_si128(x1, _mm_loadu_si128(v + 1));
+      x2 = _mm_xor_si128(x2, _mm_loadu_si128(v + 2));
+      x3 = _mm_xor_si128(x3, _mm_loadu_si128(v + 3));
+    }
+    for (; nvec > 0; --nvec, ++v) {
+      x0 = _mm_xor_si128(x0, _mm_loadu_si128(v));
     }
+    x0 = _mm_xor_si128(_mm_xor_si128(x0, x1), _mm_xor_si128(x2, x3));
+    return Fold128(x0) ^ WordsScalar((const uint8_t *) v, nwords & 3);
+  }
 
-    return crc;
+  __attribute__((target("avx2")))
+  static uint32_t WordsAVX2(const uint8_t *b, size_t nwords) {
+    const __m256i *v = (const __m256i *) b;
+    __m256i y0 = _mm256_setzero_si256();
+    __m256i y1 = _mm256_setzero_si256();
+    __m256i y2 = _mm256_setzero_si256();
+    __m256i y3 = _mm256_setzero_si256();
+    size_t nvec = nwords / 8;
+
+    for (; nvec >= 4; nvec -= 4, v += 4) {
+      y0 = _mm256_xor_si256(y0, _mm256_loadu_si256(v));
+      y1 = _mm256_xor_si256(y1, _mm256_loadu_si256(v + 1));
+      y2 = _mm256_xor_si256(y2, _mm256_loadu_si256(v + 2));
+      y3 = _mm256_xor_si256(y3, _mm256_loadu_si256(v + 3));
+    }
+    for (; nvec > 0; --nvec, ++v) {
+      y0 = _mm256_xor_si256(y0, _mm256_loadu_si256(v));
+    }
+    y0 = _mm256_xor_si256(_mm256_xor_si256(y0, y1), _mm256_xor_si256(y2, y3));
+    __m128i x = _mm_xor_si128(_mm256_castsi256_si128(y0),
+                              _mm256_extracti128_si256(y0, 1));
+    return Fold128(x) ^ WordsScalar((const uint8_t *) v, nwords & 7);
   }
 
-  static inline int VerifyCRC(struct iovec *iov, int niov, uint32_t crcIn)
-  {
-    uint8_t *base = static_cast <uint8_t *> (iov[0].iov_base);
-    uint32_t crc =  XorCrc32::ComputeUnalign(base, 0, iov[0].iov_len);
-    if (niov > 1) {
-      int off = iov[0].iov_len;
-      base = static_cast <uint8_t *> (iov[1].iov_base);
-      crc ^=  ComputeUnalign(base - off, off, iov[1].iov_len);
+#if XORCRC32_AVX512
+  __attribute__((target("avx512f")))
+  static uint32_t WordsAVX512(const uint8_t *b, size_t nwords) {
+    const uint8_t *p = b;
+    __m512i z0 = _mm512_setzero_si512();
+    __m512i z1 = _mm512_setzero_si512();
+    size_t nvec = nwords / 16;
+
+    for (; nvec >= 2; nvec -= 2, p += 128) {
+      z0 = _mm512_xor_si512(z0, _mm512_loadu_si512(p));
+      z1 = _mm512_xor_si512(z1, _mm512_loadu_si512(p + 64));
     }
-    return (crc != crcIn);
+    if (nvec) {
+      z0 = _mm512_xor_si512(z0, _mm512_loadu_si512(p));
+      p += 64;
+    }
+    z0 = _mm512_xor_si512(z0, z1);
+    // the maskz forms, the plain extract trips -Wuninitialized in gcc 12
+    __m256i y = _mm256_xor_si256(_mm512_maskz_extracti64x4_epi64(0xF, z0, 0),
+                                 _mm512_maskz_extracti64x4_epi64(0xF, z0, 1));
+    __m128i x = _mm_xor_si128(_mm256_castsi256_si128(y),
+                              _mm256_extracti128_si256(y, 1));
+    return Fold128(x) ^ WordsScalar(p, nwords & 15);
   }
+#endif
+#endif
+};
 
+// XorCrc32 fed in pieces.
+//
+// Update() takes fragments of any length at any address and keeps track
+// of the stream position, so a byte lands in the same lane it would in a
+// single ComputeUnalign over the whole stream. Scatter buffers can be
+// checked in place without gathering them first.
+class XorCrc32Stream {
+public:
+  XorCrc32Stream() : crc_(0), pos_(0) {}
+
+  void Reset() {
+    crc_ = 0;
+    pos_ = 0;
+  }
+
+  void Update(const uint8_t *buf, size_t len) {
+    // bytes up to the next word boundary of the stream
+    while (len && (pos_ & 3)) {
+      crc_ ^= (uint32_t) *buf << (8 * (pos_ & 3));
+      ++buf;
+      ++pos_;
+      --len;
+    }
+
+    size_t words = len / 4;
+    crc_ ^= XorCrc32::ComputeWords(buf, words);
+    buf += words * 4;
+    pos_ += words * 4;
+    len &= 3;
 
+    for (int lane = 0; lane < (int) len; ++lane) {
+      crc_ ^= (uint32_t) buf[lane] << (8 * lane);
+    }
+    pos_ += len;
+  }
+
+  void Update(const struct iovec *iov, int niov) {
+    for (int i = 0; i < niov; ++i) {
+      Update(static_cast <const uint8_t *> (iov[i].iov_base),
+             iov[i].iov_len);
+    }
+  }
+
+  uint32_t Value() const { return crc_; }
+  uint64_t Length() const { return pos_; }
+
+private:
+  uint32_t  crc_;
+  uint64_t  pos_;
 };
 
+inline uint32_t XorCrc32::Compute(const struct iovec *iov, int niov)
+{
+  XorCrc32Stream stream;
+  stream.Update(iov, niov);
+  return stream.Value();
+}
+
+inline int XorCrc32::VerifyCRC(const struct iovec *iov, int niov,
+                               uint32_t crcIn)
+{
+  return (Compute(iov, niov) != crcIn);
+}
+
 } // namespace fs 
 } // namespace mapr 
 
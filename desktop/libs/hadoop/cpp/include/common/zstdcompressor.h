@@ -0,0 +1,267 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+#ifndef ZSTDCOMPRESSOR_H__
+#define ZSTDCOMPRESSOR_H__
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zstd.h>
+#include <zstd_errors.h>
+#include <zdict.h>
+
+#include "common/basecompressor.h"
+#include "common/xorcrc32.h"
+
+// A thread's zstd contexts, made on its first block and reused for every
+// block after. Kept out of CompressorScratchMem, whose size libMapRClient
+// fixes.
+struct ZSTDScratchMem {
+  ZSTD_CCtx *cctx;
+  ZSTD_DCtx *dctx;
+  byte_t ioBuf[CompressChunkSize + 1024];
+};
+
+// Zstandard on CompressChunkSize blocks.
+//
+// There is no CompressionType id for zstd until fs/proto/common.proto and
+// libMapRClient's Compressor have one, so the codec is only reachable
+// through this class; Type is the id it is meant to get.
+//
+// Each thread keeps its compression and decompression contexts in a
+// ZSTDScratchMem, so no memory is allocated per block; the
+// CompressorScratchMem argument is not used. Only zstd's stable API is
+// used, so the header can be included anywhere.
+// Small blocks compress much better against a shared dictionary trained
+// on representative data: once SetDictionary() has installed one, every
+// block is compressed with it and carries its id, and Decompress()
+// refuses a block whose dictionary is not the installed one. A
+// dictionary must therefore stay installed for as long as data written
+// with it can be read.
+class ZSTDCompressor : public BaseCompressor {
+  public:
+    static const uint32_t Type = 4;  // not a CompressionType yet
+    static const int DefaultLevel = 3;
+    static const int MaxLevel = 9;   // beyond that, too slow for a block
+
+    // Compress
+    // ovec: is the array of output vector
+    // crc: is the array of crcs IN/OUT
+    // nvec: size of ovec and crc arrays
+    // retLen: size of compressed data OUT
+    int Compress(const uint8_t *const inBuf, unsigned int inLen,
+                 struct iovec *ovec, int nvec,
+                 uint16_t *retLen, uint32_t *crc,
+                 CompressorScratchMem * /* scratch */) {
+      ZSTDScratchMem *zs = ThreadScratch();
+      Dictionary *d = SharedDict();
+      *retLen = 0;
+      if (!zs) {
+        return ENOMEM;
+      }
+      ZSTD_CCtx *cctx = zs->cctx;
+
+      // single output vector: compress straight into it
+      void *dst = (nvec == 1) ? ovec[0].iov_base : zs->ioBuf;
+      size_t cap = (nvec == 1) ? ovec[0].iov_len : sizeof(zs->ioBuf);
+      size_t n = d->cdict ?
+        ZSTD_compress_usingCDict(cctx, dst, cap, inBuf, inLen, d->cdict) :
+        ZSTD_compressCCtx(cctx, dst, cap, inBuf, inLen, Level());
+      if (ZSTD_isError(n)) {
+        return (ZSTD_getErrorCode(n) == ZSTD_error_dstSize_tooSmall) ?
+               ENOSPC : EIO;
+      }
+      if (n > 0xFFFF) {
+        return ENOSPC;
+      }
+
+      if (nvec == 1) {
+        crc[0] ^= mapr::fs::XorCrc32::ComputeUnalign((uint8_t *) dst, 0, n);
+      } else {
+        size_t done = 0;
+        for (int i = 0; i < nvec && done < n; ++i) {
+          size_t len = MIN(ovec[i].iov_len, n - done);
+          memcpy(ovec[i].iov_base, zs->ioBuf + done, len);
+          crc[i] ^= mapr::fs::XorCrc32::ComputeUnalign(
+                      (uint8_t *) ovec[i].iov_base, 0, len);
+          done += len;
+        }
+        if (done < n) {
+          return ENOSPC;
+        }
+      }
+      *retLen = n;
+      return 0;
+    }
+
+    int Decompress(const struct iovec *ivec, int nvec,
+                   uint8_t *outBuf, int outLen,
+                   CompressorScratchMem * /* scratch */) {
+      ZSTDScratchMem *zs = ThreadScratch();
+      Dictionary *d = SharedDict();
+      if (!zs) {
+        return ENOMEM;
+      }
+
+      const void *src = ivec[0].iov_base;
+      size_t srcLen = ivec[0].iov_len;
+      if (nvec != 1) {
+        srcLen = 0;
+        for (int i = 0; i < nvec; ++i) {
+          if (srcLen + ivec[i].iov_len > sizeof(zs->ioBuf)) {
+            return EINVAL;
+          }
+          memcpy(zs->ioBuf + srcLen, ivec[i].iov_base, ivec[i].iov_len);
+          srcLen += ivec[i].iov_len;
+        }
+        src = zs->ioBuf;
+      }
+
+      unsigned dictId = ZSTD_getDictID_fromFrame(src, srcLen);
+      if (dictId && (!d->ddict || dictId != d->id)) {
+        return EIO;
+      }
+
+      ZSTD_DCtx *dctx = zs->dctx;
+      size_t n = dictId ?
+        ZSTD_decompress_usingDDict(dctx, outBuf, outLen, src, srcLen,
+                                   d->ddict) :
+        ZSTD_decompressDCtx(dctx, outBuf, outLen, src, srcLen);
+      if (ZSTD_isError(n) || n != (size_t) outLen) {
+        return EIO;
+      }
+      return 0;
+    }
+
+    // SetLevel
+    // Level used when there is no dictionary, 1 .. MaxLevel.
+    static int SetLevel(int level) {
+      if (level < 1 || level > MaxLevel) {
+        return EINVAL;
+      }
+      SharedDict()->level = level;
+      return 0;
+    }
+
+    // SetDictionary
+    // Installs a dictionary made by TrainDictionary() for all blocks
+    // compressed from now on, at the given level. Not safe against
+    // concurrent Compress/Decompress, call it before the compress threads
+    // start. Raw content dictionaries carry no id and are refused.
+    static int SetDictionary(const void *dict, size_t len, int level) {
+      if (level < 1 || level > MaxLevel) {
+        return EINVAL;
+      }
+      unsigned id = ZDICT_getDictID(dict, len);
+      if (!id) {
+        return EINVAL;
+      }
+
+      ZSTD_CDict *cdict = ZSTD_createCDict(dict, len, level);
+      ZSTD_DDict *ddict = ZSTD_createDDict(dict, len);
+      if (!cdict || !ddict) {
+        ZSTD_freeCDict(cdict);
+        ZSTD_freeDDict(ddict);
+        return ENOMEM;
+      }
+
+      Dictionary *d = SharedDict();
+      ZSTD_freeCDict(d->cdict);
+      ZSTD_freeDDict(d->ddict);
+      d->cdict = cdict;
+      d->ddict = ddict;
+      d->id = id;
+      d->level = level;
+      return 0;
+    }
+
+    // ClearDictionary
+    // Goes back to compressing without a dictionary. Same restrictions
+    // as SetDictionary().
+    static void ClearDictionary() {
+      Dictionary *d = SharedDict();
+      ZSTD_freeCDict(d->cdict);
+      ZSTD_freeDDict(d->ddict);
+      d->cdict = NULL;
+      d->ddict = NULL;
+      d->id = 0;
+    }
+
+    // TrainDictionary
+    // Trains a dictionary of at most dictCap bytes from numSamples
+    // samples stored back to back in samples. Blocks of the data that is
+    // going to be compressed make the best samples.
+    static int TrainDictionary(const void *samples, const size_t *sampleLens,
+                               unsigned numSamples, void *dict,
+                               size_t dictCap, size_t *dictLen) {
+      size_t n = ZDICT_trainFromBuffer(dict, dictCap, samples,
+                                       sampleLens, numSamples);
+      if (ZDICT_isError(n)) {
+        return EINVAL;
+      }
+      *dictLen = n;
+      return 0;
+    }
+
+  private:
+    struct Dictionary {
+      ZSTD_CDict *cdict;
+      ZSTD_DDict *ddict;
+      unsigned id;
+      int level;
+    };
+
+    static Dictionary *SharedDict() {
+      static Dictionary dict;  // zero initialized
+      return &dict;
+    }
+
+    // ThreadScratch
+    // The calling thread's contexts, made on its first block and freed
+    // when it exits.
+    static ZSTDScratchMem *ThreadScratch() {
+      static pthread_once_t once = PTHREAD_ONCE_INIT;
+      pthread_once(&once, CreateScratchKey);
+      ZSTDScratchMem *zs = (ZSTDScratchMem *) pthread_getspecific(ScratchKey());
+      if (zs) {
+        return zs;
+      }
+      zs = (ZSTDScratchMem *) malloc(sizeof(ZSTDScratchMem));
+      if (!zs) {
+        return NULL;
+      }
+      zs->cctx = ZSTD_createCCtx();
+      zs->dctx = ZSTD_createDCtx();
+      if (!zs->cctx || !zs->dctx ||
+          pthread_setspecific(ScratchKey(), zs) != 0) {
+        FreeScratch(zs);
+        return NULL;
+      }
+      return zs;
+    }
+
+    static void FreeScratch(void *arg) {
+      ZSTDScratchMem *zs = (ZSTDScratchMem *) arg;
+      ZSTD_freeCCtx(zs->cctx);
+      ZSTD_freeDCtx(zs->dctx);
+      free(zs);
+    }
+
+    static pthread_key_t &ScratchKey() {
+      static pthread_key_t key;
+      return key;
+    }
+
+    static void CreateScratchKey() {
+      pthread_key_create(&ScratchKey(), FreeScratch);
+    }
+
+    static int Level() {
+      int level = SharedDict()->level;
+      return level ? level : DefaultLevel;
+    }
+};
+
+#endif  // ZSTDCOMPRESSOR_H__
@@ -0,0 +1,372 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+#ifndef RPC_DISPATCHAFFINITY_H__
+#define RPC_DISPATCHAFFINITY_H__
+
+#include "common/nonlinuxsupport.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "common/common.h"
+#include "rpc/dispatch.h"
+#include "rpc/dispatchstats.h"
+
+namespace mapr {
+namespace fs {
+
+// Which cpus and which memory node each CpuQ thread uses.
+//
+// The policy is a list of rules, separated by blanks or ';':
+//
+//   queues:cpus[@node]
+//
+// queues is a queue name as DispatchProfile::QueueName() prints it, a
+// qid, a range of either ("DBFlush1-DBFlush3"), "all", or a ','
+// separated list of those. cpus is a list of cpus and cpu ranges,
+// "0-3,8,10-11". node is the memory node the queue's threads and
+// memory should come from. A later rule overrides an earlier one for
+// the queues both name, so "all:0-63 Rpc:0-1@0" works. For example, on
+// two sockets of 16 cpus:
+//
+//   Rpc,FS:0-3@0 DBFlush1-DBFlush3:4-15@0 DBFlush4-DBFlush6:16-27@1
+//   Compress1-Compress3:28-31@1
+//
+// Configure() or LoadConf() sets the policy at startup. Then each
+// dispatch thread calls ApplyToMyThread() once it has its CpuQid, or
+// the code that started it calls ApplyToThread(). Pools that belong to
+// a queue put their memory on the queue's node: CompressScratchPool
+// slabs and DispatchRings do, and per-queue pools of WAs should use
+// AllocOnNode(). Queues the policy does not name are left alone.
+//
+// Cpu pinning and memory nodes are Linux only; elsewhere applying a
+// policy fails with ENOSYS and NodeOf() is always -1.
+class DispatchAffinity {
+public:
+  static const int      NumQueues = GlobalDispatch::CpuQ_Max;
+  static const int      MaxCpus = 1024;
+  static const int      MaxNodes = 64;
+  static const int      MaxSpec = 4096;
+
+  struct Policy {
+    bool                set;
+    int                 node;         // -1 for any
+    uint64_t            cpus[MaxCpus / 64];
+  };
+
+  static DispatchAffinity &Instance() {
+    static DispatchAffinity affinity;
+    return affinity;
+  }
+
+  DispatchAffinity() {
+    memset(policy_, 0, sizeof(policy_));
+    for (int i = 0; i < NumQueues; ++i) {
+      policy_[i].node = -1;
+    }
+  }
+
+  // Configure
+  // Replaces the policy with spec, or returns EINVAL and keeps the old
+  // one when spec does not parse.
+  int Configure(const char *spec) {
+    char buf[MaxSpec];
+    if (strlen(spec) >= sizeof(buf)) {
+      return EINVAL;
+    }
+    strcpy(buf, spec);
+    Policy policy[NumQueues];
+    memset(policy, 0, sizeof(policy));
+    for (int i = 0; i < NumQueues; ++i) {
+      policy[i].node = -1;
+    }
+    char *save = NULL;
+    for (char *rule = strtok_r(buf, " \t\r\n;", &save); rule;
+         rule = strtok_r(NULL, " \t\r\n;", &save)) {
+      if (ParseRule(rule, policy) != 0) {
+        return EINVAL;
+      }
+    }
+    memcpy(policy_, policy, sizeof(policy_));
+    return 0;
+  }
+
+  // LoadConf
+  // Configures from the "key=policy" line of a key=value file such as
+  // mfs.conf. No such line means no policy.
+  int LoadConf(const char *path, const char *key) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+      return errno;
+    }
+    int err = 0;
+    size_t keyLen = strlen(key);
+    char line[MaxSpec];
+    while (fgets(line, sizeof(line), fp)) {
+      char *p = line;
+      while (isspace((unsigned char) *p)) {
+        ++p;
+      }
+      if (strncmp(p, key, keyLen) != 0) {
+        continue;
+      }
+      p += keyLen;
+      while (*p == ' ' || *p == '\t') {
+        ++p;
+      }
+      if (*p == '=') {
+        err = Configure(p + 1);
+        break;
+      }
+    }
+    fclose(fp);
+    return err;
+  }
+
+  // NodeOf
+  // The memory node of qid, -1 if it has none.
+  int NodeOf(int qid) const {
+#ifdef __linux__
+    if (qid > 0 && qid < NumQueues && policy_[qid].set) {
+      return policy_[qid].node;
+    }
+#endif
+    return -1;
+  }
+
+  bool GetPolicy(int qid, Policy *out) const {
+    if (qid <= 0 || qid >= NumQueues || !policy_[qid].set) {
+      return false;
+    }
+    *out = policy_[qid];
+    return true;
+  }
+
+  // ApplyToThread
+  // Pins thread t to qid's cpus. The memory node is a per-thread
+  // setting the thread has to make itself, see ApplyToMyThread().
+  int ApplyToThread(pthread_t t, int qid) const {
+    if (qid <= 0 || qid >= NumQueues) {
+      return EINVAL;
+    }
+    const Policy *p = &policy_[qid];
+    if (!p->set) {
+      return 0;
+    }
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c = 0; c < MaxCpus && c < CPU_SETSIZE; ++c) {
+      if (p->cpus[c / 64] & (1ULL << (c % 64))) {
+        CPU_SET(c, &set);
+      }
+    }
+    return pthread_setaffinity_np(t, sizeof(set), &set);
+#else
+    return ENOSYS;
+#endif
+  }
+
+  // ApplyToMyThread
+  // Pins the calling dispatch thread to its queue's cpus and has its
+  // memory come from the queue's node when it can.
+  int ApplyToMyThread() const {
+    int qid = GlobalDispatch::GetMyQid();
+    int err = ApplyToThread(pthread_self(), qid);
+    int node = NodeOf(qid);
+    if (err || node < 0) {
+      return err;
+    }
+#ifdef __linux__
+    uint64_t mask = 1ULL << node;
+    if (syscall(SYS_set_mempolicy, MpolPreferred, &mask, MaxNodes + 1) != 0) {
+      return errno;
+    }
+#endif
+    return 0;
+  }
+
+  // BindToNode
+  // Places the pages of [p, p + len) on node, moving any already
+  // touched. p must be page aligned. Nothing to do for node -1.
+  static int BindToNode(void *p, size_t len, int node) {
+    if (node < 0) {
+      return 0;
+    }
+#ifdef __linux__
+    if (node >= MaxNodes) {
+      return EINVAL;
+    }
+    uint64_t mask = 1ULL << node;
+    if (syscall(SYS_mbind, p, len, MpolPreferred, &mask, MaxNodes + 1,
+                MpolMfMove) != 0) {
+      return errno;
+    }
+    return 0;
+#else
+    return ENOSYS;
+#endif
+  }
+
+  // AllocOnNode
+  // Zeroed memory placed on node, for per-queue pools of WAs and the
+  // like; free() releases it. Falls back to any node when the pages
+  // cannot be placed.
+  static void *AllocOnNode(size_t len, int node) {
+    void *p = NULL;
+#ifdef __linux__
+    size_t page = sysconf(_SC_PAGESIZE);
+    len = (len + page - 1) & ~(page - 1);
+    if (posix_memalign(&p, page, len) != 0) {
+      return NULL;
+    }
+    BindToNode(p, len, node);
+#else
+    p = malloc(len);
+    if (!p) {
+      return NULL;
+    }
+#endif
+    memset(p, 0, len);
+    return p;
+  }
+
+private:
+  // from linux/mempolicy.h
+  static const int      MpolPreferred = 1;
+  static const unsigned MpolMfMove = 1 << 1;
+
+  // a qid from a name or a number
+  static int ParseQueue(const char *s, int len) {
+    char name[32];
+    if (len <= 0 || len >= (int) sizeof(name)) {
+      return -1;
+    }
+    memcpy(name, s, len);
+    name[len] = '\0';
+    if (isdigit((unsigned char) name[0])) {
+      char *end;
+      long q = strtol(name, &end, 10);
+      return (*end == '\0' && q > 0 && q < NumQueues) ? (int) q : -1;
+    }
+    for (int q = 1; q < NumQueues; ++q) {
+      if (strcasecmp(name, DispatchProfile::QueueName(q)) == 0) {
+        return q;
+      }
+    }
+    return -1;
+  }
+
+  // "a,b-c,all" into a mask of qids
+  static int ParseQueues(const char *s, const char *end, bool *queues) {
+    while (s < end) {
+      const char *comma = (const char *) memchr(s, ',', end - s);
+      const char *item = s;
+      const char *itemEnd = comma ? comma : end;
+      s = comma ? comma + 1 : end;
+      if (itemEnd - item == 3 && strncasecmp(item, "all", 3) == 0) {
+        for (int q = 1; q < NumQueues; ++q) {
+          queues[q] = true;
+        }
+        continue;
+      }
+      // names have no '-', so one splits a range
+      const char *dash = (const char *) memchr(item, '-', itemEnd - item);
+      int first = ParseQueue(item, (dash ? dash : itemEnd) - item);
+      int last = dash ? ParseQueue(dash + 1, itemEnd - dash - 1) : first;
+      if (first < 0 || last < first) {
+        return EINVAL;
+      }
+      for (int q = first; q <= last; ++q) {
+        queues[q] = true;
+      }
+    }
+    return 0;
+  }
+
+  // "0-3,8" into a cpu mask
+  static int ParseCpus(const char *s, uint64_t *cpus) {
+    bool any = false;
+    while (*s) {
+      char *end;
+      long first = strtol(s, &end, 10);
+      long last = first;
+      if (end == s) {
+        return EINVAL;
+      }
+      s = end;
+      if (*s == '-') {
+        last = strtol(s + 1, &end, 10);
+        if (end == s + 1) {
+          return EINVAL;
+        }
+        s = end;
+      }
+      if (first < 0 || last < first || last >= MaxCpus) {
+        return EINVAL;
+      }
+      for (long c = first; c <= last; ++c) {
+        cpus[c / 64] |= 1ULL << (c % 64);
+      }
+      any = true;
+      if (*s == ',' && s[1]) {
+        ++s;
+      } else if (*s) {
+        return EINVAL;
+      }
+    }
+    return any ? 0 : EINVAL;
+  }
+
+  static int ParseRule(char *rule, Policy *policy) {
+    char *colon = strchr(rule, ':');
+    if (!colon) {
+      return EINVAL;
+    }
+    *colon = '\0';
+    char *cpus = colon + 1;
+    int node = -1;
+    char *at = strchr(cpus, '@');
+    if (at) {
+      *at = '\0';
+      char *end;
+      node = strtol(at + 1, &end, 10);
+      if (end == at + 1 || *end || node < 0 || node >= MaxNodes) {
+        return EINVAL;
+      }
+    }
+
+    bool queues[NumQueues];
+    memset(queues, 0, sizeof(queues));
+    Policy p;
+    memset(&p, 0, sizeof(p));
+    if (ParseQueues(rule, colon, queues) != 0 ||
+        ParseCpus(cpus, p.cpus) != 0) {
+      return EINVAL;
+    }
+    p.set = true;
+    p.node = node;
+    for (int q = 1; q < NumQueues; ++q) {
+      if (queues[q]) {
+        policy[q] = p;
+      }
+    }
+    return 0;
+  }
+
+  Policy                policy_[NumQueues];
+};
+
+} // namespace fs
+} // namespace mapr
+
+#endif // RPC_DISPATCHAFFINITY_H__
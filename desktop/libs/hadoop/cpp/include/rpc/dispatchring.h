@@ -0,0 +1,358 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+#ifndef RPC_DISPATCHRING_H__
+#define RPC_DISPATCHRING_H__
+
+#include "common/nonlinuxsupport.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/common.h"
+#include "rpc/dispatch.h"
+#include "rpc/dispatchaffinity.h"
+#include "rpc/dispatchstats.h"
+
+namespace mapr {
+namespace fs {
+
+// Bounded ring of dispatch WAs, many producers and one consumer.
+//
+// A producer reserves room for a whole batch with one CAS on the tail,
+// then stores the WAs into their slots; a slot is ready for the
+// consumer when it is not NULL. The consumer clears each slot it takes
+// before it moves the head, so a reserved slot is always empty.
+//
+// Producers check for room against headCache_, which sits on their own
+// line, and only read the consumer's head when the ring looks full.
+// headCache_ is written by whichever producer looked last, so it may
+// be behind, never ahead.
+class DispatchRing {
+public:
+  DispatchRing()
+    : slots_(NULL), mask_(0), tail_(0), headCache_(0), head_(0) {}
+
+  ~DispatchRing() {
+    free((void *) slots_);
+  }
+
+  // Init
+  // numSlots is rounded up to a power of two. The slots are put on
+  // node, the consumer's, unless it is -1.
+  int Init(uint32_t numSlots, int node) {
+    uint64_t n = 2;
+    while (n < numSlots && n < (1U << 30)) {
+      n <<= 1;
+    }
+    slots_ = (volatile uint64_t *)
+      DispatchAffinity::AllocOnNode(n * sizeof(uint64_t), node);
+    if (!slots_) {
+      return ENOMEM;
+    }
+    mask_ = n - 1;
+    return 0;
+  }
+
+  // Publish
+  // Puts the n WAs of the list h into the ring, in order, or none of
+  // them when there is no room for all. depth is set to what was
+  // queued ahead of them.
+  bool Publish(GlobalDispatchWA *h, uint64_t n, uint64_t *depth) {
+    uint64_t pos = atomic_load_acquire64(&tail_);
+    for (;;) {
+      if (pos + n - headCache_ > mask_ + 1) {
+        headCache_ = atomic_load_acquire64(&head_);
+        if (pos + n - headCache_ > mask_ + 1) {
+          return false;
+        }
+      }
+      if (atomic_cas64(&tail_, pos, pos + n)) {
+        break;
+      }
+      pos = atomic_load_acquire64(&tail_);
+    }
+    *depth = pos - headCache_;
+    for (uint64_t i = 0; i < n; ++i) {
+      // once stored the WA may run and be reused, so read next first
+      GlobalDispatchWA *next = h->next;
+      atomic_store_release64(&slots_[(pos + i) & mask_],
+                             (uint64_t) (uintptr_t) h);
+      h = next;
+    }
+    return true;
+  }
+
+  // Pop
+  // Consumer only. NULL when the next slot is not published yet.
+  inline GlobalDispatchWA *Pop() {
+    volatile uint64_t *s = &slots_[head_ & mask_];
+    uint64_t v = atomic_load_acquire64(s);
+    if (!v) {
+      return NULL;
+    }
+    *s = 0;
+    atomic_store_release64(&head_, head_ + 1);
+    return (GlobalDispatchWA *) (uintptr_t) v;
+  }
+
+  // Ready
+  // Consumer only: the next slot is published.
+  inline bool Ready() const {
+    return atomic_load_acquire64(&slots_[head_ & mask_]) != 0;
+  }
+
+  // Empty
+  // Nothing reserved that the consumer has not taken.
+  inline bool Empty() const {
+    return atomic_load_acquire64(&tail_) == head_;
+  }
+
+  bool Initialized() const { return slots_ != NULL; }
+
+private:
+  volatile uint64_t     *slots_;
+  uint64_t              mask_;
+  char                  pad0_[64];
+  volatile uint64_t     tail_;        // next position to reserve
+  volatile uint64_t     headCache_;   // a head producers have seen
+  char                  pad1_[64];
+  volatile uint64_t     head_;        // next position to take
+  char                  pad2_[64];
+};
+
+// Cross-queue handoff through a DispatchRing per CpuQid.
+//
+// GlobalDispatch::ExecuteBatch() hands a list to the target queue under
+// the queue's lock, so the RPC queue and the FS and DB queues it feeds
+// keep taking the lock's line from each other. A queue enabled here
+// takes batches built with GlobalDispatch::AppendBatch() through its
+// ring instead: one CAS per batch on the producer side, and none on
+// the consumer side.
+//
+// The consumer is a Drain() callback queued on the target through the
+// regular dispatcher when the ring goes from idle to busy, the same way
+// WorkStealDispatch wakes a queue. Drain() runs at most DrainBudget
+// callbacks before it requeues itself.
+//
+// A batch that does not fit goes on the queue's overflow list, under a
+// lock, and so do all batches after it until the consumer has emptied
+// the ring and taken the list; a producer's WAs run in the order it
+// queued them, ring or not. Nothing is dropped and no producer waits.
+class DispatchRings {
+public:
+  static const int      NumQueues = GlobalDispatch::CpuQ_Max;
+  static const uint32_t DefaultSlots = 4096;
+  static const int      DrainBudget = 64;
+
+  struct QueueStats {
+    uint64_t            batches;      // ExecuteBatch() aimed at this queue
+    uint64_t            published;    // WAs that went through the ring
+    uint64_t            overflowed;   // WAs that went on the overflow list
+    uint64_t            executed;     // callbacks run from either
+    uint64_t            drains;       // Drain() callbacks run
+  };
+
+  static DispatchRings &Instance() {
+    static DispatchRings rings;
+    return rings;
+  }
+
+  DispatchRings() {
+    for (int i = 0; i < NumQueues; ++i) {
+      Queue *q = &queues_[i];
+      q->qid = i;
+      q->enabled = false;
+      q->scheduled = 0;
+      q->overflowing = false;
+      q->overHead = NULL;
+      q->overTail = NULL;
+      q->runHead = NULL;
+      pthread_mutex_init(&q->lock, NULL);
+      memset(&q->stats, 0, sizeof(q->stats));
+    }
+  }
+
+  // Enable
+  // Gives qid a ring of numSlots. qid must have a dispatch thread.
+  // Call at startup, before anything is submitted to qid.
+  int Enable(int qid, uint32_t numSlots) {
+    if (qid <= 0 || qid >= NumQueues || numSlots < 2) {
+      return EINVAL;
+    }
+    Queue *q = &queues_[qid];
+    if (q->ring.Initialized()) {
+      return EEXIST;
+    }
+    int node = DispatchAffinity::Instance().NodeOf(qid);
+    int err = q->ring.Init(numSlots, node);
+    if (err) {
+      return err;
+    }
+    atomic_barrier();
+    q->enabled = true;
+    return 0;
+  }
+
+  int Enable(int qid) {
+    return Enable(qid, DefaultSlots);
+  }
+
+  bool Enabled(int qid) const {
+    return qid > 0 && qid < NumQueues && queues_[qid].enabled;
+  }
+
+  // ExecuteBatch
+  // Like GlobalDispatch::ExecuteBatch(): runs the list h..t, built with
+  // GlobalDispatch::AppendBatch(), on atQid. Plain ExecuteBatch() when
+  // atQid has no ring.
+  int ExecuteBatch(int atQid, GlobalDispatchWA *h, GlobalDispatchWA *t) {
+    if (!h) {
+      return 0;
+    }
+    if (!Enabled(atQid)) {
+      return g_Dispatch.ExecuteBatch(atQid, h, t);
+    }
+    Queue *q = &queues_[atQid];
+    t->next = NULL;
+    uint64_t now = DispatchProfile::NowUsecs();
+    uint64_t n = 0;
+    for (GlobalDispatchWA *wa = h; wa; wa = wa->next) {
+      wa->dispatchTime = now;
+      ++n;
+    }
+    atomic_add64(&q->stats.batches, 1);
+
+    uint64_t depth = 0;
+    if (!q->overflowing && q->ring.Publish(h, n, &depth)) {
+      atomic_add64(&q->stats.published, n);
+    } else {
+      Overflow(q, h, t, n);
+    }
+    DispatchProfile::Instance().RecordDepth(atQid, depth);
+    Schedule(q);
+    return 0;
+  }
+
+  // ExecuteAt
+  // A batch of one.
+  int ExecuteAt(int atQid, CallbackFunc *func, void *arg, int err,
+                uint64_t dispatchId, GlobalDispatchWA *wa) {
+    if (!Enabled(atQid)) {
+      return g_Dispatch.ExecuteAt(atQid, func, arg, err, dispatchId, wa);
+    }
+    wa->cb = func;
+    wa->arg = arg;
+    wa->err = err;
+    wa->dispatchId = dispatchId;
+    wa->next = NULL;
+    return ExecuteBatch(atQid, wa, wa);
+  }
+
+  int ExecuteAt(int atQid, CallbackFunc *func, void *arg, int err,
+                GlobalDispatchWA *wa) {
+    return ExecuteAt(atQid, func, arg, err, GlobalDispatch::id(), wa);
+  }
+
+  void GetStats(int qid, QueueStats *out) const {
+    debug_assert(qid >= 0 && qid < NumQueues);
+    *out = queues_[qid].stats;
+  }
+
+private:
+  struct Queue {
+    DispatchRing        ring;
+    int                 qid;
+    volatile bool       enabled;
+    volatile bool       overflowing;  // batches go on the overflow list
+    volatile uint64_t   scheduled;    // a Drain() is queued or running
+    GlobalDispatchWA    drainWA;      // for that Drain()
+    pthread_mutex_t     lock;         // for the overflow list
+    GlobalDispatchWA    *overHead;
+    GlobalDispatchWA    *overTail;
+    GlobalDispatchWA    *runHead;     // taken overflow, consumer only
+    QueueStats          stats;
+  };
+
+  static void Overflow(Queue *q, GlobalDispatchWA *h, GlobalDispatchWA *t,
+                       uint64_t n) {
+    pthread_mutex_lock(&q->lock);
+    if (q->overTail) {
+      q->overTail->next = h;
+    } else {
+      q->overHead = h;
+    }
+    q->overTail = t;
+    q->overflowing = true;
+    pthread_mutex_unlock(&q->lock);
+    atomic_add64(&q->stats.overflowed, n);
+  }
+
+  // queues a Drain() on q unless one is already queued or running
+  static void Schedule(Queue *q) {
+    if (!q->scheduled && atomic_cas64(&q->scheduled, 0, 1)) {
+      g_Dispatch.ExecuteAt(q->qid, Drain, q, 0, &q->drainWA);
+    }
+  }
+
+  // next WA for q's thread: overflow already taken, then the ring, then
+  // the overflow list once everything queued before it has run
+  static GlobalDispatchWA *Next(Queue *q) {
+    GlobalDispatchWA *wa = q->runHead;
+    if (wa) {
+      q->runHead = wa->next;
+      return wa;
+    }
+    wa = q->ring.Pop();
+    if (wa || !q->overflowing || !q->ring.Empty()) {
+      return wa;
+    }
+    pthread_mutex_lock(&q->lock);
+    wa = q->overHead;
+    q->overHead = NULL;
+    q->overTail = NULL;
+    q->overflowing = false;
+    pthread_mutex_unlock(&q->lock);
+    if (wa) {
+      q->runHead = wa->next;
+    }
+    return wa;
+  }
+
+  static void Drain(void *arg, int /* err */) {
+    Queue *q = (Queue *) arg;
+    DispatchProfile &dp = DispatchProfile::Instance();
+    ++q->stats.drains;
+    int n = 0;
+    while (n < DrainBudget) {
+      GlobalDispatchWA *wa = Next(q);
+      if (!wa) {
+        break;
+      }
+      GlobalDispatch::setId(wa->dispatchId);
+      dp.Run(q->qid, wa);
+      ++n;
+    }
+    q->stats.executed += n;
+    if (n == DrainBudget) {
+      // more to do, let the rest of the queue run first
+      g_Dispatch.ExecuteAt(q->qid, Drain, q, 0, &q->drainWA);
+      return;
+    }
+    // a reserved slot that is not stored yet gets its own Schedule()
+    q->scheduled = 0;
+    atomic_barrier();
+    if (q->runHead || q->ring.Ready() ||
+        (q->overflowing && q->ring.Empty())) {
+      Schedule(q);
+    }
+  }
+
+  Queue                 queues_[NumQueues];
+};
+
+} // namespace fs
+} // namespace mapr
+
+#endif // RPC_DISPATCHRING_H__
@@ -0,0 +1,360 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+#ifndef RPC_DISPATCHSTATS_H__
+#define RPC_DISPATCHSTATS_H__
+
+#include "common/nonlinuxsupport.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifndef __WINDOWS__
+#include <sys/time.h>
+#endif
+
+#include "common/common.h"
+#include "common/stats.h"
+#include "rpc/dispatch.h"
+
+namespace mapr {
+namespace fs {
+
+// Log-linear histogram, HDR style: values below LinearMax have a bucket
+// each, above that every power of two is split into 1 << SubBits
+// buckets, so a value is off by at most 1/8th. Values past 2^MaxBits
+// land in the last bucket.
+class DispatchHistogram {
+public:
+  static const int      SubBits = 3;
+  static const int      LinearMax = 2 << SubBits;
+  static const int      MaxBits = 40;
+  static const int      Buckets = LinearMax +
+                                  (MaxBits - SubBits) * (1 << SubBits);
+
+  DispatchHistogram() { Reset(); }
+
+  void Reset() {
+    memset((void *) counts_, 0, sizeof(counts_));
+    total_ = 0;
+    max_ = 0;
+  }
+
+  // Record
+  // For the one thread that owns the histogram.
+  inline void Record(uint64_t v) {
+    ++counts_[BucketOf(v)];
+    ++total_;
+    if (v > max_) {
+      max_ = v;
+    }
+  }
+
+  // RecordShared
+  // For a histogram that several threads record into.
+  inline void RecordShared(uint64_t v) {
+    atomic_add64(&counts_[BucketOf(v)], 1);
+    atomic_add64(&total_, 1);
+    uint64_t m = max_;
+    while (v > m && !atomic_cas64(&max_, m, v)) {
+      m = max_;
+    }
+  }
+
+  uint64_t Count() const { return total_; }
+  uint64_t Max() const { return max_; }
+
+  // Percentile
+  // Highest value of the bucket holding the given fraction of the
+  // values, pct in 0.1% units (500 is the median), and never above Max().
+  // Reads while others record, so it is as good as a snapshot gets.
+  uint64_t Percentile(int pct) const {
+    uint64_t total = total_;
+    if (total == 0) {
+      return 0;
+    }
+    uint64_t want = (total * pct + 999) / 1000;
+    uint64_t seen = 0;
+    for (int i = 0; i < Buckets; ++i) {
+      seen += counts_[i];
+      if (seen >= want) {
+        return MIN(BucketHigh(i), max_);
+      }
+    }
+    return max_;
+  }
+
+  static inline int BucketOf(uint64_t v) {
+    if (v < (uint64_t) LinearMax) {
+      return (int) v;
+    }
+    int msb = 0;
+    for (int shift = 32; shift > 0; shift >>= 1) {
+      if (v >> (msb + shift)) {
+        msb += shift;
+      }
+    }
+    if (msb > MaxBits) {
+      return Buckets - 1;
+    }
+    int sub = (int) (v >> (msb - SubBits)) & ((1 << SubBits) - 1);
+    return LinearMax + (msb - SubBits - 1) * (1 << SubBits) + sub;
+  }
+
+  static inline uint64_t BucketHigh(int i) {
+    if (i < LinearMax) {
+      return i;
+    }
+    int msb = (i - LinearMax) / (1 << SubBits) + SubBits + 1;
+    uint64_t sub = (i - LinearMax) % (1 << SubBits);
+    uint64_t low = ((1ULL << SubBits) + sub) << (msb - SubBits);
+    return low + (1ULL << (msb - SubBits)) - 1;
+  }
+
+private:
+  volatile uint64_t     counts_[Buckets];
+  volatile uint64_t     total_;
+  volatile uint64_t     max_;
+};
+
+// Where dispatch queues spend their time, per CpuQid.
+//
+//   wait   enqueue to run, from the WA's dispatchTime, in usecs
+//   run    time in the callback, in usecs
+//   depth  entries queued on the queue when one more was added
+//
+// wait and run are recorded by the queue's own thread, so they cost two
+// clock reads and a few plain increments per callback; depth may be
+// recorded by any thread. The slowest callbacks of each queue are kept
+// with their dispatchId and function, to tell which work saturates a
+// queue and not only that it is saturated.
+//
+// WorkStealDispatch, DispatchRings and DispatchTimers record here, and
+// the dispatch loop in libMapRClient can through RecordRun() and
+// RecordDepth(). The first recorded run starts a timed callback on its
+// queue that copies a summary into Stats::dispatch for the stats shm
+// every PublishMs, and GTraceProgram prints the whole thing for a
+// "print" request on module "dispatch".
+class DispatchProfile {
+public:
+  static const int      NumQueues = GlobalDispatch::CpuQ_Max;
+  static const int      SlowestKept = 8;
+  static const int      PublishMs = 1000;
+
+  struct Slow {
+    uint64_t            runUsecs;
+    uint64_t            waitUsecs;
+    uint64_t            dispatchId;
+    CallbackFunc        *cb;
+  };
+
+  static DispatchProfile &Instance() {
+    static DispatchProfile profile;
+    return profile;
+  }
+
+  // monotonic, what Stamp() puts in dispatchTime
+  static inline uint64_t NowUsecs() {
+#ifndef __WINDOWS__
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000ULL) + ts.tv_nsec / 1000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((uint64_t) tv.tv_sec * 1000000ULL) + tv.tv_usec;
+#endif
+  }
+
+  // Stamp
+  // Marks wa as queued now. Only for WAs whose dispatchTime is not
+  // kept by GlobalDispatch itself.
+  static inline void Stamp(GlobalDispatchWA *wa) {
+    wa->dispatchTime = NowUsecs();
+  }
+
+  // RecordRun
+  // On qid's thread, after a callback tagged dispatchId ran.
+  inline void RecordRun(int qid, uint64_t dispatchId, CallbackFunc *cb,
+                        uint64_t waitUsecs, uint64_t runUsecs) {
+    if (qid <= 0 || qid >= NumQueues) {
+      return;
+    }
+    Queue *q = &queues_[qid];
+    q->wait.Record(waitUsecs);
+    q->run.Record(runUsecs);
+    if (waitUsecs > q->maxWaitUsecs) {
+      q->maxWaitUsecs = waitUsecs;
+      q->maxWaitId = dispatchId;
+    }
+    if (runUsecs > q->slowest[q->fastestSlow].runUsecs) {
+      Keep(q, dispatchId, cb, waitUsecs, runUsecs);
+    }
+    if (!publishing_ && atomic_cas64(&publishing_, 0, 1)) {
+      g_Dispatch.AddTimed(PublishMs, PublishTimed, this, 0, 0, &publishWA_);
+    }
+  }
+
+  // Run
+  // Runs wa's callback on qid's thread and records it, wa having been
+  // stamped when it was queued.
+  inline void Run(int qid, GlobalDispatchWA *wa) {
+    uint64_t start = NowUsecs();
+    uint64_t wait = start > wa->dispatchTime ? start - wa->dispatchTime : 0;
+    uint64_t id = wa->dispatchId;
+    CallbackFunc *cb = wa->cb;
+    // wa may be reused by its callback
+    cb(wa->arg, wa->err);
+    RecordRun(qid, id, cb, wait, NowUsecs() - start);
+  }
+
+  // RecordDepth
+  // From any thread, when an entry was queued on qid.
+  inline void RecordDepth(int qid, uint64_t depth) {
+    if (qid > 0 && qid < NumQueues) {
+      queues_[qid].depth.RecordShared(depth);
+    }
+  }
+
+  // Publish
+  // Fills the stats shm summary.
+  void Publish(DispatchStats *out) const {
+    memset(out, 0, sizeof(*out));
+    for (int i = 1; i < NumQueues && i < DispatchStats::numQueues; ++i) {
+      const Queue *q = &queues_[i];
+      DispatchQueueStats *s = &out->queues[i];
+      s->runs = q->run.Count();
+      s->waitP50Usecs = q->wait.Percentile(500);
+      s->waitP99Usecs = q->wait.Percentile(990);
+      s->waitMaxUsecs = q->wait.Max();
+      s->runP99Usecs = q->run.Percentile(990);
+      s->runMaxUsecs = q->run.Max();
+      s->depthP99 = q->depth.Percentile(990);
+      s->depthMax = q->depth.Max();
+    }
+  }
+
+  // Print
+  // One block per queue that ran anything, into buf; returns the length.
+  int Print(char *buf, int size) const {
+    if (size <= 0) {
+      return 0;
+    }
+    buf[0] = '\0';
+    int len = 0;
+    for (int i = 1; i < NumQueues && len < size; ++i) {
+      const Queue *q = &queues_[i];
+      if (q->run.Count() == 0 && q->depth.Count() == 0) {
+        continue;
+      }
+      len += snprintf(buf + len, size - len,
+        "q%d %s runs %llu\n"
+        "  wait usecs p50 %llu p90 %llu p99 %llu p999 %llu max %llu "
+        "(id %llu)\n"
+        "  run usecs p50 %llu p90 %llu p99 %llu p999 %llu max %llu\n"
+        "  depth p50 %llu p90 %llu p99 %llu max %llu\n",
+        i, QueueName(i), (unsigned long long) q->run.Count(),
+        (unsigned long long) q->wait.Percentile(500),
+        (unsigned long long) q->wait.Percentile(900),
+        (unsigned long long) q->wait.Percentile(990),
+        (unsigned long long) q->wait.Percentile(999),
+        (unsigned long long) q->wait.Max(),
+        (unsigned long long) q->maxWaitId,
+        (unsigned long long) q->run.Percentile(500),
+        (unsigned long long) q->run.Percentile(900),
+        (unsigned long long) q->run.Percentile(990),
+        (unsigned long long) q->run.Percentile(999),
+        (unsigned long long) q->run.Max(),
+        (unsigned long long) q->depth.Percentile(500),
+        (unsigned long long) q->depth.Percentile(900),
+        (unsigned long long) q->depth.Percentile(990),
+        (unsigned long long) q->depth.Max());
+      for (int k = 0; k < SlowestKept && len < size; ++k) {
+        const Slow *s = &q->slowest[k];
+        if (s->runUsecs == 0) {
+          continue;
+        }
+        len += snprintf(buf + len, size - len,
+          "  slow run %llu wait %llu id %llu cb %p\n",
+          (unsigned long long) s->runUsecs,
+          (unsigned long long) s->waitUsecs,
+          (unsigned long long) s->dispatchId, (void *) s->cb);
+      }
+    }
+    return MIN(len, size - 1);
+  }
+
+  // Reset
+  // Racy against recording threads, a few samples may survive it.
+  void Reset() {
+    for (int i = 0; i < NumQueues; ++i) {
+      Queue *q = &queues_[i];
+      q->wait.Reset();
+      q->run.Reset();
+      q->depth.Reset();
+      q->maxWaitUsecs = 0;
+      q->maxWaitId = 0;
+      memset(q->slowest, 0, sizeof(q->slowest));
+      q->fastestSlow = 0;
+    }
+  }
+
+  static const char *QueueName(int qid) {
+    static const char *names[NumQueues] = {
+      "none", "Rpc", "IOMgr1", "FS", "IOMgr", "DBMain",
+      "DBHelper1", "DBHelper2", "DBHelper3",
+      "DBFlush1", "DBFlush2", "DBFlush3", "DBFlush4", "DBFlush5", "DBFlush6",
+      "Compress1", "Compress2", "Compress3"
+    };
+    return (qid >= 0 && qid < NumQueues) ? names[qid] : "?";
+  }
+
+private:
+  struct Queue {
+    DispatchHistogram   wait;
+    DispatchHistogram   run;
+    DispatchHistogram   depth;
+    uint64_t            maxWaitUsecs;
+    uint64_t            maxWaitId;
+    Slow                slowest[SlowestKept];
+    int                 fastestSlow;  // the entry the next slow one replaces
+  };
+
+  DispatchProfile() : publishing_(0) {
+    memset(&publishWA_, 0, sizeof(publishWA_));
+    Reset();
+  }
+
+  // on the queue that recorded the first run, every PublishMs
+  static void PublishTimed(void *arg, int /* err */) {
+    DispatchProfile *p = (DispatchProfile *) arg;
+    if (serverStats) {
+      p->Publish(&ServerStats().dispatch);
+    }
+    g_Dispatch.AddTimed(PublishMs, PublishTimed, p, 0, 0, &p->publishWA_);
+  }
+
+  static void Keep(Queue *q, uint64_t dispatchId, CallbackFunc *cb,
+                   uint64_t waitUsecs, uint64_t runUsecs) {
+    Slow *s = &q->slowest[q->fastestSlow];
+    s->runUsecs = runUsecs;
+    s->waitUsecs = waitUsecs;
+    s->dispatchId = dispatchId;
+    s->cb = cb;
+    int f = 0;
+    for (int k = 1; k < SlowestKept; ++k) {
+      if (q->slowest[k].runUsecs < q->slowest[f].runUsecs) {
+        f = k;
+      }
+    }
+    q->fastestSlow = f;
+  }
+
+  Queue                 queues_[NumQueues];
+  volatile uint64_t     publishing_;  // PublishTimed() is queued
+  GlobalDispatchWA      publishWA_;
+};
+
+} // namespace fs
+} // namespace mapr
+
+#endif // RPC_DISPATCHSTATS_H__
@@ -0,0 +1,420 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+#ifndef RPC_TIMERWHEEL_H__
+#define RPC_TIMERWHEEL_H__
+
+#include "common/nonlinuxsupport.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#include "common/common.h"
+#include "rpc/dispatch.h"
+#include "rpc/dispatchstats.h"
+
+namespace mapr {
+namespace fs {
+
+struct TimerLink {
+  TimerLink             *next;
+  TimerLink             *prev;
+};
+
+// A timer for DispatchTimers, embedded by the caller like a
+// GlobalDispatchWA. link must stay first.
+struct DispatchTimer {
+  enum State {
+    Idle = 0,
+    Pending,                // on its queue's inbox
+    Armed,                  // in its queue's wheel
+    Cancelled,              // cancelled, still linked until its deadline
+  };
+
+  TimerLink             link;
+  uint64_t              expires;      // wheel ticks
+  CallbackFunc          *cb;
+  void                  *arg;
+  int                   err;
+  int                   qid;
+  uint64_t              dispatchId;
+  volatile uint64_t     state;
+  GlobalDispatchWA      globWA;       // threads that are not a CpuQ
+};
+
+// Hierarchical timing wheel, used by one thread.
+//
+// Levels of 256 slots each, a slot being a circular list of timers.
+// Level 0 has one slot per tick, level 1 one per 256 ticks and so on;
+// a timer goes in the coarsest level that still tells its slot apart
+// and moves down a level each time the level below wraps around.
+// Insert and Remove are O(1) and Advance is O(1) per tick plus the
+// timers that expire or move down.
+class TimerWheel {
+public:
+  static const int      LevelBits = 8;
+  static const int      Levels = 4;
+  static const int      NumSlots = 1 << LevelBits;
+  static const uint64_t SlotMask = NumSlots - 1;
+
+  // called by Advance() for each timer that has expired, already removed
+  typedef void ExpireFunc(void *arg, DispatchTimer *t);
+
+  TimerWheel() : now_(0), count_(0) {
+    for (int l = 0; l < Levels; ++l) {
+      for (int i = 0; i < NumSlots; ++i) {
+        Init(&slots_[l][i]);
+      }
+    }
+  }
+
+  void Start(uint64_t now) { now_ = now; }
+
+  // Insert
+  // t->expires is in ticks; a deadline already past fires next tick.
+  void Insert(DispatchTimer *t) {
+    if (t->expires <= now_) {
+      t->expires = now_ + 1;
+    }
+    Place(t);
+  }
+
+  void Remove(DispatchTimer *t) {
+    Unlink(&t->link);
+    --count_;
+  }
+
+  // Advance
+  // Moves the wheel on to tick now, calling fn for every timer whose
+  // deadline has come. fn may insert and remove timers.
+  void Advance(uint64_t now, ExpireFunc *fn, void *arg) {
+    if (count_ == 0) {
+      now_ = MAX(now_, now);
+      return;
+    }
+    while (now_ < now) {
+      ++now_;
+      // refill the levels below from the next slot up when they wrap
+      for (int l = 1; l < Levels; ++l) {
+        if ((now_ & ((1ULL << (l * LevelBits)) - 1)) != 0) {
+          break;
+        }
+        Cascade(l, (now_ >> (l * LevelBits)) & SlotMask);
+      }
+
+      TimerLink due;
+      Init(&due);
+      TimerLink *slot = &slots_[0][now_ & SlotMask];
+      if (slot->next != slot) {
+        Splice(slot, &due);
+      }
+      while (due.next != &due) {
+        DispatchTimer *t = (DispatchTimer *) due.next;
+        Remove(t);
+        fn(arg, t);
+      }
+      if (count_ == 0) {
+        now_ = MAX(now_, now);
+      }
+    }
+  }
+
+  inline uint64_t Now() const { return now_; }
+  inline uint64_t Count() const { return count_; }
+
+private:
+  // links t by its deadline, which is not before now_; one due now goes
+  // in the level 0 slot Advance() is about to run
+  void Place(DispatchTimer *t) {
+    uint64_t delta = t->expires - now_;
+    int level = 0;
+    while (level < Levels - 1 &&
+           delta >= (1ULL << ((level + 1) * LevelBits))) {
+      ++level;
+    }
+    uint64_t when = t->expires;
+    uint64_t span = 1ULL << (Levels * LevelBits);
+    if (delta >= span) {
+      // beyond the top level, parked in its last slot and moved down
+      // again as it comes round
+      when = now_ + span - 1;
+    }
+    Link(&slots_[level][(when >> (level * LevelBits)) & SlotMask], &t->link);
+    ++count_;
+  }
+
+  static inline void Init(TimerLink *l) {
+    l->next = l->prev = l;
+  }
+
+  static inline void Link(TimerLink *head, TimerLink *l) {
+    l->prev = head->prev;
+    l->next = head;
+    head->prev->next = l;
+    head->prev = l;
+  }
+
+  static inline void Unlink(TimerLink *l) {
+    l->prev->next = l->next;
+    l->next->prev = l->prev;
+    l->next = l->prev = l;
+  }
+
+  // moves all of from onto the empty list to
+  static inline void Splice(TimerLink *from, TimerLink *to) {
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    Init(from);
+  }
+
+  void Cascade(int level, uint64_t index) {
+    TimerLink moving;
+    Init(&moving);
+    TimerLink *slot = &slots_[level][index];
+    if (slot->next == slot) {
+      return;
+    }
+    Splice(slot, &moving);
+    while (moving.next != &moving) {
+      DispatchTimer *t = (DispatchTimer *) moving.next;
+      Remove(t);
+      Place(t);
+    }
+  }
+
+  uint64_t              now_;
+  uint64_t              count_;
+  TimerLink             slots_[Levels][NumSlots];
+};
+
+// Timers on per CpuQ wheels, for large numbers of timeouts.
+//
+// GlobalDispatch::AddTimed() keeps timers on lists it scans for the next
+// deadline. Here each queue has its own TimerWheel that only the queue's
+// thread touches, and only one AddTimed() tick per queue is outstanding
+// while its wheel has timers, so the dispatcher's scan stays short no
+// matter how many timers there are. The tick fires every TickMs and
+// runs what has expired on the queue's own thread.
+//
+// A timer added from its own queue goes straight into the wheel. One
+// added for another queue is pushed on that queue's inbox with a CAS
+// and the queue is poked through ExecuteAt(), so there is no lock
+// between queues. Cancel() on the owning queue unlinks the timer at
+// once. From another thread it only marks it, and the timer stays in
+// use until its deadline has passed.
+class DispatchTimers {
+public:
+  static const int      NumQueues = GlobalDispatch::CpuQ_Max;
+  static const int      TickMs = 5;
+
+  struct QueueStats {
+    uint64_t            added;
+    uint64_t            fired;
+    uint64_t            cancelled;
+    uint64_t            timers;       // in the wheel right now
+    uint64_t            ticks;
+  };
+
+  static DispatchTimers &Instance() {
+    static DispatchTimers timers;
+    return timers;
+  }
+
+  DispatchTimers() {
+    startMs_ = GlobalDispatch::CurrentTimeMillis();
+    for (int i = 0; i < NumQueues; ++i) {
+      Queue *q = &queues_[i];
+      q->qid = i;
+      q->inbox = NULL;
+      q->ticking = false;
+      q->now = 0;
+      q->poked = 0;
+      memset(&q->stats, 0, sizeof(q->stats));
+    }
+  }
+
+  // AddTimed
+  // Runs func on the calling thread's queue after afterMilliSecs, to
+  // within TickMs. t must be Idle, i.e. new, fired or cancelled on its
+  // own queue.
+  void AddTimed(uint64_t afterMilliSecs, CallbackFunc *func, void *arg,
+                int err, uint64_t dispatchId, DispatchTimer *t) {
+    AddTimedAt(GlobalDispatch::GetMyQid(), afterMilliSecs, func, arg, err,
+               dispatchId, t);
+  }
+
+  // AddTimedAt
+  // Same, on queue qid.
+  void AddTimedAt(int qid, uint64_t afterMilliSecs, CallbackFunc *func,
+                  void *arg, int err, uint64_t dispatchId,
+                  DispatchTimer *t) {
+    t->cb = func;
+    t->arg = arg;
+    t->err = err;
+    t->dispatchId = dispatchId;
+    t->qid = qid;
+    t->expires = Ticks(GlobalDispatch::CurrentTimeMillis() + afterMilliSecs +
+                       TickMs - 1);
+    if (qid <= 0 || qid >= NumQueues) {
+      // no wheel to put it on
+      t->state = DispatchTimer::Armed;
+      g_Dispatch.AddTimed(afterMilliSecs, FireUnqueued, t, err, dispatchId,
+                          &t->globWA);
+      return;
+    }
+
+    Queue *q = &queues_[qid];
+    atomic_add64(&q->stats.added, 1);
+    if (qid == GlobalDispatch::GetMyQid()) {
+      t->state = DispatchTimer::Armed;
+      Arm(q, t);
+      return;
+    }
+    t->state = DispatchTimer::Pending;
+    TimerLink *head;
+    do {
+      head = q->inbox;
+      t->link.next = head;
+    } while (!atomic_casptr(&q->inbox, head, &t->link));
+    if (!q->poked && atomic_cas64(&q->poked, 0, 1)) {
+      g_Dispatch.ExecuteAt(qid, Poke, q, 0, &q->pokeWA);
+    }
+  }
+
+  // Cancel
+  // true if func will not run. A timer cancelled from another thread
+  // than its queue's is only marked, and must not be reused or freed
+  // before its deadline has passed.
+  bool Cancel(DispatchTimer *t) {
+    uint64_t s = t->state;
+    if ((s != DispatchTimer::Armed && s != DispatchTimer::Pending) ||
+        !atomic_cas64(&t->state, s, (uint64_t) DispatchTimer::Cancelled)) {
+      return false;
+    }
+    if (t->qid > 0 && t->qid < NumQueues) {
+      Queue *q = &queues_[t->qid];
+      atomic_add64(&q->stats.cancelled, 1);
+      if (s == DispatchTimer::Armed &&
+          t->qid == GlobalDispatch::GetMyQid()) {
+        q->wheel.Remove(t);
+        t->state = DispatchTimer::Idle;
+      }
+    }
+    return true;
+  }
+
+  void GetStats(int qid, QueueStats *out) const {
+    debug_assert(qid >= 0 && qid < NumQueues);
+    *out = queues_[qid].stats;
+    out->timers = queues_[qid].wheel.Count();
+  }
+
+private:
+  struct Queue {
+    int                 qid;
+    TimerWheel          wheel;        // queue's thread only
+    TimerLink * volatile inbox;       // from other queues, via link.next
+    bool                ticking;      // a Tick() is queued
+    uint64_t            now;          // wheel ticks, while Advance() runs
+    volatile uint64_t   poked;        // a Poke() is queued
+    GlobalDispatchWA    tickWA;
+    GlobalDispatchWA    pokeWA;
+    QueueStats          stats;
+  };
+
+  inline uint64_t Ticks(uint64_t ms) const {
+    return ms > startMs_ ? (ms - startMs_) / TickMs : 0;
+  }
+
+  // on q's thread: into the wheel, and keep the tick going
+  void Arm(Queue *q, DispatchTimer *t) {
+    if (q->wheel.Count() == 0) {
+      q->wheel.Start(Ticks(GlobalDispatch::CurrentTimeMillis()));
+    }
+    q->wheel.Insert(t);
+    if (!q->ticking) {
+      q->ticking = true;
+      g_Dispatch.AddTimed(TickMs, Tick, q, 0, 0, &q->tickWA);
+    }
+  }
+
+  // on q's thread: timers other queues added
+  void TakeInbox(Queue *q) {
+    TimerLink *l = (TimerLink *) atomic_xchgptr(&q->inbox,
+                                                (TimerLink *) NULL);
+    while (l) {
+      DispatchTimer *t = (DispatchTimer *) l;
+      l = l->next;
+      if (atomic_cas64(&t->state, (uint64_t) DispatchTimer::Pending,
+                       (uint64_t) DispatchTimer::Armed)) {
+        Arm(q, t);
+      } else {
+        t->state = DispatchTimer::Idle;  // cancelled before it got here
+      }
+    }
+  }
+
+  static void Expire(void *arg, DispatchTimer *t) {
+    Queue *q = (Queue *) arg;
+    if (!atomic_cas64(&t->state, (uint64_t) DispatchTimer::Armed,
+                      (uint64_t) DispatchTimer::Idle)) {
+      t->state = DispatchTimer::Idle;  // cancelled from another queue
+      return;
+    }
+    ++q->stats.fired;
+    GlobalDispatch::setId(t->dispatchId);
+    // a timer waits from its deadline, not from when it was added
+    uint64_t late = q->now > t->expires ? (q->now - t->expires) * TickMs : 0;
+    uint64_t id = t->dispatchId;
+    CallbackFunc *cb = t->cb;
+    uint64_t start = DispatchProfile::NowUsecs();
+    // t may be reused by its callback
+    cb(t->arg, t->err);
+    DispatchProfile::Instance().RecordRun(q->qid, id, cb, late * 1000,
+                                          DispatchProfile::NowUsecs() - start);
+  }
+
+  static void Tick(void *arg, int /* err */) {
+    Queue *q = (Queue *) arg;
+    DispatchTimers &dt = Instance();
+    if (GlobalDispatch::GetMyQid() != q->qid) {
+      g_Dispatch.ExecuteAt(q->qid, Tick, q, 0, &q->tickWA);
+      return;
+    }
+    ++q->stats.ticks;
+    q->ticking = false;
+    dt.TakeInbox(q);
+    q->now = dt.Ticks(GlobalDispatch::CurrentTimeMillis());
+    q->wheel.Advance(q->now, Expire, q);
+    if (q->wheel.Count() > 0 && !q->ticking) {
+      q->ticking = true;
+      g_Dispatch.AddTimed(TickMs, Tick, q, 0, 0, &q->tickWA);
+    }
+  }
+
+  static void Poke(void *arg, int /* err */) {
+    Queue *q = (Queue *) arg;
+    q->poked = 0;
+    atomic_barrier();
+    Instance().TakeInbox(q);
+  }
+
+  static void FireUnqueued(void *arg, int /* err */) {
+    DispatchTimer *t = (DispatchTimer *) arg;
+    if (atomic_cas64(&t->state, (uint64_t) DispatchTimer::Armed,
+                     (uint64_t) DispatchTimer::Idle)) {
+      t->cb(t->arg, t->err);
+    } else {
+      t->state = DispatchTimer::Idle;
+    }
+  }
+
+  uint64_t              startMs_;
+  Queue                 queues_[NumQueues];
+};
+
+} // namespace fs
+} // namespace mapr
+
+#endif // RPC_TIMERWHEEL_H__
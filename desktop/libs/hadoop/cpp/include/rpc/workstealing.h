@@ -0,0 +1,404 @@
+/* Copyright (c) 2009 & onwards. MapR Tech, Inc., All rights reserved */
+
+#ifndef RPC_WORKSTEALING_H__
+#define RPC_WORKSTEALING_H__
+
+#include "common/nonlinuxsupport.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/common.h"
+#include "rpc/dispatch.h"
+#include "rpc/dispatchstats.h"
+
+namespace mapr {
+namespace fs {
+
+// Work stealing deque of dispatch WAs, after Chase-Lev.
+//
+// The owner pushes at the bottom without atomics. The owner and the
+// thieves all take from the top with a CAS, so WAs run in the order
+// they were pushed wherever they run, and a steady flow of new ones
+// cannot starve the old. The array grows when it is full. Old arrays
+// are kept until the deque is destroyed, since a thief may still be
+// reading one.
+class WorkStealDeque {
+public:
+  static const int64_t  InitialSize = 256;   // power of two
+
+  WorkStealDeque() : top_(0), bottom_(0), retired_(NULL) {
+    array_ = NewArray(InitialSize);
+  }
+
+  ~WorkStealDeque() {
+    while (retired_) {
+      Array *a = retired_;
+      retired_ = a->prev;
+      free(a);
+    }
+    free(array_);
+  }
+
+  // Push
+  // Owner only. false when out of memory, the WA is not queued then.
+  bool Push(GlobalDispatchWA *wa) {
+    int64_t b = bottom_;
+    int64_t t = atomic_load_acquire64((volatile uint64_t *) &top_);
+    Array *a = array_;
+    if (b - t > a->mask) {
+      a = Grow(a, t, b);
+      if (!a) {
+        return false;
+      }
+    }
+    a->slots[b & a->mask] = wa;
+    atomic_store_release64((volatile uint64_t *) &bottom_, b + 1);
+    return true;
+  }
+
+  // Take
+  // Owner only, oldest first. NULL when empty. Only loses a race to a
+  // thief that took the same WA, and then tries the next one.
+  GlobalDispatchWA *Take() {
+    for (;;) {
+      int64_t t = atomic_load_acquire64((volatile uint64_t *) &top_);
+      if (t >= bottom_) {
+        return NULL;
+      }
+      Array *a = array_;
+      GlobalDispatchWA *wa = a->slots[t & a->mask];
+      if (atomic_cas64((volatile uint64_t *) &top_, t, t + 1)) {
+        return wa;
+      }
+    }
+  }
+
+  // Steal
+  // Any thread, oldest first. NULL when empty or when another thread
+  // won the race for the same WA.
+  GlobalDispatchWA *Steal() {
+    int64_t t = atomic_load_acquire64((volatile uint64_t *) &top_);
+    atomic_barrier();
+    int64_t b = atomic_load_acquire64((volatile uint64_t *) &bottom_);
+    if (t >= b) {
+      return NULL;
+    }
+    Array *a = array_;
+    GlobalDispatchWA *wa = a->slots[t & a->mask];
+    if (!atomic_cas64((volatile uint64_t *) &top_, t, t + 1)) {
+      return NULL;
+    }
+    return wa;
+  }
+
+  inline int64_t Size() const {
+    int64_t n = bottom_ - top_;
+    return n > 0 ? n : 0;
+  }
+
+private:
+  struct Array {
+    int64_t             mask;
+    Array               *prev;      // retired arrays
+    GlobalDispatchWA    *slots[1];
+  };
+
+  static Array *NewArray(int64_t size) {
+    Array *a = (Array *) malloc(sizeof(Array) +
+                                (size - 1) * sizeof(GlobalDispatchWA *));
+    if (a) {
+      a->mask = size - 1;
+      a->prev = NULL;
+    }
+    return a;
+  }
+
+  Array *Grow(Array *a, int64_t t, int64_t b) {
+    Array *n = NewArray((a->mask + 1) * 2);
+    if (!n) {
+      return NULL;
+    }
+    for (int64_t i = t; i < b; ++i) {
+      n->slots[i & n->mask] = a->slots[i & a->mask];
+    }
+    a->prev = retired_;
+    retired_ = a;
+    atomic_barrier();
+    array_ = n;
+    return n;
+  }
+
+  volatile int64_t      top_;
+  char                  pad_[64];   // thieves write top_, the owner bottom_
+  volatile int64_t      bottom_;
+  Array * volatile      array_;
+  Array                 *retired_;
+};
+
+// Work stealing for groups of interchangeable CpuQs.
+//
+// Opt-in per group and per call: a group is a range of queues whose
+// callbacks may run on any queue of the range, e.g. the DBFlush or the
+// Compress queues, enabled with EnableGroup(). Callers that can run
+// anywhere in the group use ExecuteAt() here instead of on g_Dispatch;
+// everything queued with g_Dispatch directly keeps strict affinity.
+//
+// Submitting pushes the WA on the target queue's inbox with a CAS and
+// makes sure a Drain() callback is queued on the target through the
+// regular dispatcher. Drain() runs on the queue's own thread: it moves
+// the inbox to the queue's deque and runs what is there. When its deque
+// is empty it steals the oldest WAs of its siblings, or takes over a
+// sibling's whole inbox when that sibling is busy in a long callback.
+// A queue that falls more than StealThreshold behind has an idle
+// sibling kicked, so that sibling comes and helps. Drain() runs at most
+// DrainBudget callbacks before it requeues itself, so strict affinity
+// work on the same queue is not starved.
+class WorkStealDispatch {
+public:
+  static const int      NumQueues = GlobalDispatch::CpuQ_Max;
+  static const int      DrainBudget = 64;
+  static const int64_t  StealThreshold = 8;
+
+  struct QueueStats {
+    uint64_t            submitted;  // ExecuteAt() aimed at this queue
+    uint64_t            executed;   // callbacks run on this queue
+    uint64_t            stolen;     // of those, taken from a sibling
+    uint64_t            kicks;      // times woken to help a sibling
+  };
+
+  static WorkStealDispatch &Instance() {
+    static WorkStealDispatch ws;
+    return ws;
+  }
+
+  WorkStealDispatch() {
+    memset(queues_, 0, sizeof(queues_));
+    for (int i = 0; i < NumQueues; ++i) {
+      queues_[i].qid = i;
+      queues_[i].deque = NULL;
+    }
+  }
+
+  // EnableGroup
+  // Lets the queues first..last steal from each other. Every queue in
+  // the range must have a dispatch thread. Call at startup, before
+  // anything is submitted to the range.
+  int EnableGroup(int first, int last) {
+    if (first <= 0 || last >= NumQueues || first >= last) {
+      return EINVAL;
+    }
+    for (int i = first; i <= last; ++i) {
+      if (queues_[i].deque) {
+        return EEXIST;
+      }
+    }
+    for (int i = first; i <= last; ++i) {
+      Queue *q = &queues_[i];
+      q->deque = new WorkStealDeque();
+      q->first = first;
+      q->last = last;
+      atomic_barrier();
+      q->grouped = true;
+    }
+    return 0;
+  }
+
+  // EnableDefaultGroups
+  // The DBFlush queues and the first numCompress Compress queues.
+  int EnableDefaultGroups(int numCompress) {
+    int err = EnableGroup(GlobalDispatch::CpuQ_DBFlush1,
+                          GlobalDispatch::CpuQ_DBFlushMax);
+    int last = MIN(GlobalDispatch::CpuQ_Compress1 + numCompress - 1,
+                   (int) GlobalDispatch::CpuQ_CompressMax);
+    if (!err && last > GlobalDispatch::CpuQ_Compress1) {
+      err = EnableGroup(GlobalDispatch::CpuQ_Compress1, last);
+    }
+    return err;
+  }
+
+  inline bool Grouped(int qid) const {
+    return qid > 0 && qid < NumQueues && queues_[qid].grouped;
+  }
+
+  // ExecuteAt
+  // Like GlobalDispatch::ExecuteAt(), but any queue of atQid's group
+  // may run func. Plain ExecuteAt() when atQid is in no group.
+  int ExecuteAt(int atQid, CallbackFunc *func, void *arg, int err,
+                uint64_t dispatchId, GlobalDispatchWA *wa) {
+    if (!Grouped(atQid)) {
+      return g_Dispatch.ExecuteAt(atQid, func, arg, err, dispatchId, wa);
+    }
+    Queue *q = &queues_[atQid];
+    wa->cb = func;
+    wa->arg = arg;
+    wa->err = err;
+    wa->dispatchId = dispatchId;
+    DispatchProfile::Stamp(wa);
+    GlobalDispatchWA *head;
+    do {
+      head = q->inbox;
+      wa->next = head;
+    } while (!atomic_casptr(&q->inbox, head, wa));
+    uint64_t depth = atomic_add64(&q->pending, 1);
+    atomic_add64(&q->stats.submitted, 1);
+    DispatchProfile::Instance().RecordDepth(atQid, depth);
+
+    Schedule(q);
+    if ((int64_t) q->pending > StealThreshold) {
+      KickSibling(q);
+    }
+    return 0;
+  }
+
+  int ExecuteAt(int atQid, CallbackFunc *func, void *arg, int err,
+                GlobalDispatchWA *wa) {
+    return ExecuteAt(atQid, func, arg, err, GlobalDispatch::id(), wa);
+  }
+
+  void GetStats(int qid, QueueStats *out) const {
+    debug_assert(qid >= 0 && qid < NumQueues);
+    *out = queues_[qid].stats;
+  }
+
+private:
+  struct Queue {
+    int                 qid;
+    int                 first;      // group range
+    int                 last;
+    volatile bool       grouped;
+    WorkStealDeque      *deque;     // pushed and taken by qid's thread
+    GlobalDispatchWA * volatile inbox;
+    volatile uint64_t   pending;    // submitted, not yet taken
+    volatile uint64_t   scheduled;  // a Drain() is queued or running
+    GlobalDispatchWA    drainWA;    // for that Drain()
+    uint32_t            nextVictim;
+    QueueStats          stats;
+    char                pad[64];
+  };
+
+  // queues a Drain() on q unless one is already queued or running
+  void Schedule(Queue *q) {
+    if (!q->scheduled && atomic_cas64(&q->scheduled, 0, 1)) {
+      g_Dispatch.ExecuteAt(q->qid, Drain, q, 0, &q->drainWA);
+    }
+  }
+
+  void KickSibling(Queue *q) {
+    int n = q->last - q->first + 1;
+    for (int i = 1; i < n; ++i) {
+      Queue *s = &queues_[q->first + (q->qid - q->first + i) % n];
+      if (!s->scheduled && atomic_cas64(&s->scheduled, 0, 1)) {
+        atomic_add64(&s->stats.kicks, 1);
+        g_Dispatch.ExecuteAt(s->qid, Drain, s, 0, &s->drainWA);
+        return;
+      }
+    }
+  }
+
+  // moves a whole inbox list, newest first, to q's deque in the order
+  // it was submitted
+  static void Adopt(Queue *q, GlobalDispatchWA *list) {
+    GlobalDispatchWA *oldest = NULL;
+    while (list) {
+      GlobalDispatchWA *wa = list;
+      list = wa->next;
+      wa->next = oldest;
+      oldest = wa;
+    }
+    list = oldest;
+    while (list) {
+      GlobalDispatchWA *wa = list;
+      list = wa->next;
+      if (!q->deque->Push(wa)) {
+        // out of memory, run it here rather than lose it
+        wa->cb(wa->arg, wa->err);
+      }
+    }
+  }
+
+  // next WA for q's thread: its own, else a sibling's
+  GlobalDispatchWA *Next(Queue *q, Queue **from) {
+    *from = q;
+    if (q->inbox) {
+      Adopt(q, (GlobalDispatchWA *) atomic_xchgptr(&q->inbox,
+                                                    (GlobalDispatchWA *) NULL));
+    }
+    GlobalDispatchWA *wa = q->deque->Take();
+    if (wa) {
+      return wa;
+    }
+    int n = q->last - q->first + 1;
+    for (int i = 0; i < n; ++i) {
+      Queue *s = &queues_[q->first + (q->nextVictim++ % n)];
+      if (s == q) {
+        continue;
+      }
+      *from = s;
+      wa = s->deque->Steal();
+      if (wa) {
+        return wa;
+      }
+      if (s->inbox) {
+        GlobalDispatchWA *list = (GlobalDispatchWA *)
+          atomic_xchgptr(&s->inbox, (GlobalDispatchWA *) NULL);
+        if (list) {
+          // all of them count as stolen, they now run from q's deque
+          uint64_t moved = 0;
+          for (GlobalDispatchWA *w = list; w; w = w->next) {
+            ++moved;
+          }
+          atomic_sub64(&s->pending, moved);
+          atomic_add64(&q->pending, moved);
+          atomic_add64(&q->stats.stolen, moved);
+          Adopt(q, list);
+          *from = q;
+          wa = q->deque->Take();
+          if (wa) {
+            return wa;
+          }
+        }
+      }
+    }
+    return NULL;
+  }
+
+  static void Drain(void *arg, int /* err */) {
+    Queue *q = (Queue *) arg;
+    WorkStealDispatch &ws = Instance();
+    int n = 0;
+    while (n < DrainBudget) {
+      Queue *from;
+      GlobalDispatchWA *wa = ws.Next(q, &from);
+      if (!wa) {
+        break;
+      }
+      atomic_sub64(&from->pending, 1);
+      if (from != q) {
+        atomic_add64(&q->stats.stolen, 1);
+      }
+      ++q->stats.executed;
+      GlobalDispatch::setId(wa->dispatchId);
+      DispatchProfile::Instance().Run(q->qid, wa);
+      ++n;
+    }
+    if (n == DrainBudget) {
+      // more to do, let the rest of the queue run first
+      g_Dispatch.ExecuteAt(q->qid, Drain, q, 0, &q->drainWA);
+      return;
+    }
+    q->scheduled = 0;
+    atomic_barrier();
+    if (q->inbox || q->deque->Size() > 0) {
+      ws.Schedule(q);
+    }
+  }
+
+  Queue                 queues_[NumQueues];
+};
+
+} // namespace fs
+} // namespace mapr
+
+#endif // RPC_WORKSTEALING_H__
@@ -2,6 +2,12 @@
 #include <common/credentials.h>
 #include "proto/security.pb.h"
 #include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <string>
+#include <vector>
 
 static PyObject*
 fib(PyObject* self, PyObject* args)
@@ -26,26 +32,163 @@ add(PyObject* self, PyObject* args)
 }
 
 
+/*
+ * Process wide cache of serialized TicketAndKey protobufs, keyed by
+ * (clusterName, keyType). An entry is only handed out while the ticket
+ * has not expired and the user's ticket file has not been rewritten
+ * (e.g. by maprlogin) since it was cached. All access is done with the
+ * GIL held, which serializes it.
+ */
+struct TicketCacheEntry {
+    char *clusterName;
+    int keyType;
+    PyObject *serialized;       // PyString holding the TicketAndKey bytes
+    mapr::fs::TicketAndKey ticketAndKey;
+    uint64_t expiryTime;        // seconds since epoch
+    time_t ticketFileMtime;
+    TicketCacheEntry *next;
+};
+
+static TicketCacheEntry *ticketCache = NULL;
+static unsigned long long ticketCacheHits = 0;
+static unsigned long long ticketCacheMisses = 0;
+
+static time_t
+GetTicketFileMtime(mapr::fs::Security *security)
+{
+    char path[mapr::fs::PathNameMaxLen + 1];
+    struct stat st;
+
+    if (security->GetUserTicketAndKeyFileLocation((uint8_t *) path, sizeof(path)))
+        return 0;
+    if (stat(path, &st))
+        return 0;
+    return st.st_mtime;
+}
+
+static TicketCacheEntry *
+LookupTicketCache(const char *clusterName, int keyType)
+{
+    for (TicketCacheEntry *e = ticketCache; e; e = e->next) {
+        if (e->keyType == keyType && !strcmp(e->clusterName, clusterName))
+            return e;
+    }
+    return NULL;
+}
+
+static bool
+IsTicketCacheEntryValid(TicketCacheEntry *e, time_t ticketFileMtime)
+{
+    return e->serialized &&
+           e->ticketFileMtime == ticketFileMtime &&
+           (uint64_t) time(NULL) < e->expiryTime;
+}
+
+/*
+ * Returns the valid cache entry for (clusterName, keyType), asking
+ * Security::GetTicketAndKeyForCluster for the ticket on a miss.
+ * Returns NULL with *err set if no ticket could be obtained, in which
+ * case ticketAndKey holds whatever the lookup produced. Returns NULL
+ * with *err clear and a Python exception set on allocation failure.
+ */
+static TicketCacheEntry *
+FetchTicketCacheEntry(const char *clusterName, int keyType,
+                      mapr::fs::TicketAndKey *ticketAndKey, int *err)
+{
+    *err = 0;
+
+    mapr::fs::Security *security = mapr::fs::Security::GetSecurityInstance();
+    time_t ticketFileMtime = GetTicketFileMtime(security);
+
+    TicketCacheEntry *e = LookupTicketCache(clusterName, keyType);
+    if (e && IsTicketCacheEntryValid(e, ticketFileMtime)) {
+        ++ticketCacheHits;
+        return e;
+    }
+    ++ticketCacheMisses;
+
+    *err = security->GetTicketAndKeyForCluster((mapr::fs::ServerKeyType) keyType, clusterName, ticketAndKey);
+
+    // Failed lookups are not cached, so that a ticket obtained later on
+    // is picked up by the next call.
+    if (*err)
+        return NULL;
+
+    int bufSize = ticketAndKey->ByteSize();
+    PyObject *serialized = PyString_FromStringAndSize(NULL, bufSize);
+    if (!serialized)
+        return NULL;
+    ticketAndKey->SerializeToArray(PyString_AS_STRING(serialized), bufSize);
+
+    if (!e) {
+        e = new TicketCacheEntry();
+        e->clusterName = strdup(clusterName);
+        e->keyType = keyType;
+        e->serialized = NULL;
+        e->next = ticketCache;
+        ticketCache = e;
+    }
+    Py_XDECREF(e->serialized);
+    e->serialized = serialized;
+    e->ticketAndKey.CopyFrom(*ticketAndKey);
+    e->expiryTime = ticketAndKey->expirytime();
+    e->ticketFileMtime = ticketFileMtime;
+
+    return e;
+}
+
 static PyObject*
 GetTicketAndKeyForClusterInternal(PyObject* self, PyObject* args)
 {
     char* clusterName;
-	int keyType;
+    int keyType;
     if (!PyArg_ParseTuple(args, "si", &clusterName, &keyType))
         return NULL;
 
     int err = 0;
-
     mapr::fs::TicketAndKey ticketAndKey;
-    mapr::fs::Security *security = mapr::fs::Security::GetSecurityInstance();
 
-    err = security->GetTicketAndKeyForCluster((mapr::fs::ServerKeyType) keyType, clusterName, &ticketAndKey);
+    TicketCacheEntry *e = FetchTicketCacheEntry(clusterName, keyType, &ticketAndKey, &err);
+    if (e) {
+        Py_INCREF(e->serialized);
+        return e->serialized;
+    }
+    if (!err)
+        return NULL;
+
     int bufSize = ticketAndKey.ByteSize();
-    uint8_t *serializedBuf = new uint8_t[bufSize];
+    PyObject *serialized = PyString_FromStringAndSize(NULL, bufSize);
+    if (!serialized)
+        return NULL;
+    ticketAndKey.SerializeToArray(PyString_AS_STRING(serialized), bufSize);
 
-    err = ticketAndKey.SerializeToArray(serializedBuf, bufSize);
+    return serialized;
+}
+
+static PyObject*
+GetTicketCacheStats(PyObject* self, PyObject* args)
+{
+    int entries = 0;
+    for (TicketCacheEntry *e = ticketCache; e; e = e->next)
+        ++entries;
+
+    return Py_BuildValue("{s:K,s:K,s:i}",
+                         "hits", ticketCacheHits,
+                         "misses", ticketCacheMisses,
+                         "entries", entries);
+}
 
-    return Py_BuildValue("s#", serializedBuf, bufSize);
+static PyObject*
+ClearTicketCache(PyObject* self, PyObject* args)
+{
+    while (ticketCache) {
+        TicketCacheEntry *e = ticketCache;
+        ticketCache = e->next;
+        Py_XDECREF(e->serialized);
+        free(e->clusterName);
+        delete e;
+    }
+    Py_RETURN_NONE;
 }
 
 static PyObject*
@@ -55,64 +198,359 @@ GenerateRandomNumber(PyObject* self, PyObject* args)
     return Py_BuildValue("l", security->GenerateRandomNumber());
 }
 
+static const char base64Chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void
+Base64Encode(const std::string &in, std::string *out)
+{
+    const uint8_t *p = (const uint8_t *) in.data();
+    size_t len = in.size();
+
+    out->resize(4 * ((len + 2) / 3));
+    if (out->empty())
+        return;
+    char *o = &(*out)[0];
+
+    for (; len >= 3; len -= 3, p += 3) {
+        *o++ = base64Chars[p[0] >> 2];
+        *o++ = base64Chars[((p[0] & 0x03) << 4) | (p[1] >> 4)];
+        *o++ = base64Chars[((p[1] & 0x0f) << 2) | (p[2] >> 6)];
+        *o++ = base64Chars[p[2] & 0x3f];
+    }
+    if (len) {
+        *o++ = base64Chars[p[0] >> 2];
+        if (len == 1) {
+            *o++ = base64Chars[(p[0] & 0x03) << 4];
+            *o++ = '=';
+        } else {
+            *o++ = base64Chars[((p[0] & 0x03) << 4) | (p[1] >> 4)];
+            *o++ = base64Chars[(p[1] & 0x0f) << 2];
+        }
+        *o++ = '=';
+    }
+}
+
+/*
+ * Builds one base64 encoded AuthenticationReqFull: a fresh random
+ * challenge (big endian, as the server reads it) encrypted with the
+ * user key, plus the encrypted ticket. Does not touch Python objects,
+ * so it may run with the GIL released.
+ */
+static int
+BuildAuthRequest(mapr::fs::Security *security,
+                 const std::string &userKey,
+                 const std::string &encryptedTicket,
+                 std::string *authRequest, uint64_t *randomNumber)
+{
+    uint64_t challenge = security->GenerateRandomNumber();
+    uint8_t challengeBuf[sizeof(challenge)];
+    for (size_t i = 0; i < sizeof(challenge); ++i)
+        challengeBuf[i] = (uint8_t) (challenge >> (8 * (sizeof(challenge) - 1 - i)));
+
+    std::string encrypted;
+    encrypted.resize(security->GetEncryptedSize(sizeof(challengeBuf)));
+    int encryptedLen = (int) encrypted.size();
+
+    int err = security->Encrypt((const uint8_t *) userKey.data(), (int) userKey.size(),
+                                challengeBuf, sizeof(challengeBuf),
+                                (uint8_t *) &encrypted[0], encryptedLen, &encryptedLen);
+    if (err)
+        return err;
+
+    mapr::fs::AuthenticationReqFull req;
+    req.set_encryptedrandomsecret(encrypted.data(), encryptedLen);
+    req.set_encryptedticket(encryptedTicket);
+
+    std::string serialized;
+    req.SerializeToString(&serialized);
+    Base64Encode(serialized, authRequest);
+    *randomNumber = challenge;
+    return 0;
+}
+
+/*
+ * Builds count authentication requests for (clusterName, keyType) and
+ * returns them as a list of (authRequest, randomNumber, userKey) tuples.
+ * authRequest is what MaprSasl sends as its initial response, the other
+ * two are needed to check the server's reply in MaprSasl.step.
+ */
 static PyObject*
-Decrypt(PyObject* self, PyObject* args)
+BuildAuthenticationReqs(const char *clusterName, int keyType, int count)
 {
- uint8_t* keyBase;
- uint8_t* data;
- int dataLen;
- int keyLen;
+    int err = 0;
+    mapr::fs::TicketAndKey ticketAndKey;
 
- if (!PyArg_ParseTuple(args, "s#s#", &keyBase, &keyLen, &data, &dataLen))
+    TicketCacheEntry *e = FetchTicketCacheEntry(clusterName, keyType, &ticketAndKey, &err);
+    if (!e) {
+        if (err) {
+            errno = err;
+            PyErr_SetFromErrno(PyExc_IOError);
+        }
         return NULL;
- 
-    mapr::fs::Security *security = mapr::fs::Security::GetSecurityInstance();
+    }
 
-  int maxDecryptedSize = security->GetDecryptedSize(dataLen);
+    // Copy out what we need, the entry may be replaced once the GIL is dropped.
+    std::string userKey = e->ticketAndKey.userkey().key();
+    std::string encryptedTicket = e->ticketAndKey.encryptedticket();
 
-  uint8_t *decryptedData = new uint8_t[maxDecryptedSize];
-  int decryptedDataLen = maxDecryptedSize;
+    mapr::fs::Security *security = mapr::fs::Security::GetSecurityInstance();
+    std::vector<std::string> authRequests(count);
+    std::vector<uint64_t> randomNumbers(count);
+
+    Py_BEGIN_ALLOW_THREADS
+    for (int i = 0; i < count && !err; ++i) {
+        err = BuildAuthRequest(security, userKey, encryptedTicket,
+                               &authRequests[i], &randomNumbers[i]);
+    }
+    Py_END_ALLOW_THREADS
+
+    if (err) {
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_IOError);
+    }
+
+    PyObject *list = PyList_New(count);
+    if (!list)
+        return NULL;
+    for (int i = 0; i < count; ++i) {
+        PyObject *item = Py_BuildValue("(s#Ks#)",
+                                       authRequests[i].data(), (int) authRequests[i].size(),
+                                       (unsigned long long) randomNumbers[i],
+                                       userKey.data(), (int) userKey.size());
+        if (!item) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    return list;
+}
 
-    int err = security->Decrypt(keyBase, keyLen, data, dataLen, decryptedData, decryptedDataLen, &decryptedDataLen);
+static PyObject*
+BuildAuthenticationReqFull(PyObject* self, PyObject* args)
+{
+    char* clusterName;
+    int keyType;
+    if (!PyArg_ParseTuple(args, "si", &clusterName, &keyType))
+        return NULL;
 
-      assert(err || (decryptedDataLen == maxDecryptedSize));
+    PyObject *list = BuildAuthenticationReqs(clusterName, keyType, 1);
+    if (!list)
+        return NULL;
 
-    return Py_BuildValue("s#", decryptedData, decryptedDataLen);
+    PyObject *item = PyList_GET_ITEM(list, 0);
+    Py_INCREF(item);
+    Py_DECREF(list);
+    return item;
 }
 
+static PyObject*
+BuildAuthenticationReqFullBatch(PyObject* self, PyObject* args)
+{
+    char* clusterName;
+    int keyType;
+    int count;
+    if (!PyArg_ParseTuple(args, "sii", &clusterName, &keyType, &count))
+        return NULL;
 
+    if (count < 0) {
+        PyErr_SetString(PyExc_ValueError, "count must not be negative");
+        return NULL;
+    }
+
+    return BuildAuthenticationReqs(clusterName, keyType, count);
+}
+
+/*
+ * Common body of Encrypt and Decrypt. Key and data may be any object
+ * supporting the buffer protocol. The result is written directly into a
+ * preallocated string, and the GIL is dropped while the cipher runs so
+ * that concurrent Thrift connections are not serialized on it.
+ */
 static PyObject*
-Encrypt(PyObject* self, PyObject* args)
+EncryptDecryptCommon(PyObject* args, bool isEncrypt)
 {
- uint8_t* keyBase;
- uint8_t* data;
- int dataLen;
- int keyLen;
+    Py_buffer key;
+    Py_buffer data;
 
- if (!PyArg_ParseTuple(args, "s#s#", &keyBase, &keyLen, &data, &dataLen))
+    if (!PyArg_ParseTuple(args, "s*s*", &key, &data))
         return NULL;
 
     mapr::fs::Security *security = mapr::fs::Security::GetSecurityInstance();
 
-  int maxEncryptedSize = security->GetEncryptedSize(dataLen);
+    int dataLen = (int) data.len;
+    int maxOutLen = isEncrypt ? security->GetEncryptedSize(dataLen)
+                              : security->GetDecryptedSize(dataLen);
+    if (maxOutLen < 0) {
+        PyBuffer_Release(&key);
+        PyBuffer_Release(&data);
+        PyErr_SetString(PyExc_ValueError, "data is too short");
+        return NULL;
+    }
 
-  uint8_t *encryptedData = new uint8_t[maxEncryptedSize];
-  int encryptedDataLen = maxEncryptedSize;
+    PyObject *out = PyString_FromStringAndSize(NULL, maxOutLen);
+    if (!out) {
+        PyBuffer_Release(&key);
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+
+    const uint8_t *keyBuf = (const uint8_t *) key.buf;
+    int keyLen = (int) key.len;
+    const uint8_t *dataBuf = (const uint8_t *) data.buf;
+    uint8_t *outBuf = (uint8_t *) PyString_AS_STRING(out);
+    int outLen = maxOutLen;
+    int err;
+
+    Py_BEGIN_ALLOW_THREADS
+    if (isEncrypt) {
+        err = security->Encrypt(keyBuf, keyLen, dataBuf, dataLen,
+                                outBuf, maxOutLen, &outLen);
+    } else {
+        err = security->Decrypt(keyBuf, keyLen, dataBuf, dataLen,
+                                outBuf, maxOutLen, &outLen);
+    }
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&key);
+    PyBuffer_Release(&data);
+
+    if (err) {
+        Py_DECREF(out);
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_IOError);
+    }
+
+    if (outLen != maxOutLen && _PyString_Resize(&out, outLen))
+        return NULL;
 
-    int err = security->Encrypt(keyBase, keyLen, data, dataLen, encryptedData, encryptedDataLen, &encryptedDataLen);
+    return out;
+}
+
+static PyObject*
+Decrypt(PyObject* self, PyObject* args)
+{
+    return EncryptDecryptCommon(args, false /*isEncrypt*/);
+}
+
+static PyObject*
+Encrypt(PyObject* self, PyObject* args)
+{
+    return EncryptDecryptCommon(args, true /*isEncrypt*/);
+}
 
-      assert(err || (encryptedDataLen == maxEncryptedSize));
+/*
+ * Scatter/gather variant of EncryptDecryptCommon. Takes the key and a
+ * sequence of buffer-protocol objects and returns a single result
+ * string, so callers holding a multi-part frame do not have to join it
+ * first.
+ */
+static PyObject*
+EncryptDecryptVCommon(PyObject* args, bool isEncrypt)
+{
+    Py_buffer key;
+    PyObject *parts;
+
+    if (!PyArg_ParseTuple(args, "s*O", &key, &parts))
+        return NULL;
 
-    return Py_BuildValue("s#", encryptedData, encryptedDataLen);
+    PyObject *seq = PySequence_Fast(parts, "expected a sequence of buffers");
+    if (!seq) {
+        PyBuffer_Release(&key);
+        return NULL;
+    }
+
+    int nparts = (int) PySequence_Fast_GET_SIZE(seq);
+    Py_buffer *views = new Py_buffer[nparts];
+    struct iovec *inIov = new struct iovec[nparts];
+    int nviews = 0;
+    int dataLen = 0;
+    PyObject *out = NULL;
+
+    for (; nviews < nparts; ++nviews) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, nviews);
+        if (!PyArg_Parse(item, "s*", &views[nviews]))
+            goto done;
+        inIov[nviews].iov_base = views[nviews].buf;
+        inIov[nviews].iov_len = views[nviews].len;
+        dataLen += (int) views[nviews].len;
+    }
+
+    {
+        mapr::fs::Security *security = mapr::fs::Security::GetSecurityInstance();
+
+        int maxOutLen = isEncrypt ? security->GetEncryptedSize(dataLen)
+                                  : security->GetDecryptedSize(dataLen);
+        if (maxOutLen < 0) {
+            PyErr_SetString(PyExc_ValueError, "data is too short");
+            goto done;
+        }
+
+        out = PyString_FromStringAndSize(NULL, maxOutLen);
+        if (!out)
+            goto done;
+
+        const uint8_t *keyBuf = (const uint8_t *) key.buf;
+        int keyLen = (int) key.len;
+        struct iovec outIov;
+        outIov.iov_base = PyString_AS_STRING(out);
+        outIov.iov_len = maxOutLen;
+        int outLen = maxOutLen;
+        int err;
+
+        Py_BEGIN_ALLOW_THREADS
+        if (isEncrypt) {
+            err = security->Encrypt(keyBuf, keyLen, inIov, nparts,
+                                    &outIov, 1, &outLen);
+        } else {
+            err = security->Decrypt(keyBuf, keyLen, inIov, nparts,
+                                    &outIov, 1, &outLen);
+        }
+        Py_END_ALLOW_THREADS
+
+        if (err) {
+            Py_CLEAR(out);
+            errno = err;
+            PyErr_SetFromErrno(PyExc_IOError);
+        } else if (outLen != maxOutLen && _PyString_Resize(&out, outLen)) {
+            out = NULL;
+        }
+    }
+
+done:
+    for (int i = 0; i < nviews; ++i)
+        PyBuffer_Release(&views[i]);
+    delete [] views;
+    delete [] inIov;
+    Py_DECREF(seq);
+    PyBuffer_Release(&key);
+    return out;
 }
 
+static PyObject*
+DecryptV(PyObject* self, PyObject* args)
+{
+    return EncryptDecryptVCommon(args, false /*isEncrypt*/);
+}
 
+static PyObject*
+EncryptV(PyObject* self, PyObject* args)
+{
+    return EncryptDecryptVCommon(args, true /*isEncrypt*/);
+}
 
 static PyMethodDef SecurityMethods[] = {
     {"GetTicketAndKeyForClusterInternal", GetTicketAndKeyForClusterInternal, METH_VARARGS, "SECURITY."},
+    {"GetTicketCacheStats", GetTicketCacheStats, METH_NOARGS, "Hit/miss counters of the TicketAndKey cache."},
+    {"ClearTicketCache", ClearTicketCache, METH_NOARGS, "Drop all cached TicketAndKey entries."},
     {"GenerateRandomNumber", GenerateRandomNumber, METH_VARARGS, "SECURITY."},
+    {"BuildAuthenticationReqFull", BuildAuthenticationReqFull, METH_VARARGS, "Build a base64 AuthenticationReqFull; returns (request, randomNumber, userKey)."},
+    {"BuildAuthenticationReqFullBatch", BuildAuthenticationReqFullBatch, METH_VARARGS, "Build a list of BuildAuthenticationReqFull results."},
     {"Encrypt", Encrypt, METH_VARARGS, "SECURITY."},
     {"Decrypt", Decrypt, METH_VARARGS, "SECURITY."},
+    {"EncryptV", EncryptV, METH_VARARGS, "Encrypt a sequence of buffers into one ciphertext."},
+    {"DecryptV", DecryptV, METH_VARARGS, "Decrypt a sequence of buffers into one plaintext."},
     {NULL, NULL, 0, NULL}
 };
 